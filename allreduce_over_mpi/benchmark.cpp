@@ -35,7 +35,8 @@ int main(int argc, char **argv)
     // 命令行参数
     int repeat = 1;
     double sum_time = 0, min_time = INF;
-    int comm_type = 0; // 0 for tree, 1 for ring, 2 for mpi
+    int comm_type = 0; // 0 for tree, 1 for ring, 2 for mpi, 3 for deterministic, 4 for persistent, 5 for fusion, 6 for grouped
+    size_t num_tensors = 64; // fusion 和 group 模式下把数据切成多少个张量
     bool to_file = false;
     size_t data_len = 35;
     std::string tag;
@@ -52,7 +53,11 @@ int main(int argc, char **argv)
     node_label = tmp;
     // end init
 
-    auto topo = FlexTree::get_stages(total_peers);
+    // 不规则的树没有统一的各层宽度, 直接打印 FT_TOPO
+    const std::string topo_string = FlexTree::topo_string();
+    const bool irregular = FlexTree::is_irregular_topo(topo_string);
+    std::vector<size_t> topo;
+    if (!irregular) topo = FlexTree::get_stages(total_peers, &num_lonely);
 
     // init glog
     FLAGS_colorlogtostderr = true;
@@ -96,6 +101,30 @@ int main(int argc, char **argv)
             {
                 comm_type = 0;
             }
+            else if (strcmp(argv[i], "deterministic") == 0)
+            {
+                comm_type = 3;
+            }
+            else if (strcmp(argv[i], "persistent") == 0)
+            {
+                comm_type = 4;
+            }
+            else if (strcmp(argv[i], "fusion") == 0)
+            {
+                comm_type = 5;
+            }
+            else if (strcmp(argv[i], "group") == 0)
+            {
+                comm_type = 6;
+            }
+        }
+        else if (strcmp(argv[i], "--tensors") == 0)
+        {
+            i++;
+            CHECK_GE(argc, i);
+            std::istringstream ss(argv[i]);
+            ss >> num_tensors;
+            CHECK_GT(num_tensors, 0);
         }
         else if (strcmp(argv[i], "--tag") == 0)
         {
@@ -115,6 +144,9 @@ int main(int argc, char **argv)
         }
     }
 
+    // 没有设置 FT_TOPO 时各层宽度由代价模型按消息大小选择
+    if (!irregular && topo_string.empty()) topo = FlexTree::model_stages(total_peers, data_len * sizeof(float));
+
     // 初始化 data 和 buffer
     float *data = new float[data_len];
     for (size_t i = 0; i != data_len; i++)
@@ -130,14 +162,39 @@ int main(int argc, char **argv)
         std::ostringstream ss;
         ss << "configuration: \n  - total_peers: "<< total_peers << "\n  - data_size: " << data_len << "\n  - repeat: " << repeat << "\n  - to_file: " << (to_file ? "true":"false");
         if (to_file && !tag.empty()) ss << "\n  - file tag: " << tag;
-        ss << "\n  - communication method: " << (comm_type ? "mpi":"flextree");
-        if (comm_type == 0)
+        ss << "\n  - communication method: " << (comm_type == 2 ? "mpi" : (comm_type == 3 ? "flextree deterministic" : (comm_type == 4 ? "flextree persistent" : (comm_type == 5 ? "flextree fusion" : (comm_type == 6 ? "flextree grouped" : "flextree")))));
+        if (comm_type == 6)
+        {
+            ss << "\n  - tensors: " << num_tensors;
+        }
+        if (comm_type == 5)
         {
+            auto fusion_bytes = getenv("FT_FUSION_BYTES");
+            auto cycle = getenv("FT_FUSION_CYCLE_US");
+            ss << "\n  - tensors: " << num_tensors << ", fusion bytes: " << (fusion_bytes != nullptr ? fusion_bytes : "default") << ", cycle us: " << (cycle != nullptr ? cycle : "default");
+        }
+        auto algo = getenv("FT_ALGO");
+        if (comm_type != 2)
+        {
+            ss << "\n  - algorithm: " << (algo != nullptr && algo[0] != 0 ? algo : "tree");
+            // 单边传输只用于 tree 的 reduce 阶段, 和默认的双边传输对比
+            ss << "\n  - transport: " << (FlexTree::get_transport() == FlexTree::TRANSPORT_RMA ? "rma" : "p2p");
+            auto hier = getenv("FT_HIER");
+            if (hier != nullptr && strcmp(hier, "0") != 0 && comm_type == 0)
+            {
+                auto local_size = getenv("FT_HIER_LOCAL_SIZE");
+                ss << "\n  - hierarchical, ranks per node: " << (local_size != nullptr ? local_size : "shared memory");
+            }
             ss << "\n  - And FlexTree topo is ";
+            if (irregular) ss << topo_string << " ";
             for (auto i:topo)
             {
                 ss << i << " ";
             }
+            if (num_lonely > 0) ss << "+ " << num_lonely << " lonely";
+            // 设成比块还大的值就是不分段流水, 可以用来对比
+            auto segment_bytes = getenv("FT_SEGMENT_BYTES");
+            ss << "\n  - segment bytes: " << (segment_bytes != nullptr && strcmp(segment_bytes, "0") != 0 ? segment_bytes : "auto");
         }
         LOG(WARNING) << "\n" << ss.str();
     }
@@ -157,6 +214,14 @@ int main(int argc, char **argv)
             min_time = std::min(time2 - time1, min_time);
             LOG_IF(WARNING, node_label == 0) << "repeat " << i << " finished"; 
         }
+        size_t hits, misses;
+        FlexTree::plan_cache_stats(MPI_COMM_WORLD, hits, misses);
+        LOG_IF(WARNING, node_label == 0) << "plan cache: " << hits << " hits, " << misses << " misses";
+        // 按消息大小选择引擎时 (FT_SELECT=tune 或者 FT_SELECT_FILE) 打印选定的分界
+        for (const auto &r : FlexTree::selector_rules(MPI_COMM_WORLD))
+        {
+            LOG_IF(WARNING, node_label == 0) << "selector: up to " << (r.max_bytes == SIZE_MAX ? std::string("inf") : std::to_string(r.max_bytes)) << " bytes -> " << (r.engine.algo.empty() ? "tree" : r.engine.algo) << " " << r.engine.topo;
+        }
     }
     else if (comm_type == 2) //mpi
     {
@@ -172,6 +237,97 @@ int main(int argc, char **argv)
             LOG_IF(WARNING, node_label == 0) << "repeat " << i << " finished"; 
         }
     }
+    else if (comm_type == 3) // 确定性模式, 和 flextree 的时间对比就是它的额外开销
+    {
+        for (auto i = 0; i != repeat; i++)
+        {
+            MPI_Barrier(MPI_COMM_WORLD);
+            auto time1 = MPI_Wtime();
+            FlexTree::deterministic_sum(data, data, data_len, MPI_COMM_WORLD, nullptr);
+            auto time2 = MPI_Wtime();
+            repeat_time.push_back(time2 - time1);
+            sum_time += time2 - time1;
+            min_time = std::min(time2 - time1, min_time);
+            LOG_IF(WARNING, node_label == 0) << "repeat " << i << " finished"; 
+        }
+    }
+    else if (comm_type == 4) // 持久化的 plan, 准备工作只在 init 时做一次
+    {
+        FT_Request plan;
+        MPI_Allreduce_init_FT(MPI_IN_PLACE, data, data_len, MPI_FLOAT, MPI_SUM, MPI_COMM_WORLD, &plan);
+        for (auto i = 0; i != repeat; i++)
+        {
+            MPI_Barrier(MPI_COMM_WORLD);
+            auto time1 = MPI_Wtime();
+            MPI_Start_FT(&plan);
+            MPI_Wait_FT(&plan);
+            auto time2 = MPI_Wtime();
+            repeat_time.push_back(time2 - time1);
+            sum_time += time2 - time1;
+            min_time = std::min(time2 - time1, min_time);
+            LOG_IF(WARNING, node_label == 0) << "repeat " << i << " finished"; 
+        }
+        MPI_Request_free_FT(&plan);
+    }
+    else if (comm_type == 5) // 把数据切成 num_tensors 个张量, 融合之后的时间和逐个调用的时间对比
+    {
+        std::vector<size_t> offsets;
+        for (size_t t = 0; t <= num_tensors; t++)
+        {
+            offsets.push_back(data_len * t / num_tensors);
+        }
+        std::vector<FT_Fusion_Handle> handles(num_tensors);
+        double sum_unfused = 0;
+        for (auto i = 0; i != repeat; i++)
+        {
+            MPI_Barrier(MPI_COMM_WORLD);
+            auto time1 = MPI_Wtime();
+            for (size_t t = 0; t != num_tensors; t++)
+            {
+                MPI_Allreduce_enqueue_FT(MPI_IN_PLACE, data + offsets[t], offsets[t + 1] - offsets[t], MPI_FLOAT, MPI_SUM, MPI_COMM_WORLD, &handles[t]);
+            }
+            for (auto &h : handles)
+            {
+                MPI_Fusion_wait_FT(&h);
+            }
+            auto time2 = MPI_Wtime();
+            repeat_time.push_back(time2 - time1);
+            sum_time += time2 - time1;
+            min_time = std::min(time2 - time1, min_time);
+
+            MPI_Barrier(MPI_COMM_WORLD);
+            time1 = MPI_Wtime();
+            for (size_t t = 0; t != num_tensors; t++)
+            {
+                MPI_Allreduce_FT(MPI_IN_PLACE, data + offsets[t], offsets[t + 1] - offsets[t], MPI_FLOAT, MPI_SUM, MPI_COMM_WORLD);
+            }
+            time2 = MPI_Wtime();
+            sum_unfused += time2 - time1;
+            LOG_IF(WARNING, node_label == 0) << "repeat " << i << " finished"; 
+        }
+        size_t tensors, batches;
+        FlexTree::fusion_stats(MPI_COMM_WORLD, tensors, batches);
+        LOG_IF(WARNING, node_label == 0) << "fusion: " << tensors << " tensors in " << batches << " allreduces, unfused average time: " << sum_unfused / repeat << ", speedup: " << sum_unfused / sum_time;
+    }
+    else if (comm_type == 6) // 同样切成 num_tensors 片, 用分组的 allreduce 一次做完, 和 fusion 模式对比就是省掉的拷贝
+    {
+        std::vector<FT_Iovec> iov;
+        for (size_t t = 0; t != num_tensors; t++)
+        {
+            iov.push_back(FT_Iovec{data + data_len * t / num_tensors, data_len * (t + 1) / num_tensors - data_len * t / num_tensors});
+        }
+        for (auto i = 0; i != repeat; i++)
+        {
+            MPI_Barrier(MPI_COMM_WORLD);
+            auto time1 = MPI_Wtime();
+            MPI_Allreduce_group_FT(nullptr, iov.data(), num_tensors, MPI_FLOAT, MPI_SUM, MPI_COMM_WORLD);
+            auto time2 = MPI_Wtime();
+            repeat_time.push_back(time2 - time1);
+            sum_time += time2 - time1;
+            min_time = std::min(time2 - time1, min_time);
+            LOG_IF(WARNING, node_label == 0) << "repeat " << i << " finished"; 
+        }
+    }
     else 
     {
         LOG(FATAL) << "unknown comm type: " << comm_type;
@@ -196,12 +352,20 @@ int main(int argc, char **argv)
         std::ostringstream ss;
         if (!tag.empty()) ss << tag << ".";
         ss << total_peers << "." << data_len << ".";
-        if (comm_type == 0)
+        if (comm_type != 2)
         {
+            auto algo = getenv("FT_ALGO");
+            if (algo != nullptr && algo[0] != 0) ss << algo << "-";
+            if (FlexTree::get_transport() == FlexTree::TRANSPORT_RMA) ss << "rma-";
+            if (irregular) ss << "irregular-";
             for (auto i : topo)
             {
                 ss << i << "-";
             }
+            if (comm_type == 3) ss << "det";
+            if (comm_type == 4) ss << "persistent";
+            if (comm_type == 5) ss << "fusion" << num_tensors;
+            if (comm_type == 6) ss << "group" << num_tensors;
         }
         else
         {
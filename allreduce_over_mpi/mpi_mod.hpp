@@ -5,7 +5,7 @@
 #if defined(c_plusplus) || defined(__cplusplus)
 #include<iostream>
 
-static int FT_enabled()
+static inline int FT_enabled()
 {
     std::cout << "FlexTree enabled";
     return 0;
@@ -17,6 +17,27 @@ static int FT_enabled()
 #include<string.h>
 #include<thread>
 #include<stdlib.h>
+#include<algorithm>
+#include<memory>
+#include<list>
+#include<map>
+#include<cctype>
+#include<cmath>
+#include<limits>
+#include<type_traits>
+#include<stdint.h>
+#include<unistd.h>
+#include<atomic>
+#include<mutex>
+#include<condition_variable>
+#include<functional>
+#include<sched.h>
+#include<pthread.h>
+#include<sys/mman.h>
+#include "../cost_model/cost_model.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#endif
 #ifdef STANDALONE_TEST
 #include<mpi.h>
 #include<glog/logging.h>
@@ -38,7 +59,7 @@ double _time_base;
 #endif
 // end of LOG 控制
 
-static bool comm_only = false;
+static bool comm_only __attribute__((unused)) = false;
 static void *recv_buffer = nullptr; //必须初始化
 
 // Op
@@ -74,6 +95,209 @@ public:
     }
 };
 
+/**
+ * 不规则的树: 同一层的各个组可以有不同的宽度, 比如 9 台 16 核和 7 台 28 核的机器.
+ * 写法 (FT_TOPO 或者 FT_TOPO_FILE 指定的文件): 一个组是 [项, 项, ...], 项是一个数字 n (n 个节点组成的叶子组) 或者一个组,
+ * 后面可以跟 xk 表示重复 k 次. 例如 [16x9,28x7] 是 9 个 16 节点的组和 7 个 28 节点的组, 两层;
+ * [[4x4]x9,[4x7]x7] 把每台机器再分成 4 组, 三层. 所有叶子必须在同一层, 节点按先后顺序编号.
+ * 
+ * 块的划分: 数据分成 num_nodes 块, 根上第 b 块由节点 b 负责. 从上往下, 父组 P 负责第 b 块的节点 x 如果在子组 C 中,
+ * 那么 C 里也由 x 负责; 否则由 C 里和 x 配对的节点 C.begin + (x - P.begin) % C.size 负责.
+ * 这样每个节点在叶子组里负责的块数和组的宽度成反比 (按组的大小加权), 并且同一个 stage 里, 一个节点负责的所有块
+ * 在各个子组中都是由同一个节点负责的, 收发仍然可以写成 Send_Ops/Recv_Ops 的形式.
+ */
+class Irregular_Topo
+{
+public:
+    struct Group
+    {
+        size_t begin, size, parent;
+        std::vector<size_t> children; // 子组的下标, 叶子组为空 (它的孩子就是各个节点)
+    };
+    std::vector<Group> groups; // groups[0] 是根
+    size_t num_nodes, depth;   // depth 是 stage 数
+
+    Irregular_Topo(const std::string &topo, const size_t &_num_nodes): num_nodes(_num_nodes), depth(0)
+    {
+        std::string text;
+        for (char c : topo)
+        {
+            if (!isspace((unsigned char)c)) text.push_back(c);
+        }
+        size_t pos = 0, next = 0;
+        groups.push_back(Group{0, 0, 0, {}});
+        parse_group(text, pos, 0, next);
+        if (pos != text.size())
+        {
+            std::cerr << "invalid FT_TOPO " << topo << ": unexpected '" << text.substr(pos) << "'" << std::endl;
+            exit(1);
+        }
+        if (next != num_nodes)
+        {
+            std::cerr << "invalid FT_TOPO " << topo << ": expect " << num_nodes << " nodes" << std::endl;
+            exit(1);
+        }
+        // 所有叶子的深度相同
+        size_t leaf_depth = SIZE_MAX;
+        for (size_t g = 0; g < groups.size(); g++)
+        {
+            if (!groups[g].children.empty()) continue;
+            size_t d = 1;
+            for (size_t p = g; p != 0; p = groups[p].parent) d++;
+            if (leaf_depth != SIZE_MAX && d != leaf_depth)
+            {
+                std::cerr << "invalid FT_TOPO " << topo << ": all leaves must be at the same depth" << std::endl;
+                exit(1);
+            }
+            leaf_depth = d;
+        }
+        depth = leaf_depth;
+    }
+    // 第 i 个 stage 中 node 所在的组, stage 0 是叶子组
+    size_t group_at(const size_t &node, const size_t &stage) const
+    {
+        size_t g = 0;
+        while (!groups[g].children.empty())
+        {
+            for (auto c : groups[g].children)
+            {
+                if (contains(c, node))
+                {
+                    g = c;
+                    break;
+                }
+            }
+        }
+        for (size_t i = 0; i < stage; i++)
+        {
+            g = groups[g].parent;
+        }
+        return g;
+    }
+    // 组 g 中负责第 block 块的节点
+    size_t owner(const size_t &g, const size_t &block) const
+    {
+        if (g == 0) return block;
+        const Group &group = groups[g];
+        const size_t x = owner(group.parent, block);
+        if (contains(g, x)) return x;
+        return group.begin + (x - groups[group.parent].begin) % group.size;
+    }
+    // 第 i 个 stage 结束后 node 负责的块, 从小到大
+    std::vector<size_t> owned_blocks(const size_t &node, const size_t &stage) const
+    {
+        const size_t g = group_at(node, stage);
+        std::vector<size_t> blocks;
+        for (size_t b = 0; b < num_nodes; b++)
+        {
+            if (owner(g, b) == node) blocks.push_back(b);
+        }
+        return blocks;
+    }
+    // 每个 stage 中 node 所在的组有几个孩子, 作为这个节点的 stages
+    std::vector<size_t> widths(const size_t &node) const
+    {
+        std::vector<size_t> ans;
+        for (size_t i = 0; i < depth; i++)
+        {
+            const Group &group = groups[group_at(node, i)];
+            ans.push_back(i == 0 ? group.size : group.children.size());
+        }
+        return ans;
+    }
+    // node 在各个 stage 平铺接收的块数的最大值, 用来确定接收缓冲区每个 stage 的大小
+    size_t max_recv_blocks(const size_t &node) const
+    {
+        size_t ans = 0;
+        const std::vector<size_t> w = widths(node);
+        for (size_t i = 0; i < depth; i++)
+        {
+            ans = std::max(ans, (w[i] - 1) * owned_blocks(node, i).size());
+        }
+        return ans;
+    }
+    // node 的接收缓冲区中每个 stage 占用的元素个数 (见 FlexTree_Context::stage_size), 各个节点不一样
+    size_t stage_size(const size_t &node, const size_t &split_size) const
+    {
+        return std::max(num_nodes, max_recv_blocks(node)) * split_size;
+    }
+    bool contains(const size_t &g, const size_t &node) const
+    {
+        return node >= groups[g].begin && node < groups[g].begin + groups[g].size;
+    }
+private:
+    static size_t parse_number(const std::string &text, size_t &pos)
+    {
+        size_t n = 0, start = pos;
+        while (pos < text.size() && isdigit((unsigned char)text[pos]))
+        {
+            n = n * 10 + (text[pos++] - '0');
+        }
+        if (pos == start || n == 0)
+        {
+            std::cerr << "invalid FT_TOPO " << text << ": expect a positive number at " << start << std::endl;
+            exit(1);
+        }
+        return n;
+    }
+    // 解析从 pos 开始的一项 (一个数字或者一个组), 作为组 g 的下一个孩子. next 是下一个节点的编号
+    void parse_item(const std::string &text, size_t &pos, const size_t &g, size_t &next)
+    {
+        const size_t child = groups.size();
+        groups.push_back(Group{next, 0, g, {}});
+        groups[g].children.push_back(child);
+        if (pos < text.size() && text[pos] == '[')
+        {
+            parse_group(text, pos, child, next);
+        }
+        else
+        {
+            groups[child].size = parse_number(text, pos);
+            next += groups[child].size;
+        }
+    }
+    // 解析从 pos 开始的 [...] 到组 g 中
+    void parse_group(const std::string &text, size_t &pos, const size_t &g, size_t &next)
+    {
+        groups[g].begin = next;
+        if (pos >= text.size() || text[pos] != '[')
+        {
+            std::cerr << "invalid FT_TOPO " << text << ": expect '[' at " << pos << std::endl;
+            exit(1);
+        }
+        pos++;
+        while (true)
+        {
+            const size_t item = pos;
+            parse_item(text, pos, g, next);
+            if (pos < text.size() && text[pos] == 'x')
+            {
+                pos++;
+                const size_t repeat = parse_number(text, pos);
+                // 重复的几次从这一项的开头重新解析, 节点编号接着往后排
+                for (size_t k = 1; k < repeat; k++)
+                {
+                    size_t again = item;
+                    parse_item(text, again, g, next);
+                }
+            }
+            if (pos < text.size() && text[pos] == ',')
+            {
+                pos++;
+                continue;
+            }
+            if (pos < text.size() && text[pos] == ']')
+            {
+                pos++;
+                break;
+            }
+            std::cerr << "invalid FT_TOPO " << text << ": unexpected character at " << pos << std::endl;
+            exit(1);
+        }
+        groups[g].size = next - groups[g].begin;
+    }
+};
+
 // lonely 的意思是: 被树孤立的. 在 ar 过程中, lonely 节点的数据会不按照 stages 来进行, 而是与树的 ar 过程同步并行.
 // 为什么不在构造时直接使用 ft_ctx: 因为 ft_ctx 是与 mpi 强耦合的一个东西, 但是 operations 以及拓扑的生成应当只和所需要的这三个参数有关系, 不要和 mpi 扯上关系.
 class Operations
@@ -81,6 +305,8 @@ class Operations
 public:
     std::vector<size_t> stages;
     size_t total_peers, node_label, num_lonely, num_split;
+    // 不规则的树, 为 null 时是 stages 描述的规则的树. 只在 generate_ops 中使用
+    const Irregular_Topo *topo;
 public:
     std::vector<std::vector<Operation>> ops;
     std::vector<Operation> lonely_ops;
@@ -91,8 +317,9 @@ public:
      * @param _node_label 当前节点的编号
      * @param _stages 一个向量, 记录了 AllReduce 树自下而上每一层的宽度. 注意积 + {@code _num_lonely} 应当等于 {@code _total_peers}.
      * @param _num_lonely 孤立节点的数量
+     * @param _topo 不规则的树, 这时 {@code _stages} 只用来确定 stage 数
      */ 
-    Operations(const size_t &_total_peers, const size_t &_num_lonely, const size_t &_node_label, const std::vector<size_t> &_stages): total_peers(_total_peers), node_label(_node_label), stages(_stages), num_lonely(_num_lonely), num_split(_total_peers - _num_lonely)
+    Operations(const size_t &_total_peers, const size_t &_num_lonely, const size_t &_node_label, const std::vector<size_t> &_stages, const Irregular_Topo *_topo = nullptr): stages(_stages), total_peers(_total_peers), node_label(_node_label), num_lonely(_num_lonely), num_split(_total_peers - _num_lonely), topo(_topo)
     {
 
         size_t pi = 1;
@@ -151,6 +378,11 @@ public:
     // 生成逻辑拓扑
     virtual void generate_ops()
     {
+        if (topo != nullptr)
+        {
+            generate_irregular();
+            return;
+        }
         if (node_label < num_split)
         {
             // 当前组内成员的编号的间距
@@ -177,6 +409,37 @@ public:
             }
         }
     }
+private:
+    // 第 i 个 stage 把上一个 stage 负责的块 (第 0 个 stage 是全部) 发给它们在这一层的负责人, 同一个负责人的块按编号从小到大发送
+    void generate_irregular()
+    {
+        std::vector<size_t> held;
+        for (size_t b = 0; b < total_peers; b++)
+        {
+            held.push_back(b);
+        }
+        for (size_t i = 0; i < topo->depth; i++)
+        {
+            const size_t g = topo->group_at(node_label, i);
+            std::vector<Operation> stage_ops;
+            std::map<size_t, size_t> index;
+            for (auto b : held)
+            {
+                const size_t peer = topo->owner(g, b);
+                auto r = index.emplace(peer, stage_ops.size());
+                if (r.second)
+                {
+                    stage_ops.emplace_back(peer, b);
+                }
+                else
+                {
+                    stage_ops[r.first->second].blocks.push_back(b);
+                }
+            }
+            ops.push_back(stage_ops);
+            held = topo->owned_blocks(node_label, i);
+        }
+    }
 };
 
 class Recv_Ops: public Operations
@@ -186,6 +449,11 @@ public:
     // 生成逻辑拓扑
     virtual void generate_ops()
     {
+        if (topo != nullptr)
+        {
+            generate_irregular();
+            return;
+        }
         if (node_label < num_split)
         {
             // 当前组内成员的编号的间距
@@ -211,13 +479,46 @@ public:
             }
         }
     }
+private:
+    // 第 i 个 stage 从每个子组 (第 0 个 stage 是组里的每个节点) 收齐自己负责的块. 这些块在同一个子组里都由同一个节点负责 (见 Irregular_Topo)
+    void generate_irregular()
+    {
+        for (size_t i = 0; i < topo->depth; i++)
+        {
+            const size_t g = topo->group_at(node_label, i);
+            const auto &group = topo->groups[g];
+            Operation op_template(node_label, 0, 1);
+            op_template.blocks = topo->owned_blocks(node_label, i);
+            std::vector<Operation> stage_ops;
+            if (i == 0)
+            {
+                for (size_t j = group.begin; j < group.begin + group.size; j++)
+                {
+                    op_template.peer = j;
+                    stage_ops.push_back(op_template);
+                }
+            }
+            else
+            {
+                for (auto c : group.children)
+                {
+                    op_template.peer = (topo->contains(c, node_label) ? node_label : topo->owner(c, op_template.blocks[0]));
+                    stage_ops.push_back(op_template);
+                }
+            }
+            ops.push_back(stage_ops);
+        }
+    }
 };
 
 class FlexTree_Context
 {
 public:
-    size_t num_nodes, node_label, num_lonely, data_size, num_split, split_size, data_size_aligned, type_size;
-    bool has_lonely;
+    size_t num_nodes, node_label, num_lonely, data_size, num_split, split_size, data_size_aligned, type_size, type_extent;
+    // 接收缓冲区里每个 stage 占用的元素个数. 规则的树每个 stage 收到的块不会超过 num_split 块, 不规则的树可能更多 (见 Irregular_Topo)
+    size_t stage_size;
+    MPI_Aint type_true_lb, type_true_extent;
+    bool has_lonely, type_dense;
     FlexTree_Context(const MPI_Comm &_comm, const MPI_Datatype &_datatype, const size_t &_count, const size_t &_num_lonely = 0)
     {
         int tmp;
@@ -228,996 +529,5454 @@ public:
         num_lonely = _num_lonely;
         data_size = _count;
         num_split = num_nodes - num_lonely;
-        split_size = (data_size + num_nodes - 1) / num_nodes; // aligned
-        data_size_aligned = split_size * num_nodes;
+        // 数据只分给树里的 num_split 个节点, 孤立节点把整份数据交给它们
+        split_size = (data_size + num_split - 1) / num_split; // aligned
+        data_size_aligned = split_size * num_split;
+        stage_size = data_size_aligned;
         MPI_Type_size(_datatype, &tmp);
         type_size = tmp;
+        // 偏移量要按 extent 算: MPI_DOUBLE_INT 这种 (值, 下标) 类型在内存里有对齐填充, extent 比 size 大
+        MPI_Aint lb, extent;
+        MPI_Type_get_extent(_datatype, &lb, &extent);
+        type_extent = extent;
+        // 派生类型的数据可能不连续, 也可能不从 0 开始. type_dense 为 true 时才可以直接 memcpy
+        MPI_Type_get_true_extent(_datatype, &type_true_lb, &type_true_extent);
+        type_dense = (type_size == type_extent && type_true_lb == 0 && (size_t)type_true_extent == type_extent);
         //last_split_size = split_size - (data_size_aligned - data_size);
         // 为什么不能用 last_split_size 呢? 是因为最后一块大小可能为 0, 而且有可能倒数好几块都是 0!!! 为了对齐, 付出的代价可能是好几块. 比如说 10 个节点同步一个大小为 1 的数据块, 当然十块有九块都是空了.
         has_lonely = (num_lonely > 0);
     }
+    // 存放 n 个元素的缓冲区中, 第一个元素之前需要留出的字节数 (true_lb < 0 的派生类型)
+    size_t buffer_front() const
+    {
+        return type_true_lb < 0 ? -type_true_lb : 0;
+    }
+    // 存放 n 个元素的缓冲区需要的总字节数
+    size_t buffer_bytes(const size_t &n) const
+    {
+        if (n == 0) return 0;
+        const MPI_Aint end = std::max<MPI_Aint>((n - 1) * type_extent + type_true_lb + type_true_extent, n * type_extent);
+        return buffer_front() + end;
+    }
     void show_context() const
     {
-        std::cout << "num_nodes=" << num_nodes << ", node_label=" << node_label << ", num_lonely=" << num_lonely << ", data_size=" << data_size << ", num_split=" << num_split << ", split_size=" << split_size << ", data_size_aligned=" << data_size_aligned << ", type_size=" << type_size << ", has_lonely=" << has_lonely << std::endl;
+        std::cout << "num_nodes=" << num_nodes << ", node_label=" << node_label << ", num_lonely=" << num_lonely << ", data_size=" << data_size << ", num_split=" << num_split << ", split_size=" << split_size << ", data_size_aligned=" << data_size_aligned << ", type_size=" << type_size << ", type_extent=" << type_extent << ", has_lonely=" << has_lonely << std::endl;
     }
 };
 
-const size_t MAX_NUM_BLOCKS = 20;
-template<class DataType> 
-static void reduce_sum(const DataType **src, DataType *dst, const int &num_blocks, const size_t &num_elements)
+// reduce 算子的标签. 真正的计算由 scalar_apply 以及各个指令集下的 Vec::apply 重载给出.
+struct Op_Sum {};
+struct Op_Prod {};
+struct Op_Max {};
+struct Op_Min {};
+struct Op_Band {};
+struct Op_Bor {};
+struct Op_Bxor {};
+struct Op_Land {};
+struct Op_Lor {};
+struct Op_Lxor {};
+struct Op_Maxloc {};
+struct Op_Minloc {};
+
+// MPI_FLOAT_INT, MPI_DOUBLE_INT 等 MAXLOC/MINLOC 用的 (值, 下标) 类型, 内存布局和 MPI 的定义一致
+template<class V, class I>
+struct Value_Index
 {
-#ifdef FT_DEBUG
-    //std::cout << "reduce_sum called, ele size = " << sizeof(**src) << std::endl;
-#endif
-    if (num_blocks <= 1) return;
-#define PARALLEL_THREAD 14
-    const DataType *src0 = src[0];
-    const DataType *src1 = src[1];
-    const DataType *src2 = src[2];
-    const DataType *src3 = src[3];
-    const DataType *src4 = src[4];
-    const DataType *src5 = src[5];
-    const DataType *src6 = src[6];
-    const DataType *src7 = src[7];
-    const DataType *src8 = src[8];
-    const DataType *src9 = src[9];
-    const DataType *src10 = src[10];
-    const DataType *src11 = src[11];
-    const DataType *src12 = src[12];
-    const DataType *src13 = src[13];
-    const DataType *src14 = src[14];
-    const DataType *src15 = src[15];
-    const DataType *src16 = src[16];
-    const DataType *src17 = src[17];
-    const DataType *src18 = src[18];
-    const DataType *src19 = src[19];
-
-    switch (num_blocks)
-    {
-    case 2:
-    {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i];
-        }
-        break;
+    V value;
+    I index;
+};
+
+// 16 位浮点的存储格式. 只在传输和存储时使用 16 位, 计算时都先转换成 float.
+struct Half
+{
+    uint16_t bits;
+};
+
+struct BFloat16
+{
+    uint16_t bits;
+};
+
+static inline float half_to_float(const Half &h)
+{
+    const uint32_t sign = (uint32_t)(h.bits & 0x8000) << 16;
+    uint32_t exponent = (h.bits >> 10) & 0x1F;
+    uint32_t mantissa = h.bits & 0x3FF;
+    uint32_t bits;
+    if (exponent == 0x1F)
+    {
+        bits = sign | 0x7F800000 | (mantissa << 13) | (mantissa != 0 ? 0x400000 : 0); // inf / nan, nan 变成 quiet nan
     }
-    case 3:
+    else if (exponent != 0)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i] + src2[i];
-        }
-        break;
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
     }
-    case 4:
+    else if (mantissa == 0)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i];
-        }
-        break;
+        bits = sign;
     }
-    case 5:
+    else
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        // 非规格化数: 规格化之后再拼
+        exponent = 113;
+        while ((mantissa & 0x400) == 0)
         {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i] + src4[i];
+            mantissa <<= 1;
+            exponent--;
         }
-        break;
+        bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
     }
-    case 6:
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// 舍入到最近的偶数, 和 F16C 的 vcvtps2ph 结果一致
+static inline Half float_to_half(const float &f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    const uint16_t sign = (bits >> 16) & 0x8000;
+    const uint32_t abs = bits & 0x7FFFFFFF;
+    Half h;
+    if (abs >= 0x7F800000)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i] + src4[i] + src5[i];
-        }
-        break;
+        h.bits = sign | 0x7C00 | (abs > 0x7F800000 ? 0x200 | ((abs >> 13) & 0x3FF) : 0);
     }
-    case 7:
+    else if (abs >= 0x477FF000)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i] + src4[i] + src5[i] + src6[i];
-        }
-        break;
+        h.bits = sign | 0x7C00; // 舍入后超过 65504, 溢出成 inf
     }
-    case 8:
+    else if (abs >= 0x38800000)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i] + src4[i] + src5[i] + src6[i] + src7[i];
-        }
-        break;
+        const uint32_t rounded = abs + 0xFFF + ((abs >> 13) & 1);
+        h.bits = sign | ((rounded - 0x38000000) >> 13);
     }
-    case 9:
+    else if (abs > 0x33000000)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i] + src4[i] + src5[i] + src6[i] + src7[i] + src8[i];
-        }
-        break;
+        // 结果是非规格化数
+        const uint32_t exponent = abs >> 23;
+        const uint32_t mantissa = (abs & 0x7FFFFF) | 0x800000;
+        const uint32_t shift = 126 - exponent;
+        const uint32_t half_bit = 1u << (shift - 1);
+        uint32_t value = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1);
+        if (rest > half_bit || (rest == half_bit && (value & 1))) value++;
+        h.bits = sign | value;
     }
-    case 10:
+    else
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i] + src4[i] + src5[i] + src6[i] + src7[i] + src8[i] + src9[i];
-        }
-        break;
+        h.bits = sign; // 太小, 舍入到 0 (0x33000000 刚好是一半, 舍入到偶数也是 0)
     }
-    case 11:
+    return h;
+}
+
+static inline float bfloat16_to_float(const BFloat16 &b)
+{
+    const uint32_t bits = (uint32_t)b.bits << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline BFloat16 float_to_bfloat16(const float &f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    BFloat16 b;
+    if ((bits & 0x7FFFFFFF) > 0x7F800000)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i] + src4[i] + src5[i] + src6[i] + src7[i] + src8[i] + src9[i] + src10[i];
-        }
-        break;
+        b.bits = (bits >> 16) | 0x40; // 保持 nan, 变成 quiet nan
     }
-    case 12:
+    else
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i] + src4[i] + src5[i] + src6[i] + src7[i] + src8[i] + src9[i] + src10[i] + src11[i];
-        }
-        break;
+        b.bits = (bits + 0x7FFF + ((bits >> 16) & 1)) >> 16;
     }
-    case 13:
+    return b;
+}
+
+// reduce 时的累加类型. 16 位浮点在 float 上累加, 一个 stage 的所有来源合并完之后才舍入一次.
+template<class T> struct Accum
+{
+    typedef T type;
+    static const T &load(const T &v) { return v; }
+    static const T &store(const T &v) { return v; }
+};
+template<> struct Accum<Half>
+{
+    typedef float type;
+    static float load(const Half &v) { return half_to_float(v); }
+    static Half store(const float &v) { return float_to_half(v); }
+};
+template<> struct Accum<BFloat16>
+{
+    typedef float type;
+    static float load(const BFloat16 &v) { return bfloat16_to_float(v); }
+    static BFloat16 store(const float &v) { return float_to_bfloat16(v); }
+};
+
+template<class T> static inline T scalar_apply(Op_Sum, const T &a, const T &b) { return a + b; }
+template<class T> static inline T scalar_apply(Op_Prod, const T &a, const T &b) { return a * b; }
+template<class T> static inline T scalar_apply(Op_Max, const T &a, const T &b) { return a > b ? a : b; }
+template<class T> static inline T scalar_apply(Op_Min, const T &a, const T &b) { return a < b ? a : b; }
+template<class T> static inline T scalar_apply(Op_Band, const T &a, const T &b) { return a & b; }
+template<class T> static inline T scalar_apply(Op_Bor, const T &a, const T &b) { return a | b; }
+template<class T> static inline T scalar_apply(Op_Bxor, const T &a, const T &b) { return a ^ b; }
+template<class T> static inline T scalar_apply(Op_Land, const T &a, const T &b) { return a && b; }
+template<class T> static inline T scalar_apply(Op_Lor, const T &a, const T &b) { return a || b; }
+template<class T> static inline T scalar_apply(Op_Lxor, const T &a, const T &b) { return !a != !b; }
+static inline bool scalar_apply(Op_Prod, const bool &a, const bool &b) { return a && b; }
+// 值相等时取较小的下标, 和 MPI 标准一致
+template<class V, class I> static inline Value_Index<V, I> scalar_apply(Op_Maxloc, const Value_Index<V, I> &a, const Value_Index<V, I> &b)
+{
+    return (b.value > a.value || (b.value == a.value && b.index < a.index)) ? b : a;
+}
+template<class V, class I> static inline Value_Index<V, I> scalar_apply(Op_Minloc, const Value_Index<V, I> &a, const Value_Index<V, I> &b)
+{
+    return (b.value < a.value || (b.value == a.value && b.index < a.index)) ? b : a;
+}
+
+// 某个算子能不能用在某个类型上: 位运算和逻辑运算不能用于浮点, 其他的 (值, 下标) 类型只能用 MAXLOC/MINLOC
+template<class OP> struct Op_Allows_Float { static const bool value = false; };
+template<> struct Op_Allows_Float<Op_Sum> { static const bool value = true; };
+template<> struct Op_Allows_Float<Op_Prod> { static const bool value = true; };
+template<> struct Op_Allows_Float<Op_Max> { static const bool value = true; };
+template<> struct Op_Allows_Float<Op_Min> { static const bool value = true; };
+template<class OP> struct Op_Is_Loc { static const bool value = false; };
+template<> struct Op_Is_Loc<Op_Maxloc> { static const bool value = true; };
+template<> struct Op_Is_Loc<Op_Minloc> { static const bool value = true; };
+template<class T> struct Is_Half { static const bool value = false; };
+template<> struct Is_Half<Half> { static const bool value = true; };
+template<> struct Is_Half<BFloat16> { static const bool value = true; };
+template<class OP, class T> struct Op_Supports
+{
+    static const bool value = (std::is_arithmetic<T>::value && !Op_Is_Loc<OP>::value && (std::is_integral<T>::value || Op_Allows_Float<OP>::value))
+        || (Is_Half<T>::value && Op_Allows_Float<OP>::value);
+};
+template<class OP, class V, class I> struct Op_Supports<OP, Value_Index<V, I>>
+{
+    static const bool value = Op_Is_Loc<OP>::value;
+};
+
+// 只有整数, float, double 和 16 位浮点有向量实现, 其他类型 (long double, Value_Index) 只走标量 kernel
+template<class T> struct Has_Vec
+{
+    static const bool value = std::is_integral<T>::value || std::is_same<T, float>::value || std::is_same<T, double>::value || Is_Half<T>::value;
+};
+
+// 标量 kernel, 同时也是非 x86 平台以及 FT_SIMD=scalar 时的实现.
+// 对 [begin, end) 范围内的元素, 把 num_src 个来源合并到 dst. dst 的类型一般和来源相同, 保留 float 主副本时来源是 16 位浮点, dst 是 float.
+template<class OP, class T, class D>
+static void reduce_kernel_scalar(const T **src, D *dst, const size_t num_src, const size_t begin, const size_t end)
+{
+    typedef Accum<T> A;
+    for (size_t i = begin; i < end; ++i)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        typename A::type acc = A::load(src[0][i]);
+        for (size_t j = 1; j < num_src; ++j)
         {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i] + src4[i] + src5[i] + src6[i] + src7[i] + src8[i] + src9[i] + src10[i] + src11[i] + src12[i];
+            acc = scalar_apply(OP(), acc, A::load(src[j][i]));
         }
-        break;
+        dst[i] = Accum<D>::store(acc);
     }
-    case 14:
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FT_X86
+#endif
+
+#ifdef FT_X86
+// 各个指令集下的 kernel 主体都是一样的, 区别只在于 Vec<T> 的定义, 所以用宏展开到各自的 namespace 里去.
+// 16 位浮点的 Vec 在 load 时转换成 float 向量, store 时再转换回来, 所以来源和 dst 的 Vec::type 相同时可以混用 (16 位来源, float dst).
+// 每次处理两个向量宽度的数据, 来源按 4 个一组以树的形式合并 ((s0+s1)+(s2+s3)), 中间结果全部留在寄存器里.
+// FIXED 不为 0 时来源个数在编译期确定 (比如二叉的 stage 和 ring 都是 2 个来源), 循环可以完全展开.
+// NT 为 true 时结果用 non-temporal store 写回 (需要先把 dst 对齐到向量宽度, 对不齐就退回普通 store).
+#define FT_DEFINE_REDUCE_KERNEL                                                                         \
+template<class OP, bool NT, size_t FIXED, class T, class D>                                             \
+static void reduce_kernel(const T **src, D *dst, const size_t num_src_arg, const size_t begin, const size_t end) \
+{                                                                                                       \
+    const size_t num_src = (FIXED > 0 ? FIXED : num_src_arg);                                           \
+    typedef Vec<T> V;                                                                                   \
+    typedef Vec<D> VD;                                                                                  \
+    typedef typename V::type vec;                                                                       \
+    const size_t W = V::width;                                                                          \
+    size_t i = begin;                                                                                   \
+    bool stream = false;                                                                                \
+    if (NT && ((uintptr_t)(dst + i)) % sizeof(D) == 0)                                                  \
+    {                                                                                                   \
+        const size_t peel = (sizeof(vec) - ((uintptr_t)(dst + i)) % sizeof(vec)) % sizeof(vec) / sizeof(D); \
+        if (i + peel <= end)                                                                            \
+        {                                                                                               \
+            reduce_kernel_scalar<OP>(src, dst, num_src, i, i + peel);                                   \
+            i += peel;                                                                                  \
+            stream = true;                                                                              \
+        }                                                                                               \
+    }                                                                                                   \
+    for (; i + 2 * W <= end; i += 2 * W)                                                                \
+    {                                                                                                   \
+        vec acc0 = V::load(src[0] + i), acc1 = V::load(src[0] + i + W);                                 \
+        size_t j = 1;                                                                                   \
+        for (; j + 4 <= num_src; j += 4)                                                                \
+        {                                                                                               \
+            vec a0 = V::apply(OP(), V::load(src[j] + i), V::load(src[j + 1] + i));                      \
+            vec b0 = V::apply(OP(), V::load(src[j + 2] + i), V::load(src[j + 3] + i));                  \
+            vec a1 = V::apply(OP(), V::load(src[j] + i + W), V::load(src[j + 1] + i + W));              \
+            vec b1 = V::apply(OP(), V::load(src[j + 2] + i + W), V::load(src[j + 3] + i + W));          \
+            acc0 = V::apply(OP(), acc0, V::apply(OP(), a0, b0));                                        \
+            acc1 = V::apply(OP(), acc1, V::apply(OP(), a1, b1));                                        \
+        }                                                                                               \
+        for (; j < num_src; ++j)                                                                        \
+        {                                                                                               \
+            acc0 = V::apply(OP(), acc0, V::load(src[j] + i));                                           \
+            acc1 = V::apply(OP(), acc1, V::load(src[j] + i + W));                                       \
+        }                                                                                               \
+        if (stream) { VD::stream(dst + i, acc0); VD::stream(dst + i + W, acc1); }                       \
+        else { VD::store(dst + i, acc0); VD::store(dst + i + W, acc1); }                                \
+    }                                                                                                   \
+    for (; i + W <= end; i += W)                                                                        \
+    {                                                                                                   \
+        vec acc = V::load(src[0] + i);                                                                  \
+        for (size_t j = 1; j < num_src; ++j)                                                            \
+        {                                                                                               \
+            acc = V::apply(OP(), acc, V::load(src[j] + i));                                             \
+        }                                                                                               \
+        if (stream) VD::stream(dst + i, acc);                                                           \
+        else VD::store(dst + i, acc);                                                                   \
+    }                                                                                                   \
+    reduce_kernel_scalar<OP>(src, dst, num_src, i, end);                                                \
+}
+
+// 整数类型的 Vec 只和字节宽度以及有无符号有关, 浮点和 bool 单独特化.
+#define FT_DEFINE_VEC_FOR_INTS                                                                          \
+template<class T> struct Vec<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type>: public Int_Vec<sizeof(T), std::is_signed<T>::value> \
+{                                                                                                       \
+    typedef Int_Vec<sizeof(T), std::is_signed<T>::value> Base;                                          \
+    typedef typename Base::type type;                                                                   \
+    static type load(const T *p) { return Base::load(p); }                                              \
+    static void store(T *p, const type &v) { Base::store(p, v); }                                       \
+};
+
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+namespace sse
+{
+template<class T, class Enable = void> struct Vec;
+// 与符号无关的整数运算. 没有对应指令的 (8 位和 64 位乘法, 64 位比较) 用其他指令拼出来.
+template<size_t BYTES> struct Int_Ops;
+template<> struct Int_Ops<1>
+{
+    static __m128i add(const __m128i &a, const __m128i &b) { return _mm_add_epi8(a, b); }
+    static __m128i eq(const __m128i &a, const __m128i &b) { return _mm_cmpeq_epi8(a, b); }
+    static __m128i one() { return _mm_set1_epi8(1); }
+    static __m128i mul(const __m128i &a, const __m128i &b)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i] + src4[i] + src5[i] + src6[i] + src7[i] + src8[i] + src9[i] + src10[i] + src11[i] + src12[i] + src13[i];
-        }
-        break;
+        __m128i even = _mm_mullo_epi16(a, b);
+        __m128i odd = _mm_mullo_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+        return _mm_or_si128(_mm_and_si128(even, _mm_set1_epi16(0xFF)), _mm_slli_epi16(odd, 8));
     }
-    case 15:
+    static __m128i max(const __m128i &a, const __m128i &b, std::true_type) { return _mm_max_epi8(a, b); }
+    static __m128i max(const __m128i &a, const __m128i &b, std::false_type) { return _mm_max_epu8(a, b); }
+    static __m128i min(const __m128i &a, const __m128i &b, std::true_type) { return _mm_min_epi8(a, b); }
+    static __m128i min(const __m128i &a, const __m128i &b, std::false_type) { return _mm_min_epu8(a, b); }
+};
+template<> struct Int_Ops<2>
+{
+    static __m128i add(const __m128i &a, const __m128i &b) { return _mm_add_epi16(a, b); }
+    static __m128i eq(const __m128i &a, const __m128i &b) { return _mm_cmpeq_epi16(a, b); }
+    static __m128i one() { return _mm_set1_epi16(1); }
+    static __m128i mul(const __m128i &a, const __m128i &b) { return _mm_mullo_epi16(a, b); }
+    static __m128i max(const __m128i &a, const __m128i &b, std::true_type) { return _mm_max_epi16(a, b); }
+    static __m128i max(const __m128i &a, const __m128i &b, std::false_type) { return _mm_max_epu16(a, b); }
+    static __m128i min(const __m128i &a, const __m128i &b, std::true_type) { return _mm_min_epi16(a, b); }
+    static __m128i min(const __m128i &a, const __m128i &b, std::false_type) { return _mm_min_epu16(a, b); }
+};
+template<> struct Int_Ops<4>
+{
+    static __m128i add(const __m128i &a, const __m128i &b) { return _mm_add_epi32(a, b); }
+    static __m128i eq(const __m128i &a, const __m128i &b) { return _mm_cmpeq_epi32(a, b); }
+    static __m128i one() { return _mm_set1_epi32(1); }
+    static __m128i mul(const __m128i &a, const __m128i &b) { return _mm_mullo_epi32(a, b); }
+    static __m128i max(const __m128i &a, const __m128i &b, std::true_type) { return _mm_max_epi32(a, b); }
+    static __m128i max(const __m128i &a, const __m128i &b, std::false_type) { return _mm_max_epu32(a, b); }
+    static __m128i min(const __m128i &a, const __m128i &b, std::true_type) { return _mm_min_epi32(a, b); }
+    static __m128i min(const __m128i &a, const __m128i &b, std::false_type) { return _mm_min_epu32(a, b); }
+};
+template<> struct Int_Ops<8>
+{
+    static __m128i add(const __m128i &a, const __m128i &b) { return _mm_add_epi64(a, b); }
+    static __m128i eq(const __m128i &a, const __m128i &b) { return _mm_cmpeq_epi64(a, b); }
+    static __m128i one() { return _mm_set1_epi64x(1); }
+    // 低 64 位的乘积: lo*lo + ((lo*hi + hi*lo) << 32), 有无符号结果一样
+    static __m128i mul(const __m128i &a, const __m128i &b)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i] + src4[i] + src5[i] + src6[i] + src7[i] + src8[i] + src9[i] + src10[i] + src11[i] + src12[i] + src13[i] + src14[i];
-        }
-        break;
+        __m128i cross = _mm_add_epi64(_mm_mul_epu32(a, _mm_srli_epi64(b, 32)), _mm_mul_epu32(_mm_srli_epi64(a, 32), b));
+        return _mm_add_epi64(_mm_mul_epu32(a, b), _mm_slli_epi64(cross, 32));
     }
-    case 16:
+    static __m128i gt(const __m128i &a, const __m128i &b, std::true_type) { return _mm_cmpgt_epi64(a, b); }
+    static __m128i gt(const __m128i &a, const __m128i &b, std::false_type)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i] + src4[i] + src5[i] + src6[i] + src7[i] + src8[i] + src9[i] + src10[i] + src11[i] + src12[i] + src13[i] + src14[i] + src15[i];
-        }
-        break;
+        const __m128i sign = _mm_set1_epi64x((long long)(1ULL << 63));
+        return _mm_cmpgt_epi64(_mm_xor_si128(a, sign), _mm_xor_si128(b, sign));
     }
-    case 17:
+    template<class S> static __m128i max(const __m128i &a, const __m128i &b, S s) { return _mm_blendv_epi8(b, a, gt(a, b, s)); }
+    template<class S> static __m128i min(const __m128i &a, const __m128i &b, S s) { return _mm_blendv_epi8(a, b, gt(a, b, s)); }
+};
+template<size_t BYTES, bool SIGNED> struct Int_Vec_Base
+{
+    typedef __m128i type;
+    typedef Int_Ops<BYTES> O;
+    typedef std::integral_constant<bool, SIGNED> S;
+    static const size_t width = 16 / BYTES;
+    static type load(const void *p) { return _mm_loadu_si128((const __m128i*)p); }
+    static void store(void *p, const type &v) { _mm_storeu_si128((__m128i*)p, v); }
+    static void stream(void *p, const type &v) { _mm_stream_si128((__m128i*)p, v); }
+    static type apply(Op_Band, const type &a, const type &b) { return _mm_and_si128(a, b); }
+    static type apply(Op_Bor, const type &a, const type &b) { return _mm_or_si128(a, b); }
+    static type apply(Op_Bxor, const type &a, const type &b) { return _mm_xor_si128(a, b); }
+    // 逻辑运算: 先得到 a == 0 / b == 0 的掩码, 再转换成 0/1
+    static type apply(Op_Land, const type &a, const type &b)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i] + src4[i] + src5[i] + src6[i] + src7[i] + src8[i] + src9[i] + src10[i] + src11[i] + src12[i] + src13[i] + src14[i] + src15[i] + src16[i];
-        }
-        break;
+        const type z = _mm_setzero_si128();
+        return _mm_andnot_si128(_mm_or_si128(O::eq(a, z), O::eq(b, z)), O::one());
     }
-    case 18:
+    static type apply(Op_Lor, const type &a, const type &b)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i] + src4[i] + src5[i] + src6[i] + src7[i] + src8[i] + src9[i] + src10[i] + src11[i] + src12[i] + src13[i] + src14[i] + src15[i] + src16[i] + src17[i];
-        }
-        break;
+        const type z = _mm_setzero_si128();
+        return _mm_andnot_si128(_mm_and_si128(O::eq(a, z), O::eq(b, z)), O::one());
     }
-    case 19:
+    static type apply(Op_Lxor, const type &a, const type &b)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i] + src4[i] + src5[i] + src6[i] + src7[i] + src8[i] + src9[i] + src10[i] + src11[i] + src12[i] + src13[i] + src14[i] + src15[i] + src16[i] + src17[i] + src18[i];
-        }
-        break;
+        const type z = _mm_setzero_si128();
+        return _mm_and_si128(_mm_xor_si128(O::eq(a, z), O::eq(b, z)), O::one());
     }
-    case 20:
+};
+template<size_t BYTES, bool SIGNED> struct Int_Vec: public Int_Vec_Base<BYTES, SIGNED>
+{
+    typedef Int_Vec_Base<BYTES, SIGNED> B;
+    typedef typename B::type type;
+    using B::apply;
+    static type apply(Op_Sum, const type &a, const type &b) { return B::O::add(a, b); }
+    static type apply(Op_Prod, const type &a, const type &b) { return B::O::mul(a, b); }
+    static type apply(Op_Max, const type &a, const type &b) { return B::O::max(a, b, typename B::S()); }
+    static type apply(Op_Min, const type &a, const type &b) { return B::O::min(a, b, typename B::S()); }
+};
+FT_DEFINE_VEC_FOR_INTS
+// bool 只有 0/1 两种值, 所有运算都可以化成按位运算. 加法在转换回 bool 之后就是或.
+template<> struct Vec<bool>: public Int_Vec_Base<1, false>
+{
+    static type load(const bool *p) { return Int_Vec_Base<1, false>::load(p); }
+    static void store(bool *p, const type &v) { Int_Vec_Base<1, false>::store(p, v); }
+    static type apply(Op_Sum, const type &a, const type &b) { return _mm_or_si128(a, b); }
+    static type apply(Op_Max, const type &a, const type &b) { return _mm_or_si128(a, b); }
+    static type apply(Op_Lor, const type &a, const type &b) { return _mm_or_si128(a, b); }
+    static type apply(Op_Bor, const type &a, const type &b) { return _mm_or_si128(a, b); }
+    static type apply(Op_Prod, const type &a, const type &b) { return _mm_and_si128(a, b); }
+    static type apply(Op_Min, const type &a, const type &b) { return _mm_and_si128(a, b); }
+    static type apply(Op_Land, const type &a, const type &b) { return _mm_and_si128(a, b); }
+    static type apply(Op_Band, const type &a, const type &b) { return _mm_and_si128(a, b); }
+    static type apply(Op_Lxor, const type &a, const type &b) { return _mm_xor_si128(a, b); }
+    static type apply(Op_Bxor, const type &a, const type &b) { return _mm_xor_si128(a, b); }
+};
+template<> struct Vec<float>
+{
+    typedef __m128 type;
+    static const size_t width = 4;
+    static type load(const float *p) { return _mm_loadu_ps(p); }
+    static void store(float *p, const type &v) { _mm_storeu_ps(p, v); }
+    static void stream(float *p, const type &v) { _mm_stream_ps(p, v); }
+    static type apply(Op_Sum, const type &a, const type &b) { return _mm_add_ps(a, b); }
+    static type apply(Op_Prod, const type &a, const type &b) { return _mm_mul_ps(a, b); }
+    static type apply(Op_Max, const type &a, const type &b) { return _mm_max_ps(a, b); }
+    static type apply(Op_Min, const type &a, const type &b) { return _mm_min_ps(a, b); }
+};
+template<> struct Vec<double>
+{
+    typedef __m128d type;
+    static const size_t width = 2;
+    static type load(const double *p) { return _mm_loadu_pd(p); }
+    static void store(double *p, const type &v) { _mm_storeu_pd(p, v); }
+    static void stream(double *p, const type &v) { _mm_stream_pd(p, v); }
+    static type apply(Op_Sum, const type &a, const type &b) { return _mm_add_pd(a, b); }
+    static type apply(Op_Prod, const type &a, const type &b) { return _mm_mul_pd(a, b); }
+    static type apply(Op_Max, const type &a, const type &b) { return _mm_max_pd(a, b); }
+    static type apply(Op_Min, const type &a, const type &b) { return _mm_min_pd(a, b); }
+};
+// bf16 就是 float 的高 16 位, 转换只需要移位; 转回去时舍入到最近的偶数, nan 保持为 quiet nan
+template<> struct Vec<BFloat16>: public Vec<float>
+{
+    static type load(const BFloat16 *p) { return _mm_castsi128_ps(_mm_slli_epi32(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)p)), 16)); }
+    static void store(BFloat16 *p, const type &v)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] + src1[i] + src2[i] + src3[i] + src4[i] + src5[i] + src6[i] + src7[i] + src8[i] + src9[i] + src10[i] + src11[i] + src12[i] + src13[i] + src14[i] + src15[i] + src16[i] + src17[i] + src18[i] + src19[i];
-        }
-        break;
+        const __m128i bits = _mm_castps_si128(v);
+        __m128i rounded = _mm_add_epi32(bits, _mm_add_epi32(_mm_set1_epi32(0x7FFF), _mm_and_si128(_mm_srli_epi32(bits, 16), _mm_set1_epi32(1))));
+        rounded = _mm_blendv_epi8(rounded, _mm_or_si128(bits, _mm_set1_epi32(0x400000)), _mm_castps_si128(_mm_cmpunord_ps(v, v)));
+        rounded = _mm_srli_epi32(rounded, 16);
+        _mm_storel_epi64((__m128i*)p, _mm_packus_epi32(rounded, rounded));
     }
-    default:
-        std::cerr << "Unknown num_blocks: " << num_blocks << std::endl;
-        break;
+    static void stream(BFloat16 *p, const type &v) { store(p, v); }
+};
+// SSE 没有 F16C, fp16 逐个用标量转换
+template<> struct Vec<Half>: public Vec<float>
+{
+    static type load(const Half *p) { return _mm_setr_ps(half_to_float(p[0]), half_to_float(p[1]), half_to_float(p[2]), half_to_float(p[3])); }
+    static void store(Half *p, const type &v)
+    {
+        float tmp[4];
+        _mm_storeu_ps(tmp, v);
+        for (int k = 0; k < 4; k++) p[k] = float_to_half(tmp[k]);
     }
-}
+    static void stream(Half *p, const type &v) { store(p, v); }
+};
+FT_DEFINE_REDUCE_KERNEL
+} // end of namespace sse
+#pragma GCC pop_options
 
-template<class DataType> 
-static void reduce_band(const DataType **src, DataType *dst, const int &num_blocks, const size_t &num_elements)
+#pragma GCC push_options
+#pragma GCC target("avx2,f16c")
+namespace avx2
 {
-#ifdef FT_DEBUG
-    //std::cout << "reduce_band called, ele size = " << sizeof(**src) << std::endl;
-#endif
-    if (num_blocks <= 1) return;
-#define PARALLEL_THREAD 14
-    const DataType *src0 = src[0];
-    const DataType *src1 = src[1];
-    const DataType *src2 = src[2];
-    const DataType *src3 = src[3];
-    const DataType *src4 = src[4];
-    const DataType *src5 = src[5];
-    const DataType *src6 = src[6];
-    const DataType *src7 = src[7];
-    const DataType *src8 = src[8];
-    const DataType *src9 = src[9];
-    const DataType *src10 = src[10];
-    const DataType *src11 = src[11];
-    const DataType *src12 = src[12];
-    const DataType *src13 = src[13];
-    const DataType *src14 = src[14];
-    const DataType *src15 = src[15];
-    const DataType *src16 = src[16];
-    const DataType *src17 = src[17];
-    const DataType *src18 = src[18];
-    const DataType *src19 = src[19];
-
-    switch (num_blocks)
-    {
-    case 2:
-    {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
-        {
-            dst[i] = src0[i] & src1[i];
-        }
-        break;
-    }
-    case 3:
+template<class T, class Enable = void> struct Vec;
+template<size_t BYTES> struct Int_Ops;
+template<> struct Int_Ops<1>
+{
+    static __m256i add(const __m256i &a, const __m256i &b) { return _mm256_add_epi8(a, b); }
+    static __m256i eq(const __m256i &a, const __m256i &b) { return _mm256_cmpeq_epi8(a, b); }
+    static __m256i one() { return _mm256_set1_epi8(1); }
+    static __m256i mul(const __m256i &a, const __m256i &b)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        __m256i even = _mm256_mullo_epi16(a, b);
+        __m256i odd = _mm256_mullo_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+        return _mm256_or_si256(_mm256_and_si256(even, _mm256_set1_epi16(0xFF)), _mm256_slli_epi16(odd, 8));
+    }
+    static __m256i max(const __m256i &a, const __m256i &b, std::true_type) { return _mm256_max_epi8(a, b); }
+    static __m256i max(const __m256i &a, const __m256i &b, std::false_type) { return _mm256_max_epu8(a, b); }
+    static __m256i min(const __m256i &a, const __m256i &b, std::true_type) { return _mm256_min_epi8(a, b); }
+    static __m256i min(const __m256i &a, const __m256i &b, std::false_type) { return _mm256_min_epu8(a, b); }
+};
+template<> struct Int_Ops<2>
+{
+    static __m256i add(const __m256i &a, const __m256i &b) { return _mm256_add_epi16(a, b); }
+    static __m256i eq(const __m256i &a, const __m256i &b) { return _mm256_cmpeq_epi16(a, b); }
+    static __m256i one() { return _mm256_set1_epi16(1); }
+    static __m256i mul(const __m256i &a, const __m256i &b) { return _mm256_mullo_epi16(a, b); }
+    static __m256i max(const __m256i &a, const __m256i &b, std::true_type) { return _mm256_max_epi16(a, b); }
+    static __m256i max(const __m256i &a, const __m256i &b, std::false_type) { return _mm256_max_epu16(a, b); }
+    static __m256i min(const __m256i &a, const __m256i &b, std::true_type) { return _mm256_min_epi16(a, b); }
+    static __m256i min(const __m256i &a, const __m256i &b, std::false_type) { return _mm256_min_epu16(a, b); }
+};
+template<> struct Int_Ops<4>
+{
+    static __m256i add(const __m256i &a, const __m256i &b) { return _mm256_add_epi32(a, b); }
+    static __m256i eq(const __m256i &a, const __m256i &b) { return _mm256_cmpeq_epi32(a, b); }
+    static __m256i one() { return _mm256_set1_epi32(1); }
+    static __m256i mul(const __m256i &a, const __m256i &b) { return _mm256_mullo_epi32(a, b); }
+    static __m256i max(const __m256i &a, const __m256i &b, std::true_type) { return _mm256_max_epi32(a, b); }
+    static __m256i max(const __m256i &a, const __m256i &b, std::false_type) { return _mm256_max_epu32(a, b); }
+    static __m256i min(const __m256i &a, const __m256i &b, std::true_type) { return _mm256_min_epi32(a, b); }
+    static __m256i min(const __m256i &a, const __m256i &b, std::false_type) { return _mm256_min_epu32(a, b); }
+};
+template<> struct Int_Ops<8>
+{
+    static __m256i add(const __m256i &a, const __m256i &b) { return _mm256_add_epi64(a, b); }
+    static __m256i eq(const __m256i &a, const __m256i &b) { return _mm256_cmpeq_epi64(a, b); }
+    static __m256i one() { return _mm256_set1_epi64x(1); }
+    static __m256i mul(const __m256i &a, const __m256i &b)
+    {
+        __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)), _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b));
+        return _mm256_add_epi64(_mm256_mul_epu32(a, b), _mm256_slli_epi64(cross, 32));
+    }
+    static __m256i gt(const __m256i &a, const __m256i &b, std::true_type) { return _mm256_cmpgt_epi64(a, b); }
+    static __m256i gt(const __m256i &a, const __m256i &b, std::false_type)
+    {
+        const __m256i sign = _mm256_set1_epi64x((long long)(1ULL << 63));
+        return _mm256_cmpgt_epi64(_mm256_xor_si256(a, sign), _mm256_xor_si256(b, sign));
+    }
+    template<class S> static __m256i max(const __m256i &a, const __m256i &b, S s) { return _mm256_blendv_epi8(b, a, gt(a, b, s)); }
+    template<class S> static __m256i min(const __m256i &a, const __m256i &b, S s) { return _mm256_blendv_epi8(a, b, gt(a, b, s)); }
+};
+template<size_t BYTES, bool SIGNED> struct Int_Vec_Base
+{
+    typedef __m256i type;
+    typedef Int_Ops<BYTES> O;
+    typedef std::integral_constant<bool, SIGNED> S;
+    static const size_t width = 32 / BYTES;
+    static type load(const void *p) { return _mm256_loadu_si256((const __m256i*)p); }
+    static void store(void *p, const type &v) { _mm256_storeu_si256((__m256i*)p, v); }
+    static void stream(void *p, const type &v) { _mm256_stream_si256((__m256i*)p, v); }
+    static type apply(Op_Band, const type &a, const type &b) { return _mm256_and_si256(a, b); }
+    static type apply(Op_Bor, const type &a, const type &b) { return _mm256_or_si256(a, b); }
+    static type apply(Op_Bxor, const type &a, const type &b) { return _mm256_xor_si256(a, b); }
+    static type apply(Op_Land, const type &a, const type &b)
+    {
+        const type z = _mm256_setzero_si256();
+        return _mm256_andnot_si256(_mm256_or_si256(O::eq(a, z), O::eq(b, z)), O::one());
+    }
+    static type apply(Op_Lor, const type &a, const type &b)
+    {
+        const type z = _mm256_setzero_si256();
+        return _mm256_andnot_si256(_mm256_and_si256(O::eq(a, z), O::eq(b, z)), O::one());
+    }
+    static type apply(Op_Lxor, const type &a, const type &b)
+    {
+        const type z = _mm256_setzero_si256();
+        return _mm256_and_si256(_mm256_xor_si256(O::eq(a, z), O::eq(b, z)), O::one());
+    }
+};
+template<size_t BYTES, bool SIGNED> struct Int_Vec: public Int_Vec_Base<BYTES, SIGNED>
+{
+    typedef Int_Vec_Base<BYTES, SIGNED> B;
+    typedef typename B::type type;
+    using B::apply;
+    static type apply(Op_Sum, const type &a, const type &b) { return B::O::add(a, b); }
+    static type apply(Op_Prod, const type &a, const type &b) { return B::O::mul(a, b); }
+    static type apply(Op_Max, const type &a, const type &b) { return B::O::max(a, b, typename B::S()); }
+    static type apply(Op_Min, const type &a, const type &b) { return B::O::min(a, b, typename B::S()); }
+};
+FT_DEFINE_VEC_FOR_INTS
+template<> struct Vec<bool>: public Int_Vec_Base<1, false>
+{
+    static type load(const bool *p) { return Int_Vec_Base<1, false>::load(p); }
+    static void store(bool *p, const type &v) { Int_Vec_Base<1, false>::store(p, v); }
+    static type apply(Op_Sum, const type &a, const type &b) { return _mm256_or_si256(a, b); }
+    static type apply(Op_Max, const type &a, const type &b) { return _mm256_or_si256(a, b); }
+    static type apply(Op_Lor, const type &a, const type &b) { return _mm256_or_si256(a, b); }
+    static type apply(Op_Bor, const type &a, const type &b) { return _mm256_or_si256(a, b); }
+    static type apply(Op_Prod, const type &a, const type &b) { return _mm256_and_si256(a, b); }
+    static type apply(Op_Min, const type &a, const type &b) { return _mm256_and_si256(a, b); }
+    static type apply(Op_Land, const type &a, const type &b) { return _mm256_and_si256(a, b); }
+    static type apply(Op_Band, const type &a, const type &b) { return _mm256_and_si256(a, b); }
+    static type apply(Op_Lxor, const type &a, const type &b) { return _mm256_xor_si256(a, b); }
+    static type apply(Op_Bxor, const type &a, const type &b) { return _mm256_xor_si256(a, b); }
+};
+template<> struct Vec<float>
+{
+    typedef __m256 type;
+    static const size_t width = 8;
+    static type load(const float *p) { return _mm256_loadu_ps(p); }
+    static void store(float *p, const type &v) { _mm256_storeu_ps(p, v); }
+    static void stream(float *p, const type &v) { _mm256_stream_ps(p, v); }
+    static type apply(Op_Sum, const type &a, const type &b) { return _mm256_add_ps(a, b); }
+    static type apply(Op_Prod, const type &a, const type &b) { return _mm256_mul_ps(a, b); }
+    static type apply(Op_Max, const type &a, const type &b) { return _mm256_max_ps(a, b); }
+    static type apply(Op_Min, const type &a, const type &b) { return _mm256_min_ps(a, b); }
+};
+template<> struct Vec<double>
+{
+    typedef __m256d type;
+    static const size_t width = 4;
+    static type load(const double *p) { return _mm256_loadu_pd(p); }
+    static void store(double *p, const type &v) { _mm256_storeu_pd(p, v); }
+    static void stream(double *p, const type &v) { _mm256_stream_pd(p, v); }
+    static type apply(Op_Sum, const type &a, const type &b) { return _mm256_add_pd(a, b); }
+    static type apply(Op_Prod, const type &a, const type &b) { return _mm256_mul_pd(a, b); }
+    static type apply(Op_Max, const type &a, const type &b) { return _mm256_max_pd(a, b); }
+    static type apply(Op_Min, const type &a, const type &b) { return _mm256_min_pd(a, b); }
+};
+template<> struct Vec<BFloat16>: public Vec<float>
+{
+    static type load(const BFloat16 *p) { return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p)), 16)); }
+    static __m128i convert(const type &v)
+    {
+        const __m256i bits = _mm256_castps_si256(v);
+        __m256i rounded = _mm256_add_epi32(bits, _mm256_add_epi32(_mm256_set1_epi32(0x7FFF), _mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1))));
+        rounded = _mm256_blendv_epi8(rounded, _mm256_or_si256(bits, _mm256_set1_epi32(0x400000)), _mm256_castps_si256(_mm256_cmp_ps(v, v, _CMP_UNORD_Q)));
+        rounded = _mm256_srli_epi32(rounded, 16);
+        return _mm_packus_epi32(_mm256_castsi256_si128(rounded), _mm256_extracti128_si256(rounded, 1));
+    }
+    static void store(BFloat16 *p, const type &v) { _mm_storeu_si128((__m128i*)p, convert(v)); }
+    static void stream(BFloat16 *p, const type &v) { _mm_stream_si128((__m128i*)p, convert(v)); }
+};
+template<> struct Vec<Half>: public Vec<float>
+{
+    static type load(const Half *p) { return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)p)); }
+    static void store(Half *p, const type &v) { _mm_storeu_si128((__m128i*)p, _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT)); }
+    static void stream(Half *p, const type &v) { _mm_stream_si128((__m128i*)p, _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT)); }
+};
+FT_DEFINE_REDUCE_KERNEL
+} // end of namespace avx2
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw,avx512dq")
+// GCC 自己的 avx512 intrinsic 用 _mm512_undefined_* (自己给自己赋值) 作为不关心的来源, 内联之后会误报 maybe-uninitialized
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+namespace avx512
+{
+template<class T, class Enable = void> struct Vec;
+// AVX-512 的比较结果是掩码寄存器, 不同宽度的掩码类型不同, 所以逻辑运算也放到这里
+template<size_t BYTES> struct Int_Ops;
+template<> struct Int_Ops<1>
+{
+    typedef __mmask64 mask;
+    static __m512i add(const __m512i &a, const __m512i &b) { return _mm512_add_epi8(a, b); }
+    static mask nonzero(const __m512i &a) { return _mm512_test_epi8_mask(a, a); }
+    static __m512i to_bool(const mask &m) { return _mm512_maskz_mov_epi8(m, _mm512_set1_epi8(1)); }
+    static __m512i mul(const __m512i &a, const __m512i &b)
+    {
+        __m512i even = _mm512_mullo_epi16(a, b);
+        __m512i odd = _mm512_mullo_epi16(_mm512_srli_epi16(a, 8), _mm512_srli_epi16(b, 8));
+        return _mm512_or_si512(_mm512_and_si512(even, _mm512_set1_epi16(0xFF)), _mm512_slli_epi16(odd, 8));
+    }
+    static __m512i max(const __m512i &a, const __m512i &b, std::true_type) { return _mm512_max_epi8(a, b); }
+    static __m512i max(const __m512i &a, const __m512i &b, std::false_type) { return _mm512_max_epu8(a, b); }
+    static __m512i min(const __m512i &a, const __m512i &b, std::true_type) { return _mm512_min_epi8(a, b); }
+    static __m512i min(const __m512i &a, const __m512i &b, std::false_type) { return _mm512_min_epu8(a, b); }
+};
+template<> struct Int_Ops<2>
+{
+    typedef __mmask32 mask;
+    static __m512i add(const __m512i &a, const __m512i &b) { return _mm512_add_epi16(a, b); }
+    static mask nonzero(const __m512i &a) { return _mm512_test_epi16_mask(a, a); }
+    static __m512i to_bool(const mask &m) { return _mm512_maskz_mov_epi16(m, _mm512_set1_epi16(1)); }
+    static __m512i mul(const __m512i &a, const __m512i &b) { return _mm512_mullo_epi16(a, b); }
+    static __m512i max(const __m512i &a, const __m512i &b, std::true_type) { return _mm512_max_epi16(a, b); }
+    static __m512i max(const __m512i &a, const __m512i &b, std::false_type) { return _mm512_max_epu16(a, b); }
+    static __m512i min(const __m512i &a, const __m512i &b, std::true_type) { return _mm512_min_epi16(a, b); }
+    static __m512i min(const __m512i &a, const __m512i &b, std::false_type) { return _mm512_min_epu16(a, b); }
+};
+template<> struct Int_Ops<4>
+{
+    typedef __mmask16 mask;
+    static __m512i add(const __m512i &a, const __m512i &b) { return _mm512_add_epi32(a, b); }
+    static mask nonzero(const __m512i &a) { return _mm512_test_epi32_mask(a, a); }
+    static __m512i to_bool(const mask &m) { return _mm512_maskz_mov_epi32(m, _mm512_set1_epi32(1)); }
+    static __m512i mul(const __m512i &a, const __m512i &b) { return _mm512_mullo_epi32(a, b); }
+    static __m512i max(const __m512i &a, const __m512i &b, std::true_type) { return _mm512_max_epi32(a, b); }
+    static __m512i max(const __m512i &a, const __m512i &b, std::false_type) { return _mm512_max_epu32(a, b); }
+    static __m512i min(const __m512i &a, const __m512i &b, std::true_type) { return _mm512_min_epi32(a, b); }
+    static __m512i min(const __m512i &a, const __m512i &b, std::false_type) { return _mm512_min_epu32(a, b); }
+};
+template<> struct Int_Ops<8>
+{
+    typedef __mmask8 mask;
+    static __m512i add(const __m512i &a, const __m512i &b) { return _mm512_add_epi64(a, b); }
+    static mask nonzero(const __m512i &a) { return _mm512_test_epi64_mask(a, a); }
+    static __m512i to_bool(const mask &m) { return _mm512_maskz_mov_epi64(m, _mm512_set1_epi64(1)); }
+    static __m512i mul(const __m512i &a, const __m512i &b) { return _mm512_mullo_epi64(a, b); }
+    static __m512i max(const __m512i &a, const __m512i &b, std::true_type) { return _mm512_max_epi64(a, b); }
+    static __m512i max(const __m512i &a, const __m512i &b, std::false_type) { return _mm512_max_epu64(a, b); }
+    static __m512i min(const __m512i &a, const __m512i &b, std::true_type) { return _mm512_min_epi64(a, b); }
+    static __m512i min(const __m512i &a, const __m512i &b, std::false_type) { return _mm512_min_epu64(a, b); }
+};
+template<size_t BYTES, bool SIGNED> struct Int_Vec_Base
+{
+    typedef __m512i type;
+    typedef Int_Ops<BYTES> O;
+    typedef std::integral_constant<bool, SIGNED> S;
+    static const size_t width = 64 / BYTES;
+    static type load(const void *p) { return _mm512_loadu_si512(p); }
+    static void store(void *p, const type &v) { _mm512_storeu_si512(p, v); }
+    static void stream(void *p, const type &v) { _mm512_stream_si512((__m512i*)p, v); }
+    static type apply(Op_Band, const type &a, const type &b) { return _mm512_and_si512(a, b); }
+    static type apply(Op_Bor, const type &a, const type &b) { return _mm512_or_si512(a, b); }
+    static type apply(Op_Bxor, const type &a, const type &b) { return _mm512_xor_si512(a, b); }
+    static type apply(Op_Land, const type &a, const type &b) { return O::to_bool(O::nonzero(a) & O::nonzero(b)); }
+    static type apply(Op_Lor, const type &a, const type &b) { return O::to_bool(O::nonzero(a) | O::nonzero(b)); }
+    static type apply(Op_Lxor, const type &a, const type &b) { return O::to_bool(O::nonzero(a) ^ O::nonzero(b)); }
+};
+template<size_t BYTES, bool SIGNED> struct Int_Vec: public Int_Vec_Base<BYTES, SIGNED>
+{
+    typedef Int_Vec_Base<BYTES, SIGNED> B;
+    typedef typename B::type type;
+    using B::apply;
+    static type apply(Op_Sum, const type &a, const type &b) { return B::O::add(a, b); }
+    static type apply(Op_Prod, const type &a, const type &b) { return B::O::mul(a, b); }
+    static type apply(Op_Max, const type &a, const type &b) { return B::O::max(a, b, typename B::S()); }
+    static type apply(Op_Min, const type &a, const type &b) { return B::O::min(a, b, typename B::S()); }
+};
+FT_DEFINE_VEC_FOR_INTS
+template<> struct Vec<bool>: public Int_Vec_Base<1, false>
+{
+    static type load(const bool *p) { return Int_Vec_Base<1, false>::load(p); }
+    static void store(bool *p, const type &v) { Int_Vec_Base<1, false>::store(p, v); }
+    static type apply(Op_Sum, const type &a, const type &b) { return _mm512_or_si512(a, b); }
+    static type apply(Op_Max, const type &a, const type &b) { return _mm512_or_si512(a, b); }
+    static type apply(Op_Lor, const type &a, const type &b) { return _mm512_or_si512(a, b); }
+    static type apply(Op_Bor, const type &a, const type &b) { return _mm512_or_si512(a, b); }
+    static type apply(Op_Prod, const type &a, const type &b) { return _mm512_and_si512(a, b); }
+    static type apply(Op_Min, const type &a, const type &b) { return _mm512_and_si512(a, b); }
+    static type apply(Op_Land, const type &a, const type &b) { return _mm512_and_si512(a, b); }
+    static type apply(Op_Band, const type &a, const type &b) { return _mm512_and_si512(a, b); }
+    static type apply(Op_Lxor, const type &a, const type &b) { return _mm512_xor_si512(a, b); }
+    static type apply(Op_Bxor, const type &a, const type &b) { return _mm512_xor_si512(a, b); }
+};
+template<> struct Vec<float>
+{
+    typedef __m512 type;
+    static const size_t width = 16;
+    static type load(const float *p) { return _mm512_loadu_ps(p); }
+    static void store(float *p, const type &v) { _mm512_storeu_ps(p, v); }
+    static void stream(float *p, const type &v) { _mm512_stream_ps(p, v); }
+    static type apply(Op_Sum, const type &a, const type &b) { return _mm512_add_ps(a, b); }
+    static type apply(Op_Prod, const type &a, const type &b) { return _mm512_mul_ps(a, b); }
+    static type apply(Op_Max, const type &a, const type &b) { return _mm512_max_ps(a, b); }
+    static type apply(Op_Min, const type &a, const type &b) { return _mm512_min_ps(a, b); }
+};
+template<> struct Vec<double>
+{
+    typedef __m512d type;
+    static const size_t width = 8;
+    static type load(const double *p) { return _mm512_loadu_pd(p); }
+    static void store(double *p, const type &v) { _mm512_storeu_pd(p, v); }
+    static void stream(double *p, const type &v) { _mm512_stream_pd(p, v); }
+    static type apply(Op_Sum, const type &a, const type &b) { return _mm512_add_pd(a, b); }
+    static type apply(Op_Prod, const type &a, const type &b) { return _mm512_mul_pd(a, b); }
+    static type apply(Op_Max, const type &a, const type &b) { return _mm512_max_pd(a, b); }
+    static type apply(Op_Min, const type &a, const type &b) { return _mm512_min_pd(a, b); }
+};
+template<> struct Vec<BFloat16>: public Vec<float>
+{
+    static type load(const BFloat16 *p) { return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)p)), 16)); }
+    static __m256i convert(const type &v)
+    {
+        const __m512i bits = _mm512_castps_si512(v);
+        __m512i rounded = _mm512_add_epi32(bits, _mm512_add_epi32(_mm512_set1_epi32(0x7FFF), _mm512_and_si512(_mm512_srli_epi32(bits, 16), _mm512_set1_epi32(1))));
+        rounded = _mm512_mask_mov_epi32(rounded, _mm512_cmp_ps_mask(v, v, _CMP_UNORD_Q), _mm512_or_si512(bits, _mm512_set1_epi32(0x400000)));
+        return _mm512_cvtepi32_epi16(_mm512_srli_epi32(rounded, 16));
+    }
+    static void store(BFloat16 *p, const type &v) { _mm256_storeu_si256((__m256i*)p, convert(v)); }
+    static void stream(BFloat16 *p, const type &v) { _mm256_stream_si256((__m256i*)p, convert(v)); }
+};
+template<> struct Vec<Half>: public Vec<float>
+{
+    static type load(const Half *p) { return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)p)); }
+    static void store(Half *p, const type &v) { _mm256_storeu_si256((__m256i*)p, _mm512_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)); }
+    static void stream(Half *p, const type &v) { _mm256_stream_si256((__m256i*)p, _mm512_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)); }
+};
+FT_DEFINE_REDUCE_KERNEL
+} // end of namespace avx512
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+#endif // FT_X86
+
+enum SIMD_Level
+{
+    SIMD_SCALAR = 0,
+    SIMD_SSE,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+// 根据 CPUID 选择指令集. 可以用环境变量 FT_SIMD=scalar/sse/avx2/avx512 往下限制, 但不会超过 CPU 实际支持的.
+static SIMD_Level detect_simd_level()
+{
+    SIMD_Level level = SIMD_SCALAR;
+#ifdef FT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) level = SIMD_SSE;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")) level = SIMD_AVX2;
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq")) level = SIMD_AVX512;
+#endif
+    auto FT_SIMD_raw = getenv("FT_SIMD");
+    if (FT_SIMD_raw != nullptr)
+    {
+        std::string FT_SIMD = FT_SIMD_raw;
+        SIMD_Level limit = level;
+        if (FT_SIMD == "scalar") limit = SIMD_SCALAR;
+        else if (FT_SIMD == "sse") limit = SIMD_SSE;
+        else if (FT_SIMD == "avx2") limit = SIMD_AVX2;
+        else if (FT_SIMD == "avx512") limit = SIMD_AVX512;
+        else std::cerr << "invalid FT_SIMD " << FT_SIMD << ", ignored" << std::endl;
+        if (limit < level) level = limit;
+    }
+#ifdef FT_DEBUG
+    std::cout << "FlexTree SIMD level is " << level << std::endl;
+#endif
+    return level;
+}
+
+static SIMD_Level simd_level()
+{
+    static const SIMD_Level level = detect_simd_level();
+    return level;
+}
+
+// 按照运行时检测到的指令集调用对应的 kernel
+template<class OP, bool NT, size_t FIXED, class T, class D>
+static void reduce_range_dispatch(const T **src, D *dst, const size_t num_src, const size_t begin, const size_t end, std::true_type)
+{
+    switch (simd_level())
+    {
+#ifdef FT_X86
+    case SIMD_AVX512:
+        avx512::reduce_kernel<OP, NT, FIXED>(src, dst, num_src, begin, end);
+        break;
+    case SIMD_AVX2:
+        avx2::reduce_kernel<OP, NT, FIXED>(src, dst, num_src, begin, end);
+        break;
+    case SIMD_SSE:
+        sse::reduce_kernel<OP, NT, FIXED>(src, dst, num_src, begin, end);
+        break;
+#endif
+    default:
+        reduce_kernel_scalar<OP>(src, dst, num_src, begin, end);
+        break;
+    }
+#ifdef FT_X86
+    if (NT) _mm_sfence(); // 保证 non-temporal store 在 MPI 读取之前可见
+#endif
+}
+
+// 没有向量实现的类型 (MAXLOC/MINLOC 的 (值, 下标) 对等) 只能走标量 kernel
+template<class OP, bool NT, size_t FIXED, class T, class D>
+static void reduce_range_dispatch(const T **src, D *dst, const size_t num_src, const size_t begin, const size_t end, std::false_type)
+{
+    reduce_kernel_scalar<OP>(src, dst, num_src, begin, end);
+}
+
+template<class OP, bool NT = false, size_t FIXED = 0, class T, class D>
+static void reduce_range(const T **src, D *dst, const size_t num_src, const size_t begin, const size_t end)
+{
+    reduce_range_dispatch<OP, NT, FIXED>(src, dst, num_src, begin, end, std::integral_constant<bool, Has_Vec<T>::value>());
+}
+
+// 宽 stage 的分块 reduce 每一趟最多同时读取的来源数, 再多硬件预取器就跟不上了
+const size_t REDUCE_GROUP = 8;
+
+// 从环境变量读取一个非负整数, 没有设置或者格式不对时返回 default_value
+static size_t get_env_size(const char *name, const size_t &default_value)
+{
+    auto raw = getenv(name);
+    if (raw == nullptr || *raw == '\0')
+    {
+        return default_value;
+    }
+    char *end = nullptr;
+    unsigned long long value = strtoull(raw, &end, 10);
+    if (end == raw || *end != '\0')
+    {
+        std::cerr << "invalid " << name << " " << raw << ", ignored" << std::endl;
+        return default_value;
+    }
+    return value;
+}
+
+// 分块 reduce 的 tile 字节数: 累加用的 dst tile 要留在 L1 里 (还要给当前这组来源留出空间), 同时预取进来的下一组来源要放得进 L2.
+// 可以用环境变量 FT_REDUCE_TILE 直接指定.
+static size_t detect_reduce_tile_bytes()
+{
+    long l1 = 0, l2 = 0;
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+    l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+    l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    if (l1 <= 0) l1 = 32 << 10;
+    if (l2 <= 0) l2 = 256 << 10;
+    size_t tile = std::min<size_t>(l1 / 8, l2 / (2 * (REDUCE_GROUP + 1)));
+    tile = get_env_size("FT_REDUCE_TILE", tile);
+    tile = std::max<size_t>(tile / 64 * 64, 64);
+#ifdef FT_DEBUG
+    std::cout << "FlexTree reduce tile is " << tile << " bytes (L1 " << l1 << ", L2 " << l2 << ")" << std::endl;
+#endif
+    return tile;
+}
+
+static size_t reduce_tile_bytes()
+{
+    static const size_t tile = detect_reduce_tile_bytes();
+    return tile;
+}
+
+// 来源数超过这个值时 reduce_parallel 才走分块的 reduce_blocked, 可以用环境变量 FT_REDUCE_BLOCKED_WIDTH 调整.
+// 默认值来自 reduce_benchmark: 在 L3 很大的机器上, 宽度不到 32 时直接流式合并反而更快.
+static size_t reduce_blocked_min_width()
+{
+    static const size_t width = get_env_size("FT_REDUCE_BLOCKED_WIDTH", 32);
+    return width;
+}
+
+// 结果短时间内不会再被读的时候, 可以设置 FT_REDUCE_NT=1 让最后一次写回绕过 cache
+static bool reduce_nt_enabled()
+{
+    static const bool enabled = get_env_size("FT_REDUCE_NT", 0) != 0;
+    return enabled;
+}
+
+/**
+ * 分块的多来源 reduce. 
+ * 把 [begin, end) 切成 tile, 每个 tile 内把来源按 REDUCE_GROUP 个一组依次累加到 dst 的这个 tile 上, 
+ * 这样 dst tile 一直在 L1 中, 每一趟同时读取的流也不超过 REDUCE_GROUP + 1 个. 处理当前这组时会预取下一组的数据.
+ * 
+ * @param src 来源数组, 共 num_src 个
+ * @param dst 结果, 可以和 src[0] 相同
+ * @param nt 最后一趟是否使用 non-temporal store
+ */
+template<class OP, class T>
+static void reduce_blocked(const T **src, T *dst, const size_t num_src, const size_t begin, const size_t end, const bool nt)
+{
+    if (num_src <= REDUCE_GROUP)
+    {
+        if (nt) reduce_range<OP, true>(src, dst, num_src, begin, end);
+        else reduce_range<OP>(src, dst, num_src, begin, end);
+        return;
+    }
+    const size_t tile = std::max<size_t>(reduce_tile_bytes() / sizeof(T), 1);
+    const size_t line = std::max<size_t>(64 / sizeof(T), 1);
+    const T *group[REDUCE_GROUP + 1];
+    for (size_t t = begin; t < end; t += tile)
+    {
+        const size_t te = std::min(end, t + tile);
+        for (size_t g = 0; g < num_src; g += REDUCE_GROUP)
+        {
+            // 预取下一组来源在这个 tile 中的数据; 如果这是最后一组, 就预取下一个 tile 的第一组
+            const size_t next_g = (g + REDUCE_GROUP < num_src ? g + REDUCE_GROUP : 0);
+            const size_t next_t = (next_g == 0 ? te : t);
+            const size_t next_te = (next_g == 0 ? std::min(end, te + tile) : te);
+            for (size_t k = next_g; k < std::min(num_src, next_g + REDUCE_GROUP); k++)
+            {
+                for (size_t p = next_t; p < next_te; p += line)
+                {
+                    __builtin_prefetch(src[k] + p, 0, 3);
+                }
+            }
+            size_t n = 0;
+            if (g > 0) group[n++] = dst;
+            for (size_t k = g; k < std::min(num_src, g + REDUCE_GROUP); k++)
+            {
+                group[n++] = src[k];
+            }
+            if (nt && g + REDUCE_GROUP >= num_src) reduce_range<OP, true>(group, dst, n, t, te);
+            else reduce_range<OP>(group, dst, n, t, te);
+        }
+    }
+}
+
+// 当前进程所在的机器上一共有几个 rank, 以及自己是第几个. 优先从启动器设置的环境变量里读.
+struct Local_Ranks
+{
+    size_t local_rank = 0, local_size = 0;
+};
+
+static Local_Ranks &local_ranks()
+{
+    static Local_Ranks info;
+    return info;
+}
+
+// 需要在所有 rank 都进入的集合操作中调用 (各个 allreduce 的入口), 只有第一次会做事情.
+// 线程池 (见 Reduce_Pool) 按这里的结果分配核心, 所以要在第一次 reduce 之前调用.
+// 环境变量里找不到时才用 MPI_Comm_split_type 在 comm 上统计.
+static void init_local_ranks(const MPI_Comm &comm)
+{
+    static bool initialized = false;
+    if (initialized) return;
+    initialized = true;
+    const char *env_pairs[][2] = {
+        {"OMPI_COMM_WORLD_LOCAL_RANK", "OMPI_COMM_WORLD_LOCAL_SIZE"},
+        {"MPI_LOCALRANKID", "MPI_LOCALNRANKS"},
+        {"MV2_COMM_WORLD_LOCAL_RANK", "MV2_COMM_WORLD_LOCAL_SIZE"},
+    };
+    auto &info = local_ranks();
+    for (auto &p : env_pairs)
+    {
+        size_t size = get_env_size(p[1], 0);
+        if (size > 0)
+        {
+            info.local_rank = get_env_size(p[0], 0);
+            info.local_size = size;
+            return;
+        }
+    }
+    MPI_Comm node_comm;
+    int tmp;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &tmp);
+    info.local_rank = tmp;
+    MPI_Comm_size(node_comm, &tmp);
+    info.local_size = tmp;
+    MPI_Comm_free(&node_comm);
+}
+
+// 解析 /sys 中 "0-3,8-11" 格式的编号列表 (cpu 或者 NUMA 节点)
+static std::vector<int> parse_cpu_list(const std::string &text)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        if (item.empty() || !isdigit((unsigned char)item[0])) continue;
+        const size_t dash = item.find('-');
+        const int first = atoi(item.c_str());
+        const int last = (dash == std::string::npos ? first : atoi(item.c_str() + dash + 1));
+        for (int i = first; i <= last; i++)
+        {
+            cpus.push_back(i);
+        }
+    }
+    return cpus;
+}
+
+/**
+ * 每个 cpu 所在的 NUMA 节点, 下标是 cpu 编号. 从 /sys/devices/system/node 读取, 不依赖 libnuma, 读不到时都算作节点 0.
+ * FT_NUMA_NODES=k 时把 cpu 按编号平分成 k 个节点, 用来在只有一个节点的机器上测试.
+ */
+static const std::vector<int> &cpu_numa_nodes()
+{
+    static const std::vector<int> nodes = []()
+    {
+        std::vector<int> result(CPU_SETSIZE, 0);
+        const size_t simulated = get_env_size("FT_NUMA_NODES", 0);
+        if (simulated > 0)
+        {
+            const size_t hw = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+            for (size_t i = 0; i < result.size(); i++)
+            {
+                result[i] = (int)(i % hw * simulated / hw);
+            }
+            return result;
+        }
+        std::ifstream online("/sys/devices/system/node/online");
+        std::string text;
+        std::getline(online, text);
+        for (auto node : parse_cpu_list(text))
+        {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!file) continue;
+            std::getline(file, text);
+            for (auto cpu : parse_cpu_list(text))
+            {
+                if (cpu < CPU_SETSIZE) result[cpu] = node;
+            }
+        }
+        return result;
+    }();
+    return nodes;
+}
+
+static size_t num_numa_nodes()
+{
+    const auto &nodes = cpu_numa_nodes();
+    return std::max<size_t>(*std::max_element(nodes.begin(), nodes.end()) + 1, get_env_size("FT_NUMA_NODES", 0));
+}
+
+// 当前线程被绑定在哪个 NUMA 节点上. 没有绑定, 或者亲和性掩码跨了好几个节点时返回 -1
+static int current_numa_node()
+{
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) != 0) return -1;
+    int node = -1;
+    for (int i = 0; i < CPU_SETSIZE; i++)
+    {
+        if (!CPU_ISSET(i, &mask)) continue;
+        if (node != -1 && node != cpu_numa_nodes()[i]) return -1;
+        node = cpu_numa_nodes()[i];
+    }
+    return node;
+}
+
+/**
+ * 常驻的 reduce 线程池, 替代每次 reduce 都要 fork/join 的 omp parallel.
+ * 线程数上限: 如果启动器已经把进程绑到了一部分核上, 就用这些核; 否则把整台机器的核平分给本机的 rank.
+ * 工作线程会绑到各自的核上 (FT_REDUCE_PIN=0 可以关掉), 调用者自己算第 0 份, 不会被绑核.
+ * 核按所在的 NUMA 节点排过序, 编号相邻的线程在同一个 socket 上, reduce 时分到的也是相邻的几段 (见 first_touch).
+ * 没有任务时工作线程先自旋一会儿, 然后睡在条件变量上.
+ */
+class Reduce_Pool
+{
+public:
+    typedef std::function<void(size_t, size_t)> Job;
+
+    static Reduce_Pool &get()
+    {
+        static Reduce_Pool pool;
+        return pool;
+    }
+
+    size_t max_threads() const
+    {
+        return workers.size() + 1;
+    }
+
+    /**
+     * 在 num_threads 个线程上 (包括调用者) 执行 job(tid, num_threads), 所有线程完成后返回.
+     */
+    void run(size_t num_threads, const Job &job)
+    {
+        num_threads = std::min(num_threads, max_threads());
+        if (num_threads <= 1)
+        {
+            job(0, 1);
+            return;
+        }
+        std::lock_guard<std::mutex> run_lock(run_mutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            current_job = &job;
+            current_threads = num_threads;
+            pending.store(num_threads - 1, std::memory_order_relaxed);
+            generation.fetch_add(1, std::memory_order_release);
+        }
+        cv.notify_all();
+        job(0, num_threads);
+        while (pending.load(std::memory_order_acquire) != 0)
+        {
+            cpu_relax();
+        }
+    }
+
+    ~Reduce_Pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+            generation.fetch_add(1, std::memory_order_release);
+        }
+        cv.notify_all();
+        for (auto &i : workers)
+        {
+            i.join();
+        }
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex run_mutex, mutex;
+    std::condition_variable cv;
+    std::atomic<size_t> generation{0}, pending{0};
+    const Job *current_job = nullptr;
+    size_t current_threads = 0;
+    bool stop = false;
+
+    static void cpu_relax()
+    {
+#ifdef FT_X86
+        _mm_pause();
+#else
+        std::this_thread::yield();
+#endif
+    }
+
+    Reduce_Pool()
+    {
+        std::vector<int> cores;
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+        {
+            for (int i = 0; i < CPU_SETSIZE; i++)
+            {
+                if (CPU_ISSET(i, &mask)) cores.push_back(i);
+            }
+        }
+        std::stable_sort(cores.begin(), cores.end(), [](const int &a, const int &b) { return cpu_numa_nodes()[a] < cpu_numa_nodes()[b]; });
+        const size_t hw = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        const auto &info = local_ranks();
+        if (cores.size() >= hw && info.local_size > 1)
+        {
+            // 没有被绑核, 按本机的 rank 数平分
+            const size_t per_rank = std::max<size_t>(cores.size() / info.local_size, 1);
+            const size_t first = info.local_rank % info.local_size * per_rank % cores.size();
+            std::vector<int> mine;
+            for (size_t i = 0; i < per_rank; i++)
+            {
+                mine.push_back(cores[(first + i) % cores.size()]);
+            }
+            cores.swap(mine);
+        }
+        size_t num_threads = get_env_size("FT_REDUCE_THREADS", std::max<size_t>(cores.size(), 1));
+        const bool pin = get_env_size("FT_REDUCE_PIN", 1) != 0 && !cores.empty();
+#ifdef FT_DEBUG
+        std::cout << "FlexTree reduce pool: " << num_threads << " threads, pin=" << pin << ", numa nodes:";
+        for (size_t i = 0; i < num_threads && !cores.empty(); i++)
+        {
+            std::cout << " " << cpu_numa_nodes()[cores[i % cores.size()]];
+        }
+        std::cout << std::endl;
+#endif
+        for (size_t i = 1; i < num_threads; i++)
+        {
+            workers.emplace_back(&Reduce_Pool::worker_loop, this, i);
+            if (pin)
+            {
+                cpu_set_t core;
+                CPU_ZERO(&core);
+                CPU_SET(cores[i % cores.size()], &core);
+                pthread_setaffinity_np(workers.back().native_handle(), sizeof(core), &core);
+            }
+        }
+    }
+
+    // 任务参数和 generation 一起在锁内读取. 没赶上的任务一定是不需要自己参与的, 因为需要参与的任务不等自己完成就不会结束.
+    void worker_loop(const size_t tid)
+    {
+        size_t seen = 0;
+        while (true)
+        {
+            for (int spin = 0; spin < 4096 && generation.load(std::memory_order_acquire) == seen; spin++)
+            {
+                cpu_relax();
+            }
+            const Job *job;
+            size_t num_threads;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return generation.load(std::memory_order_relaxed) != seen; });
+                seen = generation.load(std::memory_order_relaxed);
+                if (stop) return;
+                job = current_job;
+                num_threads = current_threads;
+            }
+            if (tid < num_threads)
+            {
+                (*job)(tid, num_threads);
+                pending.fetch_sub(1, std::memory_order_release);
+            }
+        }
+    }
+};
+
+// 一个线程至少要分到多少字节 (读 + 写) 才值得叫醒它, 可以用 FT_REDUCE_MIN_BYTES 调整
+static size_t reduce_min_bytes_per_thread()
+{
+    static const size_t bytes = std::max<size_t>(get_env_size("FT_REDUCE_MIN_BYTES", 256 << 10), 1);
+    return bytes;
+}
+
+/**
+ * 由线程池第一次写入 [p, p + bytes), 让物理页分配在之后 reduce 这一段的线程所在的 NUMA 节点上 (first touch).
+ * 缓冲区按 tile 字节分成若干片 (一个 stage 中每个来源占一片), 每一片都和 reduce_parallel 一样按 cache line 对齐平分给各个线程.
+ * 只有一个 NUMA 节点, 或者 FT_NUMA_FIRST_TOUCH=0 时什么都不做.
+ */
+static void first_touch(char *p, const size_t &bytes, size_t tile)
+{
+    static const bool enabled = get_env_size("FT_NUMA_FIRST_TOUCH", 1) != 0 && num_numa_nodes() > 1;
+    if (!enabled || bytes == 0) return;
+    tile = std::min(std::max<size_t>(tile, 1), bytes);
+    Reduce_Pool &pool = Reduce_Pool::get();
+    auto body = [&](size_t tid, size_t n)
+    {
+        size_t chunk = (tile + n - 1) / n;
+        chunk = (chunk + 63) / 64 * 64;
+        for (size_t base = 0; base < bytes; base += tile)
+        {
+            const size_t end = std::min(bytes, base + tile);
+            const size_t b = std::min(end, base + chunk * tid);
+            const size_t e = std::min(end, b + chunk);
+            memset(p + b, 0, e - b);
+        }
+    };
+    pool.run(pool.max_threads(), std::ref(body));
+}
+
+// reduce 的一块: num_src 个来源 src[0..num_src) 合并到 dst, 共 len 个元素
+struct Reduce_Task
+{
+    const void **src;
+    void *dst;
+    size_t len;
+};
+
+// 按 stage 的宽度 (来源个数) 分类, 每一类对应一个专门的 kernel 实例
+enum Width_Class
+{
+    WIDTH_PAIR = 0, // 正好 2 个来源 (二叉的 stage 和 ring), 来源个数在编译期确定
+    WIDTH_STREAM,   // 一般情况, 所有来源一趟流式合并
+    WIDTH_BLOCKED,  // 来源很多, 走分块的 reduce_blocked
+    NUM_WIDTH_CLASSES
+};
+
+static Width_Class width_class(const size_t &num_src)
+{
+    if (num_src == 2) return WIDTH_PAIR;
+    if (num_src > reduce_blocked_min_width()) return WIDTH_BLOCKED;
+    return WIDTH_STREAM;
+}
+
+// 线程池中的一段 reduce
+template<int WC> struct Chunk_Reduce;
+template<> struct Chunk_Reduce<WIDTH_PAIR>
+{
+    template<class OP, class T, class D>
+    static void run(const T **src, D *dst, const size_t num_src, const size_t begin, const size_t end, const bool nt)
+    {
+        if (nt) reduce_range<OP, true, 2>(src, dst, num_src, begin, end);
+        else reduce_range<OP, false, 2>(src, dst, num_src, begin, end);
+    }
+};
+template<> struct Chunk_Reduce<WIDTH_STREAM>
+{
+    template<class OP, class T, class D>
+    static void run(const T **src, D *dst, const size_t num_src, const size_t begin, const size_t end, const bool nt)
+    {
+        if (nt) reduce_range<OP, true>(src, dst, num_src, begin, end);
+        else reduce_range<OP>(src, dst, num_src, begin, end);
+    }
+};
+// reduce_blocked 会把 dst 当作下一组的来源, 所以只能用于来源和 dst 类型相同, 并且不需要更宽的累加类型的情况 (见 Blocked_Fn)
+template<> struct Chunk_Reduce<WIDTH_BLOCKED>
+{
+    template<class OP, class T>
+    static void run(const T **src, T *dst, const size_t num_src, const size_t begin, const size_t end, const bool nt)
+    {
+        reduce_blocked<OP>(src, dst, num_src, begin, end, nt);
+    }
+};
+
+/**
+ * 把一个 stage 中所有块的 reduce 一次性交给线程池.
+ * 所有 task 首尾相接看成一段, 按 cache line 对齐平分给各个线程, 线程数由总字节数决定.
+ * DstType 和 DataType 不同时 (16 位浮点来源写到 float 主副本), 只有一个来源也要做一次转换.
+ */
+template<class OP, class DataType, class DstType, int WC>
+static void reduce_parallel(const Reduce_Task *tasks, const size_t &num_tasks, const int &num_blocks)
+{
+    if (num_blocks < 1 || (num_blocks == 1 && std::is_same<DataType, DstType>::value)) return;
+    size_t total = 0;
+    for (size_t k = 0; k < num_tasks; k++)
+    {
+        total += tasks[k].len;
+    }
+    if (total == 0) return;
+    const size_t align = 64 / sizeof(DataType) > 0 ? 64 / sizeof(DataType) : 1;
+    const bool nt = reduce_nt_enabled();
+    const size_t bytes = total * (num_blocks * sizeof(DataType) + sizeof(DstType));
+    const size_t num_threads = std::max<size_t>(bytes / reduce_min_bytes_per_thread(), 1);
+    // 用 std::ref 包装, 构造 Job 时不会分配内存
+    auto body = [&](size_t tid, size_t n)
+    {
+        size_t chunk = (total + n - 1) / n;
+        chunk = (chunk + align - 1) / align * align;
+        const size_t begin = std::min(total, chunk * tid);
+        const size_t end = std::min(total, begin + chunk);
+        size_t base = 0;
+        for (size_t k = 0; k < num_tasks && base < end; base += tasks[k].len, k++)
+        {
+            if (base + tasks[k].len <= begin) continue;
+            const size_t b = std::max(begin, base) - base;
+            const size_t e = std::min(end, base + tasks[k].len) - base;
+            Chunk_Reduce<WC>::template run<OP>((const DataType**)tasks[k].src, (DstType*)tasks[k].dst, num_blocks, b, e, nt);
+        }
+    };
+    Reduce_Pool::get().run(num_threads, std::ref(body));
+}
+
+// MPI 没有预定义 16 位浮点类型, 这里用 2 字节的 contiguous 类型代替, 第一次用到时创建 (必须在 MPI_Init 之后).
+// 用户代码里用 FT_FLOAT16 / FT_BFLOAT16 来指定.
+static MPI_Datatype create_half_type(const char *name)
+{
+    MPI_Datatype type;
+    MPI_Type_contiguous(2, MPI_BYTE, &type);
+    MPI_Type_set_name(type, name);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+static MPI_Datatype float16_type()
+{
+    static const MPI_Datatype type = create_half_type("FT_FLOAT16");
+    return type;
+}
+
+static MPI_Datatype bfloat16_type()
+{
+    static const MPI_Datatype type = create_half_type("FT_BFLOAT16");
+    return type;
+}
+
+static bool is_half_type(const MPI_Datatype &datatype)
+{
+#ifdef MPIX_C_FLOAT16
+    if (datatype == MPIX_C_FLOAT16) return true;
+#endif
+    return datatype == float16_type() || datatype == bfloat16_type();
+}
+
+// reduce kernel 的注册表. 所有 (算子, 类型) 组合的实例在编译期由下面的类型列表生成, 运行时只需要把 MPI 的句柄翻译成下标.
+// 新增类型或者算子时: 在 Reduce_Types / Reduce_Ops 里加上, 再在 reduce_type_index / reduce_op_index 里加上对应的 MPI 句柄.
+template<class... Ts> struct Type_List {};
+
+template<class T, class List> struct Index_Of;
+// 用枚举而不是 static const 成员: 按引用传递 (比如构造 std::pair) 时不需要在类外定义
+template<class T, class... Ts> struct Index_Of<T, Type_List<T, Ts...>>
+{
+    enum { value = 0 };
+};
+template<class T, class U, class... Ts> struct Index_Of<T, Type_List<U, Ts...>>
+{
+    enum { value = 1 + Index_Of<T, Type_List<Ts...>>::value };
+};
+
+// int8_t 等定宽类型都是下面某个类型的别名, 不需要单独列出
+typedef Type_List<signed char, unsigned char, short, unsigned short, int, unsigned int, long, unsigned long, long long, unsigned long long, bool,
+    float, double, long double, Half, BFloat16,
+    Value_Index<float, int>, Value_Index<double, int>, Value_Index<long, int>, Value_Index<int, int>, Value_Index<short, int>, Value_Index<long double, int>> Reduce_Types;
+typedef Type_List<Op_Sum, Op_Prod, Op_Max, Op_Min, Op_Band, Op_Bor, Op_Bxor, Op_Land, Op_Lor, Op_Lxor, Op_Maxloc, Op_Minloc> Reduce_Ops;
+
+// 一个 (算子, 类型) 组合在各个宽度分类下的实现, 不支持的组合全为 nullptr
+typedef void (*Reduce_Fn)(const Reduce_Task *tasks, const size_t &num_tasks, const int &num_blocks);
+struct Reduce_Kernels
+{
+    Reduce_Fn fn[NUM_WIDTH_CLASSES];
+};
+
+// 不能分块的组合, 宽的 stage 也用流式的实现
+template<class OP, class T, class D, class Enable = void> struct Blocked_Fn
+{
+    static Reduce_Fn get() { return &reduce_parallel<OP, T, D, WIDTH_STREAM>; }
+};
+template<class OP, class T> struct Blocked_Fn<OP, T, T, typename std::enable_if<std::is_same<typename Accum<T>::type, T>::value>::type>
+{
+    static Reduce_Fn get() { return &reduce_parallel<OP, T, T, WIDTH_BLOCKED>; }
+};
+
+template<class OP, class T, class D>
+static typename std::enable_if<Op_Supports<OP, T>::value, Reduce_Kernels>::type make_kernels()
+{
+    Reduce_Kernels k = {{&reduce_parallel<OP, T, D, WIDTH_PAIR>, &reduce_parallel<OP, T, D, WIDTH_STREAM>, Blocked_Fn<OP, T, D>::get()}};
+    return k;
+}
+
+template<class OP, class T, class D>
+static typename std::enable_if<!Op_Supports<OP, T>::value, Reduce_Kernels>::type make_kernels()
+{
+    Reduce_Kernels k = {{nullptr, nullptr, nullptr}};
+    return k;
+}
+
+// 写 float 主副本的实现只有 16 位浮点有
+template<class OP, class T>
+static typename std::enable_if<Is_Half<T>::value, Reduce_Kernels>::type make_master_kernels()
+{
+    return make_kernels<OP, T, float>();
+}
+
+template<class OP, class T>
+static typename std::enable_if<!Is_Half<T>::value, Reduce_Kernels>::type make_master_kernels()
+{
+    Reduce_Kernels k = {{nullptr, nullptr, nullptr}};
+    return k;
+}
+
+template<class OP, class... Ts>
+static std::vector<Reduce_Kernels> make_kernel_row(Type_List<Ts...>, const bool &master)
+{
+    return master ? std::vector<Reduce_Kernels>{make_master_kernels<OP, Ts>()...} : std::vector<Reduce_Kernels>{make_kernels<OP, Ts, Ts>()...};
+}
+
+template<class... OPs>
+static std::vector<std::vector<Reduce_Kernels>> make_kernel_table(Type_List<OPs...>, const bool &master)
+{
+    return {make_kernel_row<OPs>(Reduce_Types(), master)...};
+}
+
+// MPI 预定义类型到 Reduce_Types 下标的映射, 不认识的类型返回 -1
+static int reduce_type_index(const MPI_Datatype &datatype)
+{
+    static const std::vector<std::pair<MPI_Datatype, int>> types = {
+        {MPI_INT, Index_Of<int, Reduce_Types>::value},
+        {MPI_UNSIGNED, Index_Of<unsigned int, Reduce_Types>::value},
+        {MPI_LONG, Index_Of<long, Reduce_Types>::value},
+        {MPI_UNSIGNED_LONG, Index_Of<unsigned long, Reduce_Types>::value},
+        {MPI_SHORT, Index_Of<short, Reduce_Types>::value},
+        {MPI_UNSIGNED_SHORT, Index_Of<unsigned short, Reduce_Types>::value},
+        {MPI_LONG_LONG_INT, Index_Of<long long, Reduce_Types>::value},
+        {MPI_LONG_LONG, Index_Of<long long, Reduce_Types>::value},
+        {MPI_UNSIGNED_LONG_LONG, Index_Of<unsigned long long, Reduce_Types>::value},
+        {MPI_SIGNED_CHAR, Index_Of<signed char, Reduce_Types>::value},
+        {MPI_UNSIGNED_CHAR, Index_Of<unsigned char, Reduce_Types>::value},
+        {MPI_BYTE, Index_Of<unsigned char, Reduce_Types>::value},
+        {MPI_INT8_T, Index_Of<int8_t, Reduce_Types>::value},
+        {MPI_UINT8_T, Index_Of<uint8_t, Reduce_Types>::value},
+        {MPI_INT16_T, Index_Of<int16_t, Reduce_Types>::value},
+        {MPI_UINT16_T, Index_Of<uint16_t, Reduce_Types>::value},
+        {MPI_INT32_T, Index_Of<int32_t, Reduce_Types>::value},
+        {MPI_UINT32_T, Index_Of<uint32_t, Reduce_Types>::value},
+        {MPI_INT64_T, Index_Of<int64_t, Reduce_Types>::value},
+        {MPI_UINT64_T, Index_Of<uint64_t, Reduce_Types>::value},
+        {MPI_C_BOOL, Index_Of<bool, Reduce_Types>::value},
+        {MPI_FLOAT, Index_Of<float, Reduce_Types>::value},
+        {MPI_DOUBLE, Index_Of<double, Reduce_Types>::value},
+        {MPI_LONG_DOUBLE, Index_Of<long double, Reduce_Types>::value},
+#ifdef MPIX_C_FLOAT16
+        {MPIX_C_FLOAT16, Index_Of<Half, Reduce_Types>::value},
+#endif
+        {float16_type(), Index_Of<Half, Reduce_Types>::value},
+        {bfloat16_type(), Index_Of<BFloat16, Reduce_Types>::value},
+        {MPI_FLOAT_INT, Index_Of<Value_Index<float, int>, Reduce_Types>::value},
+        {MPI_DOUBLE_INT, Index_Of<Value_Index<double, int>, Reduce_Types>::value},
+        {MPI_LONG_INT, Index_Of<Value_Index<long, int>, Reduce_Types>::value},
+        {MPI_2INT, Index_Of<Value_Index<int, int>, Reduce_Types>::value},
+        {MPI_SHORT_INT, Index_Of<Value_Index<short, int>, Reduce_Types>::value},
+        {MPI_LONG_DOUBLE_INT, Index_Of<Value_Index<long double, int>, Reduce_Types>::value},
+    };
+    for (auto &i : types)
+    {
+        if (i.first == datatype) return i.second;
+    }
+    return -1;
+}
+
+// MPI 预定义算子到 Reduce_Ops 下标的映射, 用户自定义的算子返回 -1
+static int reduce_op_index(const MPI_Op &op)
+{
+    static const std::vector<std::pair<MPI_Op, int>> ops = {
+        {MPI_SUM, Index_Of<Op_Sum, Reduce_Ops>::value},
+        {MPI_PROD, Index_Of<Op_Prod, Reduce_Ops>::value},
+        {MPI_MAX, Index_Of<Op_Max, Reduce_Ops>::value},
+        {MPI_MIN, Index_Of<Op_Min, Reduce_Ops>::value},
+        {MPI_BAND, Index_Of<Op_Band, Reduce_Ops>::value},
+        {MPI_BOR, Index_Of<Op_Bor, Reduce_Ops>::value},
+        {MPI_BXOR, Index_Of<Op_Bxor, Reduce_Ops>::value},
+        {MPI_LAND, Index_Of<Op_Land, Reduce_Ops>::value},
+        {MPI_LOR, Index_Of<Op_Lor, Reduce_Ops>::value},
+        {MPI_LXOR, Index_Of<Op_Lxor, Reduce_Ops>::value},
+        {MPI_MAXLOC, Index_Of<Op_Maxloc, Reduce_Ops>::value},
+        {MPI_MINLOC, Index_Of<Op_Minloc, Reduce_Ops>::value},
+    };
+    for (auto &i : ops)
+    {
+        if (i.first == op) return i.second;
+    }
+    return -1;
+}
+
+// 查表, 没有对应实现时全为 nullptr
+static Reduce_Kernels lookup_kernels(const MPI_Op &op, const MPI_Datatype &datatype, const bool &master)
+{
+    static const std::vector<std::vector<Reduce_Kernels>> table = make_kernel_table(Reduce_Ops(), false);
+    static const std::vector<std::vector<Reduce_Kernels>> master_table = make_kernel_table(Reduce_Ops(), true);
+    const int o = reduce_op_index(op);
+    const int t = reduce_type_index(datatype);
+    if (o < 0 || t < 0)
+    {
+        Reduce_Kernels k = {{nullptr, nullptr, nullptr}};
+        return k;
+    }
+    return master ? master_table[o][t] : table[o][t];
+}
+
+// 本地复制用的通信域. 每个线程第一次用时复制一份 MPI_COMM_SELF, 这样不同线程 (比如进度线程, 融合队列的后台线程和用户线程)
+// 同时复制时收发不会互相匹配, 也不会和应用自己在 MPI_COMM_SELF 上的通信混在一起.
+static MPI_Comm self_comm()
+{
+    static thread_local MPI_Comm comm = MPI_COMM_NULL;
+    if (comm == MPI_COMM_NULL)
+    {
+        MPI_Comm_dup(MPI_COMM_SELF, &comm);
+    }
+    return comm;
+}
+
+// 本地复制 count 个元素. 不连续的派生类型交给 MPI 在 self_comm 上收发, 这样间隙里的数据不会被覆盖.
+static void copy_local(const void *src, void *dst, const size_t &count, const MPI_Datatype &datatype, const bool &dense, const size_t &extent)
+{
+    if (src == dst || count == 0) return;
+    if (dense)
+    {
+        memcpy(dst, src, count * extent);
+        return;
+    }
+    MPI_Sendrecv(src, count, datatype, 0, 0, dst, count, datatype, 0, 0, self_comm(), MPI_STATUS_IGNORE);
+}
+
+// 多线程调用 MPI_Reduce_local 需要 MPI_THREAD_MULTIPLE
+static bool mpi_thread_multiple()
+{
+    int level;
+    MPI_Query_thread(&level);
+    return level == MPI_THREAD_MULTIPLE;
+}
+
+/**
+ * 用户自定义算子 (MPI_Op_create) 以及派生类型的 reduce, 每一段都调用 MPI_Reduce_local, 由 MPI 按照类型的 typemap 访问数据, 不需要先打包.
+ * 仍然按 stage 的块来做, 并且分成 tile: 一个 tile 的 dst 在合并完所有来源之前一直留在 cache 里.
+ * 只能用于满足交换律的算子 (Reduce_local 总是 dst = src[j] op dst).
+ */
+static void reduce_generic(const MPI_Datatype &datatype, const MPI_Op &op, const Reduce_Task *tasks, const size_t &num_tasks, const int &num_blocks, const FlexTree_Context &ft_ctx)
+{
+    size_t total = 0;
+    for (size_t k = 0; k < num_tasks; k++)
+    {
+        total += tasks[k].len;
+    }
+    if (total == 0) return;
+    // Reduce_local 每次调用都有固定开销, 所以 tile 比向量化 kernel 的大一些
+    const size_t tile = std::max<size_t>(reduce_tile_bytes() * REDUCE_GROUP / std::max<size_t>(ft_ctx.type_size, 1), 1);
+    const size_t extent = ft_ctx.type_extent;
+    const size_t bytes = total * (num_blocks + 1) * ft_ctx.type_size;
+    const size_t num_threads = mpi_thread_multiple() ? std::max<size_t>(bytes / reduce_min_bytes_per_thread(), 1) : 1;
+    Reduce_Pool::get().run(num_threads, [&](size_t tid, size_t n)
+    {
+        const size_t chunk = (total + n - 1) / n;
+        const size_t begin = std::min(total, chunk * tid);
+        const size_t end = std::min(total, begin + chunk);
+        size_t base = 0;
+        for (size_t k = 0; k < num_tasks && base < end; base += tasks[k].len, k++)
+        {
+            if (base + tasks[k].len <= begin) continue;
+            const size_t b = std::max(begin, base) - base;
+            const size_t e = std::min(end, base + tasks[k].len) - base;
+            const char **src = (const char**)tasks[k].src;
+            char *dst = (char*)tasks[k].dst;
+            for (size_t t = b; t < e; t += tile)
+            {
+                const size_t len = std::min(e, t + tile) - t;
+                copy_local(src[0] + t * extent, dst + t * extent, len, datatype, ft_ctx.type_dense, extent);
+                for (int j = 1; j < num_blocks; j++)
+                {
+                    MPI_Reduce_local(src[j] + t * extent, dst + t * extent, len, datatype, op);
+                }
+            }
+        }
+    });
+}
+
+// 由同一种基本类型连续组成的派生类型 (比如 MPI_Type_contiguous(4, MPI_FLOAT)) 可以展开成基本类型, 继续用向量化的 kernel.
+// 返回每个元素展开成多少个基本类型, 不能展开时返回 0.
+static size_t flatten_contiguous(const MPI_Datatype &datatype, MPI_Datatype &basic)
+{
+    int num_integers, num_addresses, num_datatypes, combiner;
+    basic = MPI_DATATYPE_NULL;
+    MPI_Type_get_envelope(datatype, &num_integers, &num_addresses, &num_datatypes, &combiner);
+    if (combiner != MPI_COMBINER_CONTIGUOUS || is_half_type(datatype)) return 0;
+    int count;
+    MPI_Aint address;
+    MPI_Datatype inner;
+    MPI_Type_get_contents(datatype, 1, 0, 1, &count, &address, &inner);
+    size_t multiple = 0;
+    MPI_Type_get_envelope(inner, &num_integers, &num_addresses, &num_datatypes, &combiner);
+    if (combiner == MPI_COMBINER_NAMED || is_half_type(inner))
+    {
+        basic = inner;
+        multiple = count;
+    }
+    else
+    {
+        multiple = flatten_contiguous(inner, basic) * count;
+    }
+    if (combiner != MPI_COMBINER_NAMED)
+    {
+        MPI_Type_free(&inner); // get_contents 返回的派生类型需要释放, 不影响原来的类型
+    }
+    // 按字节拼起来的类型 (比如别处定义的 16 位浮点) 不知道怎么解释, 交给 MPI
+    return basic == MPI_BYTE ? 0 : multiple;
+}
+
+// 一次 allreduce 用到的 reduce 实现, 在调用开始时查好, 之后每个 stage 只按宽度分类取函数指针
+struct Reduce_Kernel
+{
+    Reduce_Kernels kernels;        // 结果写回原类型
+    Reduce_Kernels master_kernels; // 结果写进 float 主副本, 只有 16 位浮点有
+    size_t multiple;               // 每个元素展开成多少个基本类型, 没有展开时为 1
+    MPI_Datatype datatype;
+    MPI_Op op;
+    bool generic;                  // 没有对应的 kernel, 交给 MPI_Reduce_local
+};
+
+/**
+ * 根据类型和算子查好 reduce 的实现.
+ * 先查预定义类型, 再尝试把连续的派生类型展开成基本类型, 都不行就用通用的实现.
+ * @param datatype 数据类型
+ * @param op 算子
+ * @param ft_ctx 上下文, 只有紧密排列的类型才能展开
+ */
+static Reduce_Kernel resolve_reduce(const MPI_Datatype &datatype, const MPI_Op &op, const FlexTree_Context &ft_ctx)
+{
+    Reduce_Kernel kernel;
+    kernel.kernels = lookup_kernels(op, datatype, false);
+    kernel.master_kernels = lookup_kernels(op, datatype, true);
+    kernel.multiple = 1;
+    kernel.datatype = datatype;
+    kernel.op = op;
+    MPI_Datatype basic;
+    if (kernel.kernels.fn[0] == nullptr && ft_ctx.type_dense)
+    {
+        const size_t multiple = flatten_contiguous(datatype, basic);
+        if (multiple > 0)
+        {
+            kernel.kernels = lookup_kernels(op, basic, false);
+            kernel.multiple = multiple;
+        }
+    }
+    kernel.generic = (kernel.kernels.fn[0] == nullptr);
+    return kernel;
+}
+
+// 流水线的分段: 每一块被切成若干段, 一段收齐之后就可以 reduce, 同时后面的段还在传输.
+// 段的大小 (字节) 可以用环境变量 FT_SEGMENT_BYTES 指定, 没有设置时根据块的大小自动选择.
+const size_t SEGMENT_MIN_BYTES = 128 << 10; // 自动选择时每段至少这么大, 再小每条消息的固定开销就占主要部分了
+const size_t SEGMENT_MAX_COUNT = 8;         // 自动选择时每块最多切成这么多段
+
+/**
+ * 计算每段的元素个数. 块不大的时候只有一段, 和不分段完全一样.
+ * 
+ * @param ft_ctx 上下文, 用到块的大小和元素的 extent
+ */
+static size_t segment_elements(const FlexTree_Context &ft_ctx)
+{
+    static const size_t fixed = get_env_size("FT_SEGMENT_BYTES", 0);
+    const size_t block_bytes = ft_ctx.split_size * ft_ctx.type_extent;
+    size_t bytes = (fixed > 0 ? fixed : std::max(SEGMENT_MIN_BYTES, (block_bytes + SEGMENT_MAX_COUNT - 1) / SEGMENT_MAX_COUNT));
+    // 段的边界按 cache line 对齐, reduce 的时候各段不会共享同一行
+    bytes = (bytes + 63) / 64 * 64;
+    return std::max<size_t>(bytes / ft_ctx.type_extent, 1);
+}
+
+// 块 block 里第 [seg_begin, seg_begin + seg_len) 个元素中实际存在的部分, 返回元素个数, 块的末尾可能不满甚至为空
+static size_t segment_range(const FlexTree_Context &ft_ctx, const size_t &block, const size_t &seg_begin, const size_t &seg_len)
+{
+    const size_t start = ft_ctx.split_size * block;
+    if (start >= ft_ctx.data_size) return 0;
+    const size_t block_len = std::min(ft_ctx.split_size, ft_ctx.data_size - start);
+    if (seg_begin >= block_len) return 0;
+    return std::min(block_len - seg_begin, seg_len);
+}
+
+// 消息的 tag 由这是通信域上的第几次 allreduce (epoch), 阶段和这个阶段中的第几步 (tree 的 stage, ring 的 step) 决定.
+// 不同步的消息不会互相匹配, 正确性只依赖点对点的依赖关系, 各步之间不需要 barrier, 快的节点可以先往前走;
+// 同一个通信域上同时进行的几次非阻塞 allreduce 也不会互相匹配.
+enum Tag_Phase
+{
+    TAG_REDUCE = 0,
+    TAG_BROADCAST = 1
+};
+
+/**
+ * 某一步的消息的 tag.
+ * 
+ * @param epoch 这次 allreduce 的编号, 见 next_epoch
+ * @param phase reduce 阶段还是广播阶段
+ * @param step 这个阶段中的第几步
+ * @param num_steps 每个阶段的总步数
+ */
+static int step_tag(const size_t &epoch, const Tag_Phase &phase, const size_t &step, const size_t &num_steps)
+{
+    static const size_t tag_limit = []()
+    {
+        int *tag_ub, flag;
+        MPI_Comm_get_attr(MPI_COMM_WORLD, MPI_TAG_UB, &tag_ub, &flag);
+        return (size_t)(flag ? *tag_ub : 32767) + 1; // 标准保证至少是 32767
+    }();
+    // tag 空间按 epoch 分成若干份循环使用, 同时进行的 allreduce 不超过这个份数就不会冲突
+    const size_t slots = std::max<size_t>(tag_limit / (2 * num_steps), 1);
+    return (((epoch % slots) * 2 + phase) * num_steps + step) % tag_limit;
+}
+
+/**
+ * 挂在通信域上的 T 类型的对象, 第一次用到时默认构造, 作为属性随通信域一起释放 (MPI_Comm_free 或者 MPI_Finalize).
+ * 复制通信域时不会复制过去.
+ */
+template<class T>
+static T &comm_object(const MPI_Comm &comm)
+{
+    static std::mutex mutex;
+    static int keyval = MPI_KEYVAL_INVALID;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (keyval == MPI_KEYVAL_INVALID)
+    {
+        auto free_object = [](MPI_Comm, int, void *value, void *) -> int
+        {
+            delete static_cast<T*>(value);
+            return MPI_SUCCESS;
+        };
+        MPI_Comm_create_keyval(MPI_COMM_NULL_COPY_FN, free_object, &keyval, nullptr);
+    }
+    T *object;
+    int flag;
+    MPI_Comm_get_attr(comm, keyval, &object, &flag);
+    if (!flag)
+    {
+        object = new T();
+        MPI_Comm_set_attr(comm, keyval, object);
+    }
+    return *object;
+}
+
+struct Epoch_Counter
+{
+    std::atomic<size_t> next{0};
+};
+
+// 通信域上的下一个 allreduce 编号. 集合通信在所有节点上的调用顺序相同, 所以各个节点拿到的编号一致.
+static size_t next_epoch(const MPI_Comm &comm)
+{
+    return comm_object<Epoch_Counter>(comm).next++;
+}
+
+/**
+ * 要在 MPI_Finalize 之前释放的 MPI 资源 (窗口, 通信域). 子类在 release 中释放它们, 析构时也要调用 release.
+ * MPI_Finalize 一开始就删除 MPI_COMM_SELF 上的属性, 这时 MPI 还能正常使用; MPI_COMM_WORLD 上的属性 (比如计划缓存) 删得晚,
+ * 那时已经不能再释放窗口了. 所以挂一个 Finalizer 在 MPI_COMM_SELF 上, 由它按创建的顺序释放还活着的对象.
+ * 释放都是集合操作, 各个 rank 按同样的顺序创建这些对象.
+ */
+class Mpi_Resource
+{
+public:
+    Mpi_Resource()
+    {
+        comm_object<Finalizer>(MPI_COMM_SELF);
+        std::lock_guard<std::mutex> lock(live_mutex());
+        live().push_back(this);
+    }
+    virtual ~Mpi_Resource()
+    {
+        std::lock_guard<std::mutex> lock(live_mutex());
+        live().erase(std::find(live().begin(), live().end(), this));
+    }
+    virtual void release() = 0;
+private:
+    struct Finalizer
+    {
+        ~Finalizer()
+        {
+            // release 可能删掉排在后面的对象 (比如释放通信域时删掉挂在它上面的对象), 所以每次都重新取
+            for (size_t k = 0; ; k++)
+            {
+                Mpi_Resource *resource;
+                {
+                    std::lock_guard<std::mutex> lock(live_mutex());
+                    if (k >= live().size()) break;
+                    resource = live()[k];
+                }
+                resource->release();
+            }
+        }
+    };
+    static std::vector<Mpi_Resource*> &live()
+    {
+        static std::vector<Mpi_Resource*> resources;
+        return resources;
+    }
+    static std::mutex &live_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+};
+
+// 分组 allreduce 的一片缓冲区, 和 struct iovec 一样是 (地址, 长度), 只是长度按元素个数计
+struct Iovec
+{
+    void *base;
+    size_t count;
+};
+
+/**
+ * 分组 allreduce 的一组缓冲区, 逻辑上首尾相接成一个向量, FlexTree_Context 按这个向量的总长度分块.
+ * 收发和 reduce 都按逻辑上的元素位置找到所在的那一片, 不需要先拷进一块连续的内存. 发送和接收的两组各片长度相同, 所以分片的边界也相同.
+ */
+class Iovec_List
+{
+public:
+    // 一次收发的缓冲区. 跨片时是一个从 MPI_BOTTOM 开始的 hindexed 类型 (derived 为 true), 挂出通信之后由调用者释放
+    struct Range
+    {
+        void *buf;
+        int count;
+        MPI_Datatype type;
+        bool derived;
+    };
+
+    Iovec_List(const Iovec *iov, const size_t &n, const size_t &_extent): extent(_extent), first(1, 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            base.push_back((char*)iov[i].base);
+            first.push_back(first.back() + iov[i].count);
+        }
+    }
+    size_t size() const
+    {
+        return first.back();
+    }
+    // 第 start 个元素的地址
+    char *address(const size_t &start) const
+    {
+        const size_t k = piece(start);
+        return base[k] + (start - first[k]) * extent;
+    }
+    // 从第 start 个元素开始, 在同一片中连续的元素个数, 不超过 count
+    size_t contiguous(const size_t &start, const size_t &count) const
+    {
+        return std::min(count, first[piece(start) + 1] - start);
+    }
+    // [start, start + count) 跨了几片
+    size_t pieces(size_t start, size_t count) const
+    {
+        size_t n = 0;
+        while (count > 0)
+        {
+            const size_t len = contiguous(start, count);
+            start += len;
+            count -= len;
+            n++;
+        }
+        return n;
+    }
+    Range range(size_t start, size_t count, const MPI_Datatype &datatype) const
+    {
+        if (contiguous(start, count) == count)
+        {
+            return Range{address(start), (int)count, datatype, false};
+        }
+        std::vector<int> lengths;
+        std::vector<MPI_Aint> displacements;
+        while (count > 0)
+        {
+            const size_t len = contiguous(start, count);
+            MPI_Aint address_of;
+            MPI_Get_address(address(start), &address_of);
+            lengths.push_back(len);
+            displacements.push_back(address_of);
+            start += len;
+            count -= len;
+        }
+        Range r = {MPI_BOTTOM, 1, MPI_DATATYPE_NULL, true};
+        MPI_Type_create_hindexed(lengths.size(), lengths.data(), displacements.data(), datatype, &r.type);
+        MPI_Type_commit(&r.type);
+        return r;
+    }
+private:
+    const size_t extent;
+    std::vector<char*> base;
+    std::vector<size_t> first; // 每一片第一个元素在逻辑向量中的位置, 最后一项是总长度
+
+    // 第 start 个元素所在的片. 长度为 0 的片不会被选中
+    size_t piece(const size_t &start) const
+    {
+        return std::upper_bound(first.begin(), first.end(), start) - first.begin() - 1;
+    }
+};
+
+// 单纯的发送, 只负责安排工作, 不等待工作完成.
+// 只发送每一块中 [seg_begin, seg_begin + seg_len) 这一段, 默认是整块.
+// persistent 为 true 时只生成持久化的请求 (MPI_Send_init), 由调用者 MPI_Start.
+// iov 不为 null 时 data 不用, 数据分散在 iov 的各片中 (分组 allreduce).
+static size_t handle_send(const MPI_Comm &comm, const MPI_Datatype &datatype, const std::vector<Operation> *ops, const void *data, const FlexTree_Context &ft_ctx, MPI_Request request[], const int &tag = 0, const size_t &seg_begin = 0, const size_t &seg_len = SIZE_MAX, const bool &persistent = false, const Iovec_List *iov = nullptr)
+{
+
+    size_t start;
+    size_t request_index = 0;
+
+    for (const auto &i : *ops)
+    {
+        if (LIKELY(ft_ctx.node_label != i.peer))
+        {
+            for (const auto &j : i.blocks)
+            {
+                start = ft_ctx.split_size * j + seg_begin;
+                //LOG_IF(INFO, node_label == 4) << "##4 send " << j << " which is " << start << "+" << count << " to " << i.peer ;
+                const size_t count = segment_range(ft_ctx, j, seg_begin, seg_len);
+                // 当前块 (段) 超出实际的数据范围, 根本不发送
+                if (UNLIKELY(count == 0))
+                {
+#ifdef FT_DEBUG
+                    std::cout << ft_ctx.node_label << " will not send " << j << " which starts from " << start << " to " << i.peer << " because it's empty." << std::endl;
+#endif
+                    continue;
+                }
+#ifdef FT_DEBUG
+                std::cout << ft_ctx.node_label << " send " << j << " which is " << start << "+" << count << " to " << i.peer << ", element size = " << ft_ctx.type_size << std::endl;
+#endif
+                Iovec_List::Range r = (iov != nullptr ? iov->range(start, count, datatype) : Iovec_List::Range{(char*)data + start * ft_ctx.type_extent, (int)count, datatype, false});
+                if (persistent)
+                {
+                    MPI_Send_init(r.buf, r.count, r.type, i.peer, tag, comm, &request[request_index++]);
+                }
+                else
+                {
+                    MPI_Isend(r.buf, r.count, r.type, i.peer, tag, comm, &request[request_index++]);
+                }
+                // 跨片的临时类型挂出之后就可以释放, 不影响正在进行的通信
+                if (r.derived) MPI_Type_free(&r.type);
+            }
+        }
+    }
+    return request_index;
+}
+
+// 同上, 只负责安排工作, 不等待工作完成.
+// accordingly 参数的含义是, 如果为 true, 那么把数据块写到 buffer 中对应的位置去; 如果为 false, 那么直接平铺在 buffer 中.
+// 平铺的时候每一块仍然占 split_size 个元素的位置, 所以分段接收时各段落在各自的位置上.
+// iov 不为 null 时 (只能和 accordingly 一起用) 写到 iov 的各片中, buffer 不用.
+static size_t handle_recv(const MPI_Comm &comm, const MPI_Datatype &datatype, const std::vector<Operation> *ops, void *buffer, const FlexTree_Context &ft_ctx, const bool &accordingly, MPI_Request request[], const int &tag = 0, const size_t &seg_begin = 0, const size_t &seg_len = SIZE_MAX, const bool &persistent = false, const Iovec_List *iov = nullptr)
+{
+
+    size_t start = 0;
+    size_t request_index = 0;
+
+    for (const auto &i : *ops)
+    {
+        if (LIKELY(ft_ctx.node_label != i.peer))
+        {
+            for (const auto &j : i.blocks)
+            {
+                size_t split_accord_start = ft_ctx.split_size * j;
+                if (accordingly) 
+                {
+                    start = split_accord_start;
+                }
+                const size_t count = segment_range(ft_ctx, j, seg_begin, seg_len);
+                // 当前块 (段) 超出实际的数据范围, 根本不接收
+                if (UNLIKELY(count == 0))
+                {
+#ifdef FT_DEBUG
+                    std::cout << ft_ctx.node_label << " will not recv " << j << " from " << i.peer << " because it's empty" << std::endl;
+#endif
+                }
+                else
+                {
+#ifdef FT_DEBUG
+                    std::cout << ft_ctx.node_label << " recv " << j << " which will be placed to " << start + seg_begin << "+" << count << " from " << i.peer << ", element size = " << ft_ctx.type_size << std::endl;
+#endif
+                    Iovec_List::Range r = (iov != nullptr ? iov->range(start + seg_begin, count, datatype) : Iovec_List::Range{(char*)buffer + (start + seg_begin) * ft_ctx.type_extent, (int)count, datatype, false});
+                    if (persistent)
+                    {
+                        MPI_Recv_init(r.buf, r.count, r.type, i.peer, tag, comm, &request[request_index++]);
+                    }
+                    else
+                    {
+                        MPI_Irecv(r.buf, r.count, r.type, i.peer, tag, comm, &request[request_index++]);
+                    }
+                    if (r.derived) MPI_Type_free(&r.type);
+                }
+                
+                if (!accordingly)
+                {
+                    start += ft_ctx.split_size;
+                }
+            }
+        }
+    }
+    return request_index;
+}
+
+// 一次 reduce 的全部 task 和它们的来源指针. task 的长度已经按 kernel 换算好, 整理一次之后可以反复执行 (持久化的 plan)
+struct Reduce_Table
+{
+    std::vector<const void*> src;
+    std::vector<Reduce_Task> tasks;
+    size_t num_src;
+    bool to_master;
+};
+
+// 整理一次 reduce 的 task, 之后由 run_reduce 一次性交给线程池. 会自动包含自己的那块 data.
+// 这里的 dest 是一块和 data 大小/结构相同的一块内存. 进行 reduce 的时候, 会把结果对应地放进 dest 去. 注意 dest 不可以是 null.
+// master 不为 null 时 (只用于 16 位浮点), 结果不舍入, 直接以 float 写进 master 的对应位置, dest 不会被修改.
+// data_iov/dest_iov 不为 null 时 data/dest 分散在各片中 (分组 allreduce), 跨片的块每一片单独作为一个 task.
+static void build_reduce(Reduce_Table &table, const Reduce_Kernel &kernel, const std::vector<size_t> *blocks, void *buffer, const void *data, void *dest, const FlexTree_Context &ft_ctx, const size_t &num_peers, void *extra_buffer = nullptr, const size_t &extra_peers = 0, float *master = nullptr, const size_t &seg_begin = 0, const size_t &seg_len = SIZE_MAX, const Iovec_List *data_iov = nullptr, const Iovec_List *dest_iov = nullptr)
+{
+    if (dest == nullptr && dest_iov == nullptr)
+    {
+        std::cerr << "I can't reduce to null. Aborted." << std::endl;
+        exit(1);
+    }
+    // 两组片的边界相同, 按哪一组切都一样
+    const Iovec_List *iov = (data_iov != nullptr ? data_iov : dest_iov);
+    const size_t peer_gap = blocks->size() * ft_ctx.split_size;
+    const size_t num_src = 1 + num_peers + extra_peers;
+    size_t num_tasks = blocks->size();
+    if (iov != nullptr)
+    {
+        num_tasks = 0;
+        for (auto i : *blocks)
+        {
+            num_tasks += iov->pieces(ft_ctx.split_size * i + seg_begin, segment_range(ft_ctx, i, seg_begin, seg_len));
+        }
+    }
+    table.num_src = num_src;
+    table.to_master = (master != nullptr);
+    table.src.resize(num_src * num_tasks);
+    table.tasks.clear();
+    table.tasks.reserve(num_tasks);
+    for (auto i = blocks->begin(); i != blocks->end(); i++)
+    {
+        const size_t start = ft_ctx.split_size * (*i) + seg_begin;
+        // 只处理这一块中 [seg_begin, seg_begin + seg_len) 这一段, 块的末尾可能不满
+        const size_t split_size = segment_range(ft_ctx, *i, seg_begin, seg_len);
+        if (UNLIKELY(split_size == 0))
+        {
+#ifdef FT_DEBUG
+            std::cout << ft_ctx.node_label << " will not reduce " << *i << " because it's empty." << std::endl;
+#endif
+            continue; // 当前块实际大小为零, 直接溜了.
+        }
+#ifdef FT_DEBUG
+        std::cout << ft_ctx.node_label << " reduce " << *i << " which size is " << split_size << ", element size = " << ft_ctx.type_size << std::endl;
+#endif
+        // 这一块在接收区中的位置
+        const size_t offset = (i - blocks->begin()) * ft_ctx.split_size + seg_begin;
+        for (size_t done = 0; done < split_size; )
+        {
+            const size_t at = start + done;
+            const size_t count = (iov != nullptr ? iov->contiguous(at, split_size - done) : split_size);
+            size_t src_index = 0;
+            const void **task_src = table.src.data() + num_src * table.tasks.size();
+            task_src[src_index++] = (data_iov != nullptr ? data_iov->address(at) : (const char*)data + at * ft_ctx.type_extent);
+            void *dst = (master != nullptr ? (void*)(master + at) : (dest_iov != nullptr ? (void*)dest_iov->address(at) : (void*)((char*)dest + at * ft_ctx.type_extent)));
+            size_t pos = offset + done;
+            for (size_t j = 0; j < num_peers; j++)
+            {
+                task_src[src_index++] = (const char*)buffer + pos * ft_ctx.type_extent;
+#ifdef FT_DEBUG
+                std::cout << "  --" << ft_ctx.node_label << " will reduce data at " << pos << std::endl;
+#endif
+                pos += peer_gap;
+            }
+            pos = offset + done;
+            for (size_t j = 0; j < extra_peers; j++)
+            {
+                task_src[src_index++] = (const char*)extra_buffer + pos * ft_ctx.type_extent;
+                pos += peer_gap;
+            }
+            // 普通的 kernel 按基本类型的元素个数处理, 派生类型每个元素包含 multiple 个
+            const size_t len = (master != nullptr || kernel.generic ? count : count * kernel.multiple);
+            table.tasks.push_back(Reduce_Task{task_src, dst, len});
+            done += count;
+        }
+    }
+}
+
+// 执行整理好的 reduce, 一个 stage 只有一次 dispatch
+static void run_reduce(const Reduce_Kernel &kernel, const Reduce_Table &table, const FlexTree_Context &ft_ctx)
+{
+    if (table.tasks.empty())
+    {
+        return;
+    }
+    // 只有自己一个来源时 kernel 什么都不做 (原地的情况). 不规则的树中只有一个节点的组, 需要把 data 复制到 dest
+    if (table.num_src == 1 && !table.to_master)
+    {
+        for (const auto &task : table.tasks)
+        {
+            const size_t count = (kernel.generic ? task.len : task.len / kernel.multiple);
+            copy_local(task.src[0], task.dst, count, kernel.datatype, ft_ctx.type_dense, ft_ctx.type_extent);
+        }
+        return;
+    }
+    const Width_Class wc = width_class(table.num_src);
+    if (table.to_master)
+    {
+        kernel.master_kernels.fn[wc](table.tasks.data(), table.tasks.size(), table.num_src);
+    }
+    else if (kernel.generic)
+    {
+        reduce_generic(kernel.datatype, kernel.op, table.tasks.data(), table.tasks.size(), table.num_src, ft_ctx);
+    }
+    else
+    {
+        kernel.kernels.fn[wc](table.tasks.data(), table.tasks.size(), table.num_src);
+    }
+}
+
+// 16 位浮点和 float 主副本之间的转换, 共 count 个元素. to_master 为 true 时 src 是 16 位浮点, dst 是 float, 否则反过来.
+static void convert_master(const MPI_Datatype &datatype, const void *src, void *dst, const size_t &count, const bool &to_master)
+{
+    const void *task_src[1] = {src};
+    const Reduce_Task task = {task_src, dst, count};
+    const bool bf16 = (datatype == bfloat16_type());
+    if (to_master && bf16) reduce_parallel<Op_Sum, BFloat16, float, WIDTH_STREAM>(&task, 1, 1);
+    else if (to_master) reduce_parallel<Op_Sum, Half, float, WIDTH_STREAM>(&task, 1, 1);
+    else if (bf16) reduce_parallel<Op_Sum, float, BFloat16, WIDTH_STREAM>(&task, 1, 1);
+    else reduce_parallel<Op_Sum, float, Half, WIDTH_STREAM>(&task, 1, 1);
+}
+
+// FT_TOPO 的内容. 设置了 FT_TOPO_FILE 时从这个文件读, 写法相同, 可以分成多行, # 之后是注释. 每个文件只读一次
+static std::string topo_string()
+{
+    const char *file = getenv("FT_TOPO_FILE");
+    if (file != nullptr && file[0] != 0)
+    {
+        static std::mutex mutex;
+        static std::map<std::string, std::string> files;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto i = files.find(file);
+        if (i != files.end()) return i->second;
+        std::ifstream in(file);
+        if (!in)
+        {
+            std::cerr << "cannot open FT_TOPO_FILE " << file << std::endl;
+            exit(1);
+        }
+        std::string line, text;
+        while (std::getline(in, line))
+        {
+            for (char c : line.substr(0, line.find('#')))
+            {
+                if (!isspace((unsigned char)c)) text.push_back(c);
+            }
+        }
+        return files[file] = text;
+    }
+    const char *raw = getenv("FT_TOPO");
+    return raw == nullptr ? "" : raw;
+}
+
+// 以 [ 开头的是不规则的树, 见 Irregular_Topo
+static bool is_irregular_topo(const std::string &topo)
+{
+    return !topo.empty() && topo[0] == '[';
+}
+
+// 从环境变量获取每一层宽度
+// 任意一个位置是 1, 那就用 ring
+// 末尾的 +k 表示最后 k 个节点是孤立节点, 不在树里 (例如 113 个节点用 4,4,7+1), 各层宽度的积加上 k 应当等于总节点数
+// topo 默认是 FT_TOPO, 按消息大小选择引擎时 (见 Engine_Selector) 是选中的拓扑
+static std::vector<size_t> get_stages(const size_t &num_nodes, size_t *num_lonely = nullptr, const std::string &topo = topo_string())
+{
+    std::string FT_TOPO = topo;
+    const std::string FT_TOPO_raw = FT_TOPO;
+    std::vector<size_t> ans;
+    size_t pi = 1, lonely = 0;
+    int tmp;
+    if (is_irregular_topo(FT_TOPO))
+    {
+        std::cerr << "FT_TOPO " << FT_TOPO << " is an irregular tree and has no uniform stage widths" << std::endl;
+        exit(1);
+    }
+    const size_t plus = FT_TOPO.find('+');
+    if (plus != std::string::npos)
+    {
+        lonely = strtoul(FT_TOPO.c_str() + plus + 1, nullptr, 10);
+        if (num_lonely == nullptr || lonely == 0 || lonely >= num_nodes)
+        {
+            std::cerr << "invalid FT_TOPO " << FT_TOPO << std::endl;
+            exit(1);
+        }
+        FT_TOPO.resize(plus);
+    }
+    if (num_lonely != nullptr)
+    {
+        *num_lonely = lonely;
+    }
+    if (FT_TOPO.empty())
+    {
+        ans = {num_nodes - lonely};
+    }
+    else 
+    {
+        for (char &i : FT_TOPO)
+        {
+            if (i == ',') i = ' ';
+        }
+        std::istringstream ss(FT_TOPO);
+        while(!ss.eof())
+        {
+            ss >> tmp;
+            if (tmp == 1)
+            {
+                // ring 不支持孤立节点
+                if (lonely != 0)
+                {
+                    std::cerr << "invalid FT_TOPO " << FT_TOPO_raw << ": ring has no lonely nodes" << std::endl;
+                    exit(1);
+                }
+                return {1};
+            }
+            ans.push_back(tmp);
+            pi *= tmp;
+        }
+        if (pi + lonely != num_nodes)
+        {
+            std::cerr << "invalid FT_TOPO " << FT_TOPO << std::endl;
+            exit(1);
+        }
+    }
+#ifdef FT_DEBUG
+    std::cout << "FlexTree topo is ";
+    for (auto i:ans)
+    {
+        std::cout << i << " ";
+    }
+    std::cout << "+" << lonely << std::endl;
+#endif
+    return ans;
+}
+
+// 没有给出拓扑 (FT_TOPO 为空) 时树的各层宽度, 由代价模型按消息大小选择 (见 cost_model/cost_model.hpp). 设置 FT_COST_MODEL=0 时是扁平的树
+static std::vector<size_t> model_stages(const size_t &num_nodes, const size_t &bytes)
+{
+    static const bool enabled = get_env_size("FT_COST_MODEL", 1) != 0;
+    if (!enabled || num_nodes < 2) return {num_nodes};
+    std::vector<size_t> stages;
+    for (auto width : cost_model::cached_best_width((int)num_nodes, bytes))
+    {
+        stages.push_back(width);
+    }
+    return stages;
+}
+
+// allreduce 的算法, 由环境变量 FT_ALGO 选择:
+// tree (默认, 拓扑由 FT_TOPO 给出, 其中有 1 时是 ring), ring, doubling, halving, rabenseifner (后三种见 Butterfly_Allreduce)
+enum Algorithm
+{
+    ALGO_TREE,
+    ALGO_RING,
+    ALGO_DOUBLING,
+    ALGO_HALVING,
+    ALGO_RABENSEIFNER
+};
+
+// FT_ALGO 的原文
+static std::string algo_string()
+{
+    const char *raw = getenv("FT_ALGO");
+    return raw == nullptr ? "" : raw;
+}
+
+static Algorithm get_algorithm(const std::string &name = algo_string())
+{
+    if (name.empty() || name == "tree") return ALGO_TREE;
+    if (name == "ring") return ALGO_RING;
+    if (name == "doubling") return ALGO_DOUBLING;
+    if (name == "halving") return ALGO_HALVING;
+    if (name == "rabenseifner") return ALGO_RABENSEIFNER;
+    std::cerr << "invalid FT_ALGO " << name << std::endl;
+    exit(1);
+}
+
+// tree 的 reduce 阶段用双边的 Isend/Irecv 还是单边的 MPI_Put (见 Rma_Stages). 和 FT_ALGO 一样每次调用都读 FT_TRANSPORT
+enum Transport
+{
+    TRANSPORT_P2P,
+    TRANSPORT_RMA
+};
+
+static Transport get_transport()
+{
+    const char *raw = getenv("FT_TRANSPORT");
+    const std::string name = (raw == nullptr ? "" : raw);
+    if (name.empty() || name == "p2p") return TRANSPORT_P2P;
+    if (name == "rma") return TRANSPORT_RMA;
+    std::cerr << "invalid FT_TRANSPORT " << name << std::endl;
+    exit(1);
+}
+
+// 一次 allreduce 用的引擎: FT_ALGO 和 FT_TOPO 的原文. 默认来自环境变量, 也可以按消息大小选择 (见 Engine_Selector)
+struct Engine
+{
+    std::string algo, topo;
+};
+
+static Engine env_engine()
+{
+    return Engine{algo_string(), topo_string()};
+}
+
+// 不超过 n 的最大的 2 的幂
+static size_t pow2_floor(const size_t &n)
+{
+    size_t p = 1;
+    while (p * 2 <= n) p *= 2;
+    return p;
+}
+
+/**
+ * 接收缓冲区的内存. 用匿名映射分配, 分配时不写入, 物理页落在第一次写入它的线程所在的 NUMA 节点上.
+ * 使用它的调度在第一次 start 时按自己 reduce 的分段方式写一遍 (见 first_touch), 然后把 placed 设为 true.
+ */
+class Staging_Buffer
+{
+public:
+    bool placed = false;
+
+    Staging_Buffer() {}
+    Staging_Buffer(const Staging_Buffer &) = delete;
+    Staging_Buffer &operator=(const Staging_Buffer &) = delete;
+    ~Staging_Buffer()
+    {
+        release();
+    }
+    char *data() const
+    {
+        return ptr;
+    }
+    size_t size() const
+    {
+        return length;
+    }
+    // 保证至少有 bytes 字节, 不够时重新分配, 原来的内容不保留
+    void reserve(const size_t &bytes)
+    {
+        if (bytes <= length) return;
+        release();
+        void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+        {
+            std::cerr << "FlexTree failed to allocate a buffer of " << bytes << " bytes. Aborted." << std::endl;
+            exit(1);
+        }
+        ptr = (char*)p;
+        length = bytes;
+        placed = false;
+    }
+private:
+    char *ptr = nullptr;
+    size_t length = 0;
+
+    void release()
+    {
+        if (ptr != nullptr) munmap(ptr, length);
+        ptr = nullptr;
+        length = 0;
+    }
+};
+
+// NOTE: 可别把这个buffer给私自delete了
+static Staging_Buffer* flextree_register_the_buffer(size_t _size)
+{
+    static Staging_Buffer buffer;
+    if (_size > buffer.size())
+    {
+#ifdef FT_DEBUG
+        std::cout << "registered a buffer of " << _size << std::endl;
+#endif
+        buffer.reserve(_size);
+    }
+    return &buffer;
+}
+
+// ops 中需要收发的块数, 也就是 handle_send/handle_recv 最多会产生的请求数
+static size_t count_requests(const std::vector<Operation> &ops, const size_t &node_label)
+{
+    size_t n = 0;
+    for (const auto &i : ops)
+    {
+        if (i.peer != node_label) n += i.blocks.size();
+    }
+    return n;
+}
+
+// 等待一组请求. block 为 false 时只检查一次, 还没有全部完成就返回 false.
+static bool wait_requests(std::vector<MPI_Request> &requests, const bool &block)
+{
+    if (requests.empty()) return true;
+    if (block)
+    {
+        MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+        return true;
+    }
+    int flag;
+    MPI_Testall(requests.size(), requests.data(), &flag, MPI_STATUSES_IGNORE);
+    return flag != 0;
+}
+
+/**
+ * 一次 allreduce 的调度. tree 和 ring 都写成可以中途停下的状态机:
+ * start 挂出最开始的通信, advance 一直推进到需要等待还没完成的通信为止.
+ * 所以既可以阻塞地一直做完, 也可以在 test 或者后台的进度线程里轮询.
+ * 
+ * 持久化的调度 (见 allreduce_init) 在构造时就生成好所有的持久化请求 (MPI_Send_init/MPI_Recv_init) 和 reduce 的来源表,
+ * 之后每次 start 只是 MPI_Startall, 不再分配内存.
+ */
+class Allreduce_Schedule
+{
+public:
+    /**
+     * @param _data 原始数据, 为 nullptr 时表示原地 ar, 直接用 _dst
+     * @param _master 不为 null 时最终结果以 float 保存在其中 (只用于 16 位浮点)
+     * @param _staging 接收缓冲区, 为 nullptr 时自己分配一块. 非阻塞调用可能同时有好几个在进行, 不能共用全局的缓冲区
+     * @param _persistent 是否是持久化的调度. 持久化的调度在构造时取 epoch, 每次 start 都用同样的 tag
+     */
+    Allreduce_Schedule(const MPI_Datatype &_datatype, const Reduce_Kernel &_kernel, const MPI_Comm &_comm, const void *_data, void *_dst, const FlexTree_Context &_ft_ctx, float *_master, Staging_Buffer *_staging, const bool &_persistent): datatype(_datatype), kernel(_kernel), comm(_comm), data(_data == nullptr ? _dst : _data), dst(_dst), ft_ctx(_ft_ctx), master_ctx(_comm, MPI_FLOAT, _ft_ctx.data_size, _ft_ctx.num_lonely), master(_master), staging(_staging), persistent(_persistent), epoch(_persistent ? next_epoch(_comm) : 0)
+    {
+        if (staging == nullptr)
+        {
+            // tree 相邻的两个 stage 各用一半
+            own_buffer.reserve(ft_ctx.buffer_bytes(2 * ft_ctx.stage_size));
+            staging = &own_buffer;
+        }
+        buffer = staging->data() + ft_ctx.buffer_front();
+    }
+    virtual ~Allreduce_Schedule() {}
+    /**
+     * 换一组缓冲区, 只用于非持久化的调度 (计划缓存里的调度每次调用前重新绑定). 参数的含义同构造函数, 
+     * master 是否为 null 必须和构造时一样. 自己分配了接收缓冲区的调度 (比如单边传输的窗口建在上面) 不换接收缓冲区.
+     */
+    void bind(const void *_data, void *_dst, float *_master, Staging_Buffer *_staging)
+    {
+        data = (_data == nullptr ? _dst : _data);
+        dst = _dst;
+        master = _master;
+        if (_staging != nullptr && staging != &own_buffer)
+        {
+            staging = _staging;
+            buffer = staging->data() + ft_ctx.buffer_front();
+        }
+    }
+    const FlexTree_Context &context() const
+    {
+        return ft_ctx;
+    }
+    /**
+     * 分组 allreduce: 数据分散在各片中 (见 Iovec_List), 之后不再使用 data 和 dst. 原地时两组是同一组.
+     * 只用于非持久化的调度, 在 start 之前调用; 只有 tree 支持, 其他调度返回 false.
+     */
+    virtual bool bind_iov(const Iovec_List *, const Iovec_List *)
+    {
+        return false;
+    }
+    // 开始一次 allreduce, 挂出最开始的通信
+    virtual void start() = 0;
+    // 推进. block 为 true 时一直做到完成; 否则做到需要等待还没完成的通信为止. 完成时返回 true
+    virtual bool advance(const bool &block) = 0;
+protected:
+    const MPI_Datatype datatype;
+    const Reduce_Kernel kernel;
+    const MPI_Comm comm;
+    const void *data;
+    void *dst;
+    const FlexTree_Context ft_ctx;
+    // 主副本按 float 的偏移量收发, 分块和 ft_ctx 完全一样
+    const FlexTree_Context master_ctx;
+    float *master;
+    Staging_Buffer *staging;
+    char *buffer;
+    Staging_Buffer own_buffer;
+    const bool persistent;
+    size_t epoch; // 这次 allreduce 的编号, 决定消息的 tag
+    Reduce_Table reduce_scratch; // 非持久化的调度每次 reduce 都重新整理来源, 反复使用这一张表
+
+    // 启动一组持久化请求, 并把它们追加到 out 中等待
+    static void start_persistent(std::vector<MPI_Request> &requests, std::vector<MPI_Request> &out)
+    {
+        if (requests.empty()) return;
+        MPI_Startall(requests.size(), requests.data());
+        out.insert(out.end(), requests.begin(), requests.end());
+    }
+    static void free_persistent(std::vector<MPI_Request> &requests)
+    {
+        for (auto &r : requests)
+        {
+            MPI_Request_free(&r);
+        }
+        requests.clear();
+    }
+};
+
+/**
+ * tree 的 reduce 阶段的单边传输. 缓冲区的两半各开一个窗口, 相邻两个 stage 的暴露期可以同时存在.
+ * 每个 stage 用 PSCW 同步: 接收方对这个 stage 的来源 MPI_Win_post, 发送方 MPI_Win_start 之后把每一块 MPI_Put 到对方接收区中
+ * handle_recv 会放它的位置, 接收方 MPI_Win_test/MPI_Win_wait 成功之后就可以 reduce.
+ * 每个 stage 和每个对象只同步一次, 不需要每块一对请求, 也没有消息匹配的开销.
+ * 窗口建在调度自己的缓冲区上, 所以用单边传输的调度不用全局的缓冲区.
+ * 只用于阻塞调用: MPI_Win_complete 可能要等到对方 post 才返回, 同时进行的几个非阻塞调用会互相等待;
+ * 而一次阻塞调用中 complete 等待的只是对方更早的 stage, 不会形成环.
+ */
+class Rma_Stages: public Mpi_Resource
+{
+public:
+    /**
+     * 集合操作, comm 上所有节点 (包括孤立节点) 都要构造.
+     * @param _stages 规则的树各层的宽度, 不规则的树时用 _topo 算出每个对象的宽度
+     */
+    Rma_Stages(const MPI_Comm &_comm, const MPI_Datatype &_datatype, const FlexTree_Context &_ft_ctx, const Staging_Buffer &staging, const Send_Ops &send_ops, const Recv_Ops &recv_ops, const std::vector<size_t> &_stages, const Irregular_Topo *_topo): datatype(_datatype), ft_ctx(_ft_ctx), exposed{false, false}
+    {
+        MPI_Info info;
+        MPI_Info_create(&info);
+        MPI_Info_set(info, "no_locks", "true");
+        for (auto &w : win)
+        {
+            MPI_Win_create(staging.data(), staging.size(), 1, info, _comm, &w);
+        }
+        MPI_Info_free(&info);
+        MPI_Group all;
+        MPI_Comm_group(_comm, &all);
+        const size_t num_stages = (ft_ctx.node_label < ft_ctx.num_split ? _stages.size() : 0);
+        std::map<size_t, Recv_Ops> target_ops;
+        for (size_t i = 0; i < num_stages; i++)
+        {
+            // 这个 stage 的来源
+            std::vector<int> ranks;
+            for (const auto &op : recv_ops.ops[i])
+            {
+                if (op.peer != ft_ctx.node_label) ranks.push_back(op.peer);
+            }
+            origins.push_back(make_group(all, ranks));
+            // 这个 stage 的对象, 以及每一块在对象接收区里的位置
+            ranks.clear();
+            puts.emplace_back();
+            for (const auto &op : send_ops.ops[i])
+            {
+                if (op.peer == ft_ctx.node_label) continue;
+                ranks.push_back(op.peer);
+                auto it = target_ops.find(op.peer);
+                if (it == target_ops.end())
+                {
+                    it = target_ops.emplace(op.peer, Recv_Ops(ft_ctx.num_nodes, ft_ctx.num_lonely, op.peer, (_topo != nullptr ? _topo->widths(op.peer) : _stages), _topo)).first;
+                    it->second.generate_ops();
+                }
+                const size_t first = position(it->second.ops[i], op.peer);
+                // 不规则的树各个节点的 stage_size 不一样, 要用对象的
+                const size_t stage_size = (_topo != nullptr ? _topo->stage_size(op.peer, ft_ctx.split_size) : ft_ctx.stage_size);
+                for (size_t j = 0; j < op.blocks.size(); j++)
+                {
+                    const size_t count = segment_range(ft_ctx, op.blocks[j], 0, SIZE_MAX);
+                    if (count == 0) continue;
+                    const size_t elements = (i % 2) * stage_size + (first + j) * ft_ctx.split_size;
+                    puts.back().push_back(Put{(int)op.peer, op.blocks[j], count, (MPI_Aint)(ft_ctx.buffer_front() + elements * ft_ctx.type_extent)});
+                }
+            }
+            targets.push_back(make_group(all, ranks));
+        }
+        MPI_Group_free(&all);
+    }
+    ~Rma_Stages()
+    {
+        release();
+    }
+    virtual void release()
+    {
+        for (auto &w : win)
+        {
+            if (w != MPI_WIN_NULL) MPI_Win_free(&w);
+        }
+        for (auto *groups : {&origins, &targets})
+        {
+            for (auto &g : *groups)
+            {
+                if (g != MPI_GROUP_NULL) MPI_Group_free(&g);
+            }
+            groups->clear();
+        }
+    }
+    // 第 i 个 stage 的接收区可以被写了. 这一半缓冲区上一个 stage 的暴露期必须已经结束
+    void expose(const size_t &i)
+    {
+        if (origins[i] == MPI_GROUP_NULL) return;
+        MPI_Win_post(origins[i], 0, win[i % 2]);
+        exposed[i % 2] = true;
+    }
+    // 第 i 个 stage 的数据是否都到了. block 为 true 时一直等到为止
+    bool arrived(const size_t &i, const bool &block)
+    {
+        if (!exposed[i % 2]) return true;
+        int flag = 1;
+        if (block)
+        {
+            MPI_Win_wait(win[i % 2]);
+        }
+        else
+        {
+            MPI_Win_test(win[i % 2], &flag);
+        }
+        if (flag) exposed[i % 2] = false;
+        return flag != 0;
+    }
+    // 把第 i 个 stage 要发的块从 src 写到各个对象那里, 返回时 src 可以再被修改
+    void put(const size_t &i, const void *src)
+    {
+        if (targets[i] == MPI_GROUP_NULL) return;
+        MPI_Win_start(targets[i], 0, win[i % 2]);
+        for (const auto &p : puts[i])
+        {
+#ifdef FT_DEBUG
+            std::cout << ft_ctx.node_label << " put " << p.block << " to " << p.peer << " at byte " << p.disp << ", count = " << p.count << std::endl;
+#endif
+            MPI_Put((const char*)src + p.block * ft_ctx.split_size * ft_ctx.type_extent, p.count, datatype, p.peer, p.disp, p.count, datatype, win[i % 2]);
+        }
+        MPI_Win_complete(win[i % 2]);
+    }
+private:
+    struct Put
+    {
+        int peer;
+        size_t block, count;
+        MPI_Aint disp; // 在对象窗口里的字节偏移
+    };
+    const MPI_Datatype datatype;
+    const FlexTree_Context ft_ctx;
+    MPI_Win win[2] = {MPI_WIN_NULL, MPI_WIN_NULL};
+    std::vector<MPI_Group> origins, targets; // 每个 stage 的来源和对象, 没有时为 MPI_GROUP_NULL
+    std::vector<std::vector<Put>> puts;
+    bool exposed[2];
+
+    static MPI_Group make_group(const MPI_Group &all, const std::vector<int> &ranks)
+    {
+        MPI_Group group = MPI_GROUP_NULL;
+        if (!ranks.empty()) MPI_Group_incl(all, ranks.size(), ranks.data(), &group);
+        return group;
+    }
+    // 对象的接收区里, 来自 peer 的块从第几块开始. 和 handle_recv 一样, 除了自己之外的 op 依次平铺
+    size_t position(const std::vector<Operation> &ops, const size_t &self) const
+    {
+        size_t n = 0;
+        for (const auto &op : ops)
+        {
+            if (op.peer == ft_ctx.node_label) return n;
+            if (op.peer != self) n += op.blocks.size();
+        }
+        std::cerr << "FlexTree: " << ft_ctx.node_label << " is not a source of " << self << ". Aborted." << std::endl;
+        exit(1);
+    }
+};
+
+class Tree_Allreduce: public Allreduce_Schedule
+{
+public:
+    Tree_Allreduce(const MPI_Datatype &_datatype, const Reduce_Kernel &_kernel, const MPI_Comm &_comm, const void *_data, void *_dst, const FlexTree_Context &_ft_ctx, const std::vector<size_t> &_stages, float *_master, Staging_Buffer *_staging, const bool &_persistent = false, const Irregular_Topo *_topo = nullptr, const Transport &_transport = TRANSPORT_P2P): Allreduce_Schedule(_datatype, _kernel, _comm, _data, _dst, _ft_ctx, _master, _staging, _persistent), stages(_stages), send_ops(_ft_ctx.num_nodes, _ft_ctx.num_lonely, _ft_ctx.node_label, _stages, _topo), recv_ops(_ft_ctx.num_nodes, _ft_ctx.num_lonely, _ft_ctx.node_label, _stages, _topo), seg(_transport == TRANSPORT_RMA ? std::max<size_t>(_ft_ctx.split_size, 1) : segment_elements(_ft_ctx)), num_segs(std::max<size_t>((_ft_ctx.split_size + seg - 1) / seg, 1)), lonely(_ft_ctx.node_label >= _ft_ctx.num_split), phase(PHASE_DONE), stage(0), segment(0)
+    {
+        send_ops.generate_ops();
+        recv_ops.generate_ops();
+        if (_transport == TRANSPORT_RMA)
+        {
+            // 单边传输按整个 stage 同步, 不分段
+            rma.reset(new Rma_Stages(comm, datatype, ft_ctx, *staging, send_ops, recv_ops, stages, _topo));
+        }
+        seg_requests[0].resize(num_segs);
+        seg_requests[1].resize(num_segs);
+        if (ft_ctx.has_lonely && !lonely)
+        {
+            // 每个孤立节点交来的一块平铺在这里, 在最后一个 stage reduce 时一起加进去
+            lonely_buffer.resize(ft_ctx.buffer_bytes(ft_ctx.num_lonely * ft_ctx.split_size));
+        }
+        if (persistent)
+        {
+            build_persistent();
+        }
+    }
+    virtual ~Tree_Allreduce()
+    {
+        for (auto &table : persistent_requests)
+        {
+            for (auto &r : table)
+            {
+                free_persistent(r);
+            }
+        }
+        free_persistent(persistent_lonely[0]);
+        free_persistent(persistent_lonely[1]);
+    }
+    virtual void start()
+    {
+        if (!persistent)
+        {
+            epoch = next_epoch(comm);
+        }
+        stage = 0;
+        segment = 0;
+        send_requests.clear();
+        reduce_send_requests.clear();
+        lonely_requests.clear();
+        if (lonely)
+        {
+            // 孤立节点把每一块交给负责它的树节点, 然后等着收最终结果
+            phase = PHASE_LONELY_SEND;
+            post_lonely(LONELY_GATHER, lonely_requests);
+            return;
+        }
+        if (!staging->placed)
+        {
+            place_buffer();
+        }
+        phase = PHASE_REDUCE;
+        if (ft_ctx.has_lonely)
+        {
+            // 孤立节点的数据和树的各个 stage 同时传输
+            post_lonely(LONELY_GATHER, lonely_requests);
+        }
+        post_recv(REDUCE_RECV, 0);
+        if (stages.size() > 1)
+        {
+            post_recv(REDUCE_RECV, 1);
+        }
+        for (size_t s = 0; s < num_segs; s++)
+        {
+            post_send(REDUCE_SEND, 0, s);
+        }
+    }
+    virtual bool advance(const bool &block)
+    {
+        while (phase != PHASE_DONE)
+        {
+            if (phase == PHASE_LONELY_SEND)
+            {
+                if (!wait_requests(lonely_requests, block)) return false;
+                // 原地 ar 时收发的是同一块内存, 所以发送全部完成之后才开始接收
+                lonely_requests.clear();
+                post_lonely(LONELY_SCATTER, lonely_requests);
+                phase = PHASE_DRAIN;
+                continue;
+            }
+            if (phase == PHASE_REDUCE_SEND)
+            {
+                // 广播收到的数据要写进 reduce 阶段发出去的那些块, 所以先等这些发送完成
+                if (!wait_requests(reduce_send_requests, block)) return false;
+                reduce_send_requests.clear();
+                phase = PHASE_BROADCAST;
+                post_recv(BCAST_RECV, stage);
+                continue;
+            }
+            if (phase == PHASE_DRAIN)
+            {
+                if (!wait_requests(send_requests, block) || !wait_requests(lonely_requests, block)) return false;
+                send_requests.clear();
+                lonely_requests.clear();
+                if (master != nullptr)
+                {
+                    convert_master(datatype, master, dst, ft_ctx.data_size, false);
+                }
+                phase = PHASE_DONE;
+#ifdef FT_DEBUG
+                std::cout << "-------- FT DEBUG: complete allreduce --------" << std::endl;
+#endif
+                break;
+            }
+            // 最后一个 stage 的 reduce 要把孤立节点的数据一起加进去
+            if (phase == PHASE_REDUCE && stage + 1 == stages.size() && !lonely_requests.empty())
+            {
+                if (!wait_requests(lonely_requests, block)) return false;
+                lonely_requests.clear();
+            }
+            if (phase == PHASE_REDUCE && rma)
+            {
+                if (!rma->arrived(stage, block)) return false;
+            }
+            else if (!wait_requests(seg_requests[stage % 2][segment], block)) return false;
+            if (phase == PHASE_REDUCE)
+            {
+                reduce_segment();
+            }
+            else
+            {
+                broadcast_segment();
+            }
+        }
+        return true;
+    }
+    virtual bool bind_iov(const Iovec_List *_data_iov, const Iovec_List *_dst_iov)
+    {
+        // 单边传输按连续的缓冲区算好了偏移
+        if (persistent || rma || master != nullptr) return false;
+        data_iov = _data_iov;
+        dst_iov = _dst_iov;
+        return true;
+    }
+private:
+    enum Phase
+    {
+        PHASE_REDUCE,      // reduce-scatter, stage 从 0 往上
+        PHASE_REDUCE_SEND, // 等待 reduce 阶段的发送完成, 然后开始接收广播
+        PHASE_BROADCAST,   // allgather, stage 从最上面往下
+        PHASE_LONELY_SEND, // 孤立节点: 等待交给树节点的数据发送完成
+        PHASE_DRAIN,       // 等待剩下的发送 (孤立节点是接收) 完成
+        PHASE_DONE
+    };
+    // 每个 stage 的每一段有这四组通信
+    enum Post_Kind
+    {
+        REDUCE_SEND,
+        REDUCE_RECV,
+        BCAST_SEND,
+        BCAST_RECV,
+        NUM_POST_KINDS
+    };
+    // 孤立节点和树节点之间的两组通信, 都是整块的, 不分段
+    enum Lonely_Kind
+    {
+        LONELY_GATHER,  // 孤立节点把第 j 块发给树节点 j
+        LONELY_SCATTER  // 树节点 j 把最终的第 j 块发回给孤立节点
+    };
+    const std::vector<size_t> stages;
+    Send_Ops send_ops;
+    Recv_Ops recv_ops;
+    // 每一块被切成 num_segs 段, 每段 seg 个元素 (见 segment_elements)
+    const size_t seg, num_segs;
+    // 每个 stage 的接收按段分开等待, 相邻两个 stage 各用一组
+    std::vector<std::vector<MPI_Request>> seg_requests[2];
+    // reduce 阶段还没有完成的发送, 在开始接收广播之前等待
+    std::vector<MPI_Request> reduce_send_requests;
+    // 广播阶段还没有完成的发送, 在最后统一等待
+    std::vector<MPI_Request> send_requests;
+    // 自己是不是孤立节点 (编号不小于 num_split 的节点)
+    const bool lonely;
+    std::vector<char> lonely_buffer;
+    // 和孤立节点之间还没有完成的通信
+    std::vector<MPI_Request> lonely_requests;
+    Phase phase;
+    size_t stage, segment; // 当前等待的是哪个 stage 的哪一段
+    // 持久化的调度才有: 每种通信在每个 stage 每一段的请求, 以及每个 stage 每一段的 reduce 来源表, 下标都是 stage * num_segs + 段号
+    std::vector<std::vector<MPI_Request>> persistent_requests[NUM_POST_KINDS];
+    std::vector<Reduce_Table> reduce_tables;
+    std::vector<MPI_Request> persistent_lonely[2];
+    // FT_TRANSPORT=rma 时 reduce 阶段的收发由它完成, 广播阶段和孤立节点仍然是双边的
+    std::unique_ptr<Rma_Stages> rma;
+    // 分组 allreduce 的两组片, 不为 null 时代替 data 和 dst
+    const Iovec_List *data_iov = nullptr, *dst_iov = nullptr;
+
+    // 第 stages.size() 步是和孤立节点之间的通信
+    int tag(const Tag_Phase &p, const size_t &i) const
+    {
+        return step_tag(epoch, p, i, stages.size() + 1);
+    }
+    // 相邻两个 stage 的接收区用缓冲区的两半, 所以下一个 stage 的接收可以提前挂出去
+    char *stage_buffer(const size_t &i) const
+    {
+        return buffer + (i % 2) * ft_ctx.stage_size * ft_ctx.type_extent;
+    }
+    // 缓冲区的两半分别按第一次使用它们的 stage 0 和 stage 1 的 reduce 分段方式放置物理页, 后面的 stage 沿用
+    void place_buffer()
+    {
+        staging->placed = true;
+        for (size_t i = 0; i < std::min<size_t>(stages.size(), 2); i++)
+        {
+            const auto &ops = recv_ops.ops[i];
+            const size_t tile = ops[0].blocks.size() * ft_ctx.split_size * ft_ctx.type_extent;
+            first_touch(stage_buffer(i), tile * (ops.size() - 1), tile);
+        }
+    }
+    // 广播阶段传输的是主副本 (如果有的话)
+    MPI_Datatype bcast_type() const { return master != nullptr ? MPI_FLOAT : datatype; }
+    void *bcast_buf() const { return master != nullptr ? (void*)master : dst; }
+    const FlexTree_Context &bcast_ctx() const { return master != nullptr ? master_ctx : ft_ctx; }
+
+    const std::vector<Operation> &kind_ops(const Post_Kind &kind, const size_t &i) const
+    {
+        // 广播阶段把 reduce 阶段的收发反过来
+        return (kind == REDUCE_SEND || kind == BCAST_RECV) ? send_ops.ops[i] : recv_ops.ops[i];
+    }
+    // 生成第 i 个 stage 第 s 段的一组通信, 返回请求数
+    size_t make_requests(const Post_Kind &kind, const size_t &i, const size_t &s, MPI_Request request[], const bool &init)
+    {
+        const std::vector<Operation> &ops = kind_ops(kind, i);
+        switch (kind)
+        {
+        case REDUCE_SEND:
+            // 函数不会试图修改data的内容, 已经reduce的数据将会放在dst中; 而除了第一步之外, 发送的都是reduce后的数据, 所以第一步需要单独提出来.
+            return handle_send(comm, datatype, &ops, (i == 0 ? data : dst), ft_ctx, request, tag(TAG_REDUCE, i), s * seg, seg, init, (i == 0 ? data_iov : dst_iov));
+        case REDUCE_RECV:
+            return handle_recv(comm, datatype, &ops, stage_buffer(i), ft_ctx, false, request, tag(TAG_REDUCE, i), s * seg, seg, init);
+        case BCAST_SEND:
+            return handle_send(comm, bcast_type(), &ops, bcast_buf(), bcast_ctx(), request, tag(TAG_BROADCAST, i), s * seg, seg, init, dst_iov);
+        default:
+            // 广播阶段收到的块直接写进 dst (或者主副本) 的对应位置
+            return handle_recv(comm, bcast_type(), &ops, bcast_buf(), bcast_ctx(), true, request, tag(TAG_BROADCAST, i), s * seg, seg, init, dst_iov);
+        }
+    }
+    // 孤立节点一侧用 send_ops.lonely_ops, 树节点一侧用 recv_ops.lonely_ops
+    size_t make_lonely_requests(const Lonely_Kind &kind, MPI_Request request[], const bool &init)
+    {
+        const std::vector<Operation> &ops = (lonely ? send_ops.lonely_ops : recv_ops.lonely_ops);
+        const bool send = (lonely == (kind == LONELY_GATHER));
+        if (kind == LONELY_GATHER)
+        {
+            if (send)
+            {
+                return handle_send(comm, datatype, &ops, data, ft_ctx, request, tag(TAG_REDUCE, stages.size()), 0, SIZE_MAX, init, data_iov);
+            }
+            return handle_recv(comm, datatype, &ops, lonely_buffer.data() + ft_ctx.buffer_front(), ft_ctx, false, request, tag(TAG_REDUCE, stages.size()), 0, SIZE_MAX, init);
+        }
+        // 发回的是最终结果 (或者主副本), 孤立节点收到对应的位置
+        if (send)
+        {
+            return handle_send(comm, bcast_type(), &ops, bcast_buf(), bcast_ctx(), request, tag(TAG_BROADCAST, stages.size()), 0, SIZE_MAX, init, dst_iov);
+        }
+        return handle_recv(comm, bcast_type(), &ops, bcast_buf(), bcast_ctx(), true, request, tag(TAG_BROADCAST, stages.size()), 0, SIZE_MAX, init, dst_iov);
+    }
+    void post_lonely(const Lonely_Kind &kind, std::vector<MPI_Request> &out)
+    {
+        if (persistent)
+        {
+            start_persistent(persistent_lonely[kind], out);
+            return;
+        }
+        const size_t old = out.size();
+        out.resize(old + count_requests(lonely ? send_ops.lonely_ops : recv_ops.lonely_ops, ft_ctx.node_label));
+        out.resize(old + make_lonely_requests(kind, out.data() + old, false));
+    }
+    // 最后一个 stage 的 reduce 包括孤立节点交来的数据
+    void build_stage_reduce(Reduce_Table &table, const size_t &i, const size_t &s)
+    {
+        const bool last = (i + 1 == stages.size());
+        void *extra = (last && ft_ctx.has_lonely ? lonely_buffer.data() + ft_ctx.buffer_front() : nullptr);
+        build_reduce(table, kernel, &(recv_ops.ops[i][0].blocks), stage_buffer(i), (i == 0 ? data : dst), dst, ft_ctx, recv_ops.ops[i].size() - 1, extra, (extra != nullptr ? ft_ctx.num_lonely : 0), (last ? master : nullptr), s * seg, seg, (i == 0 ? data_iov : dst_iov), dst_iov);
+    }
+    // 挂出第 i 个 stage 第 s 段的一组通信, 请求追加到 out 中
+    void post(const Post_Kind &kind, const size_t &i, const size_t &s, std::vector<MPI_Request> &out)
+    {
+        if (persistent)
+        {
+            start_persistent(persistent_requests[kind][i * num_segs + s], out);
+            return;
+        }
+        const size_t old = out.size();
+        out.resize(old + count_requests(kind_ops(kind, i), ft_ctx.node_label));
+        out.resize(old + make_requests(kind, i, s, out.data() + old, false));
+    }
+    void post_send(const Post_Kind &kind, const size_t &i, const size_t &s)
+    {
+        if (rma && kind == REDUCE_SEND)
+        {
+            rma->put(i, (i == 0 ? data : dst));
+            return;
+        }
+        post(kind, i, s, (kind == REDUCE_SEND ? reduce_send_requests : send_requests));
+    }
+    void post_recv(const Post_Kind &kind, const size_t &i)
+    {
+        if (rma && kind == REDUCE_RECV)
+        {
+            rma->expose(i);
+            return;
+        }
+        for (size_t s = 0; s < num_segs; s++)
+        {
+            seg_requests[i % 2][s].clear();
+            post(kind, i, s, seg_requests[i % 2][s]);
+        }
+    }
+    void build_persistent()
+    {
+        if (ft_ctx.has_lonely)
+        {
+            for (int kind = LONELY_GATHER; kind <= LONELY_SCATTER; kind++)
+            {
+                auto &r = persistent_lonely[kind];
+                r.resize(count_requests(lonely ? send_ops.lonely_ops : recv_ops.lonely_ops, ft_ctx.node_label));
+                r.resize(make_lonely_requests((Lonely_Kind)kind, r.data(), true));
+            }
+            lonely_requests.reserve(persistent_lonely[LONELY_GATHER].size() + persistent_lonely[LONELY_SCATTER].size());
+        }
+        // 孤立节点不参与树的各个 stage
+        if (lonely) return;
+        for (int kind = 0; kind < NUM_POST_KINDS; kind++)
+        {
+            persistent_requests[kind].resize(stages.size() * num_segs);
+            // 单边传输的 reduce 阶段没有请求
+            if (rma && (kind == REDUCE_SEND || kind == REDUCE_RECV)) continue;
+            for (size_t i = 0; i < stages.size(); i++)
+            {
+                for (size_t s = 0; s < num_segs; s++)
+                {
+                    auto &r = persistent_requests[kind][i * num_segs + s];
+                    r.resize(count_requests(kind_ops((Post_Kind)kind, i), ft_ctx.node_label));
+                    r.resize(make_requests((Post_Kind)kind, i, s, r.data(), true));
+                }
+            }
+        }
+        reduce_tables.resize(stages.size() * num_segs);
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            for (size_t s = 0; s < num_segs; s++)
+            {
+                build_stage_reduce(reduce_tables[i * num_segs + s], i, s);
+            }
+        }
+        // 等待用的数组一开始就留够, start 之后不会再分配
+        size_t num_reduce_sends = 0;
+        for (const auto &r : persistent_requests[REDUCE_SEND])
+        {
+            num_reduce_sends += r.size();
+        }
+        reduce_send_requests.reserve(num_reduce_sends);
+        size_t num_sends = persistent_lonely[LONELY_SCATTER].size();
+        for (const auto &r : persistent_requests[BCAST_SEND])
+        {
+            num_sends += r.size();
+        }
+        send_requests.reserve(num_sends);
+        for (size_t s = 0; s < num_segs; s++)
+        {
+            size_t num_recvs = 0;
+            for (size_t i = 0; i < stages.size(); i++)
+            {
+                num_recvs = std::max({num_recvs, persistent_requests[REDUCE_RECV][i * num_segs + s].size(), persistent_requests[BCAST_RECV][i * num_segs + s].size()});
+            }
+            seg_requests[0][s].reserve(num_recvs);
+            seg_requests[1][s].reserve(num_recvs);
+        }
+    }
+    // 当前 stage 的这一段收齐了: reduce 它, 然后马上把这一段发给下一个 stage 的对象
+    void reduce_segment()
+    {
+        const bool has_next = (stage + 1 != stages.size());
+        if (persistent)
+        {
+            run_reduce(kernel, reduce_tables[stage * num_segs + segment], ft_ctx);
+        }
+        else
+        {
+            build_stage_reduce(reduce_scratch, stage, segment);
+            run_reduce(kernel, reduce_scratch, ft_ctx);
+        }
+        // 下一个 stage 要发送的块都是这个 stage 刚 reduce 完的
+        if (has_next)
+        {
+            post_send(REDUCE_SEND, stage + 1, segment);
+        }
+        if (++segment != num_segs) return;
+        segment = 0;
+        if (has_next)
+        {
+            stage++;
+            // 这一半缓冲区的上一个使用者 (stage - 1) 已经 reduce 完了
+            if (stage + 1 != stages.size())
+            {
+                post_recv(REDUCE_RECV, stage + 1);
+            }
+            return;
+        }
+#ifdef FT_DEBUG
+        std::cout << "-------- FT DEBUG: complete reduce --------" << std::endl;
+#endif
+        phase = PHASE_REDUCE_SEND;
+        if (ft_ctx.has_lonely)
+        {
+            // 自己负责的那一块已经是最终结果, 发回给孤立节点, 和广播阶段同时进行
+            post_lonely(LONELY_SCATTER, send_requests);
+        }
+        for (size_t s = 0; s < num_segs; s++)
+        {
+            post_send(BCAST_SEND, stage, s);
+        }
+    }
+    // 广播阶段的这一段收齐了, 马上转发给下一个 stage 的对象
+    void broadcast_segment()
+    {
+        if (stage > 0)
+        {
+            post_send(BCAST_SEND, stage - 1, segment);
+        }
+        if (++segment != num_segs) return;
+        segment = 0;
+        if (stage == 0)
+        {
+            phase = PHASE_DRAIN;
+            return;
+        }
+        stage--;
+        post_recv(BCAST_RECV, stage);
+    }
+};
+
+class Ring_Allreduce: public Allreduce_Schedule
+{
+public:
+    Ring_Allreduce(const MPI_Datatype &_datatype, const Reduce_Kernel &_kernel, const MPI_Comm &_comm, const void *_data, void *_dst, const FlexTree_Context &_ft_ctx, float *_master, Staging_Buffer *_staging, const bool &_persistent = false): Allreduce_Schedule(_datatype, _kernel, _comm, _data, _dst, _ft_ctx, _master, _staging, _persistent), num_steps(_ft_ctx.num_nodes - 1), step(2 * (_ft_ctx.num_nodes - 1))
+    {
+        const size_t n = ft_ctx.num_nodes;
+        const size_t left = (ft_ctx.node_label + n - 1) % n;
+        const size_t right = (ft_ctx.node_label + 1) % n;
+        // 第 k 步把 node_label - k 块发给右边, 从左边收 node_label - 1 - k 块
+        for (size_t k = 0; k < 2 * num_steps; k++)
+        {
+            send_ops.push_back({Operation(right, (ft_ctx.node_label + n - k % n) % n)});
+            recv_ops.push_back({Operation(left, (left + n - k % n) % n)});
+        }
+        if (persistent)
+        {
+            persistent_requests.resize(2 * num_steps);
+            reduce_tables.resize(num_steps);
+            for (size_t k = 0; k < 2 * num_steps; k++)
+            {
+                persistent_requests[k].resize(2);
+                persistent_requests[k].resize(make_requests(k, persistent_requests[k].data(), true));
+            }
+            for (size_t k = 0; k < num_steps; k++)
+            {
+                build_reduce(reduce_tables[k], kernel, &(recv_ops[k][0].blocks), buffer, data, dst, ft_ctx, 1, nullptr, 0, (k == num_steps - 1 ? master : nullptr));
+            }
+            requests.reserve(2);
+        }
+    }
+    virtual ~Ring_Allreduce()
+    {
+        for (auto &r : persistent_requests)
+        {
+            free_persistent(r);
+        }
+    }
+    virtual void start()
+    {
+        if (!persistent)
+        {
+            epoch = next_epoch(comm);
+        }
+        step = 0;
+        post_step();
+    }
+    virtual bool advance(const bool &block)
+    {
+        while (step != 2 * num_steps)
+        {
+            if (!wait_requests(requests, block)) return false;
+            if (step < num_steps)
+            {
+                // 最后一步得到的是自己负责的那一块的最终结果, 需要的话写进主副本
+                if (persistent)
+                {
+                    run_reduce(kernel, reduce_tables[step], ft_ctx);
+                }
+                else
+                {
+                    build_reduce(reduce_scratch, kernel, &(recv_ops[step][0].blocks), buffer, data, dst, ft_ctx, 1, nullptr, 0, (step == num_steps - 1 ? master : nullptr));
+                    run_reduce(kernel, reduce_scratch, ft_ctx);
+                }
+            }
+            if (++step != 2 * num_steps)
+            {
+                post_step();
+            }
+            else if (master != nullptr)
+            {
+                convert_master(datatype, master, dst, ft_ctx.data_size, false);
+            }
+        }
+        return true;
+    }
+private:
+    // 前 num_steps 步是 reduce-scatter, 后 num_steps 步是 allgather
+    const size_t num_steps;
+    size_t step;
+    // 每一步的收发
+    std::vector<std::vector<Operation>> send_ops, recv_ops;
+    std::vector<MPI_Request> requests;
+    // 持久化的调度才有: 每一步的请求, 以及每个 reduce 步的来源表
+    std::vector<std::vector<MPI_Request>> persistent_requests;
+    std::vector<Reduce_Table> reduce_tables;
+
+    size_t make_requests(const size_t &k, MPI_Request request[], const bool &init)
+    {
+        size_t request_index;
+        if (k < num_steps)
+        {
+            const int t = step_tag(epoch, TAG_REDUCE, k, num_steps);
+            // 只有第一次是直接从原始数据里面发
+            request_index = handle_send(comm, datatype, &send_ops[k], (k == 0 ? data : dst), ft_ctx, request, t, 0, SIZE_MAX, init);
+            request_index += handle_recv(comm, datatype, &recv_ops[k], buffer, ft_ctx, false, request + request_index, t, 0, SIZE_MAX, init);
+        }
+        else
+        {
+            const int t = step_tag(epoch, TAG_BROADCAST, k - num_steps, num_steps);
+            if (master != nullptr)
+            {
+                request_index = handle_send(comm, MPI_FLOAT, &send_ops[k], master, master_ctx, request, t, 0, SIZE_MAX, init);
+                request_index += handle_recv(comm, MPI_FLOAT, &recv_ops[k], master, master_ctx, true, request + request_index, t, 0, SIZE_MAX, init);
+            }
+            else
+            {
+                request_index = handle_send(comm, datatype, &send_ops[k], dst, ft_ctx, request, t, 0, SIZE_MAX, init);
+                request_index += handle_recv(comm, datatype, &recv_ops[k], dst, ft_ctx, true, request + request_index, t, 0, SIZE_MAX, init);
+            }
+        }
+        return request_index;
+    }
+    void post_step()
+    {
+        requests.clear();
+        if (persistent)
+        {
+            start_persistent(persistent_requests[step], requests);
+            return;
+        }
+        requests.resize(2);
+        requests.resize(make_requests(step, requests.data(), false));
+    }
+};
+
+/**
+ * log 步数的 allreduce: 递归倍增 (doubling), 递归减半 (halving) 和 Rabenseifner. 小数据和中等数据不用像 ring 那样走 N-1 步.
+ * doubling 每一步和距离 1, 2, 4, ... 的节点交换整份数据并 reduce, 共 log2(p) 步.
+ * halving 和 rabenseifner 先做 reduce-scatter: 每一步把手上的区间分成两半, 一半交给对方, 收回对方手上的另一半并 reduce,
+ * log2(p) 步之后每个节点得到 1/p 的最终结果, 再按相反的顺序 allgather. 两者只是配对的顺序不同:
+ * halving 的距离是 1, 2, 4, ..., 数据最多的第一步在相邻的节点 (通常在同一台机器上) 之间; rabenseifner 是经典的 p/2, p/4, ..., 1.
+ * 
+ * 节点数 N 不是 2 的幂时, p 取不超过 N 的最大的 2 的幂, r = N - p. 前 2r 个节点里的偶数号节点先把整份数据交给下一个节点 (fold-in),
+ * 不参与中间的步骤, 最后再从它那里收回结果 (fold-out). 剩下的 p 个节点重新编号为 0..p-1.
+ * ft_ctx 按 p 块划分 (num_lonely = r), 每一步用 step_context 把相邻的若干块合成一块, 所以每一步每个方向只有一条消息.
+ */
+class Butterfly_Allreduce: public Allreduce_Schedule
+{
+public:
+    Butterfly_Allreduce(const MPI_Datatype &_datatype, const Reduce_Kernel &_kernel, const MPI_Comm &_comm, const void *_data, void *_dst, const FlexTree_Context &_ft_ctx, const Algorithm &_algorithm, float *_master, Staging_Buffer *_staging, const bool &_persistent = false): Allreduce_Schedule(_datatype, _kernel, _comm, _data, _dst, _ft_ctx, _master, _staging, _persistent), step(0)
+    {
+        const size_t r = ft_ctx.num_lonely, p = ft_ctx.num_split, rank = ft_ctx.node_label;
+        size_t log_p = 0;
+        while (((size_t)1 << log_p) < p) log_p++;
+        // tag 的编号: 0 是 fold-in, 1..2log_p 是中间的各步, 最后一个是 fold-out
+        num_tags = 2 * log_p + 2;
+        if (rank < 2 * r && rank % 2 == 0)
+        {
+            add_step(true, true, false, rank + 1, 1, 0, 0, 0);
+            add_step(false, false, true, rank + 1, 1, 0, 0, num_tags - 1);
+        }
+        else
+        {
+            if (rank < 2 * r)
+            {
+                add_step(true, false, true, rank - 1, 1, 0, 0, 0);
+            }
+            const size_t new_rank = (rank < 2 * r ? rank / 2 : rank - r);
+            if (_algorithm == ALGO_DOUBLING)
+            {
+                for (size_t t = 0; t < log_p; t++)
+                {
+                    add_step(true, true, true, real_rank(new_rank ^ ((size_t)1 << t)), 1, 0, 0, 1 + t);
+                }
+            }
+            else
+            {
+                // 第 t 步之后手上的区间是 2^(t+1) 块中的第 keep[t] 块
+                std::vector<size_t> peer(log_p), keep(log_p);
+                size_t current = 0;
+                for (size_t t = 0; t < log_p; t++)
+                {
+                    const size_t mask = (_algorithm == ALGO_HALVING ? (size_t)1 << t : p >> (t + 1));
+                    const size_t bit = ((new_rank & mask) != 0);
+                    peer[t] = real_rank(new_rank ^ mask);
+                    keep[t] = 2 * current + bit;
+                    add_step(true, true, true, peer[t], (size_t)2 << t, keep[t] ^ 1, keep[t], 1 + t);
+                    current = keep[t];
+                }
+                for (size_t t = log_p; t-- > 0;)
+                {
+                    add_step(false, true, true, peer[t], (size_t)2 << t, keep[t], keep[t] ^ 1, 2 * log_p - t);
+                }
+            }
+            if (rank < 2 * r)
+            {
+                add_step(false, true, false, rank - 1, 1, 0, 0, num_tags - 1);
+            }
+        }
+        // 从原始数据里发送/reduce 的只有自己的第一个 reduce 步, 需要的话最后一个 reduce 步写进主副本
+        size_t last_reduce = steps.size();
+        for (size_t k = 0; k < steps.size(); k++)
+        {
+            if (steps[k].reduce && steps[k].recv) last_reduce = k;
+        }
+        for (size_t k = 0; k < steps.size(); k++)
+        {
+            steps[k].from_data = (k == 0);
+            steps[k].to_master = (k == last_reduce);
+        }
+        if (persistent)
+        {
+            persistent_requests.resize(steps.size());
+            reduce_tables.resize(steps.size());
+            for (size_t k = 0; k < steps.size(); k++)
+            {
+                persistent_requests[k].resize(2);
+                persistent_requests[k].resize(make_requests(k, persistent_requests[k].data(), true));
+                if (steps[k].reduce && steps[k].recv)
+                {
+                    build_step_reduce(reduce_tables[k], k);
+                }
+            }
+            requests.reserve(2);
+        }
+    }
+    virtual ~Butterfly_Allreduce()
+    {
+        for (auto &r : persistent_requests)
+        {
+            free_persistent(r);
+        }
+    }
+    virtual void start()
+    {
+        if (!persistent)
+        {
+            epoch = next_epoch(comm);
+        }
+        step = 0;
+        post_step();
+    }
+    virtual bool advance(const bool &block)
+    {
+        while (step != steps.size())
+        {
+            if (!wait_requests(requests, block)) return false;
+            if (steps[step].reduce && steps[step].recv)
+            {
+                if (persistent)
+                {
+                    run_reduce(kernel, reduce_tables[step], ft_ctx);
+                }
+                else
+                {
+                    build_step_reduce(reduce_scratch, step);
+                    run_reduce(kernel, reduce_scratch, ft_ctx);
+                }
+            }
+            if (++step != steps.size())
+            {
+                post_step();
+            }
+            else if (master != nullptr)
+            {
+                convert_master(datatype, master, dst, ft_ctx.data_size, false);
+            }
+        }
+        return true;
+    }
+private:
+    struct Step
+    {
+        bool reduce;           // true: 交换的是还没有 reduce 完的数据, 收到的放进 buffer 再 reduce; false: 交换的是最终结果
+        bool send, recv;
+        bool from_data;        // 发送和 reduce 的来源是 data 而不是 dst
+        bool to_master;        // reduce 的结果写进主副本
+        FlexTree_Context ctx, master_ctx; // 这一步的分块
+        std::vector<Operation> send_ops, recv_ops;
+        int tag_index;
+    };
+    std::vector<Step> steps;
+    size_t step, num_tags;
+    std::vector<MPI_Request> requests;
+    // 持久化的调度才有: 每一步的请求, 以及每个 reduce 步的来源表
+    std::vector<std::vector<MPI_Request>> persistent_requests;
+    std::vector<Reduce_Table> reduce_tables;
+
+    // 重新编号之后的 new_rank 对应的节点
+    size_t real_rank(const size_t &new_rank) const
+    {
+        return new_rank < ft_ctx.num_lonely ? 2 * new_rank + 1 : new_rank + ft_ctx.num_lonely;
+    }
+    // 把 ft_ctx 的 p 块按顺序合成 num_blocks 块, 每块的边界都和原来的块对齐
+    static FlexTree_Context step_context(const FlexTree_Context &base, const size_t &num_blocks)
+    {
+        FlexTree_Context ctx(base);
+        ctx.split_size = base.split_size * (base.num_split / num_blocks);
+        ctx.num_split = num_blocks;
+        return ctx;
+    }
+    void add_step(const bool &reduce, const bool &send, const bool &recv, const size_t &peer, const size_t &num_blocks, const size_t &send_block, const size_t &recv_block, const size_t &tag_index)
+    {
+        Step s = {reduce, send, recv, false, false, step_context(ft_ctx, num_blocks), step_context(master_ctx, num_blocks), {}, {}, (int)tag_index};
+        if (send) s.send_ops.push_back(Operation(peer, send_block));
+        if (recv) s.recv_ops.push_back(Operation(peer, recv_block));
+        steps.push_back(s);
+    }
+    void build_step_reduce(Reduce_Table &table, const size_t &k)
+    {
+        const Step &s = steps[k];
+        build_reduce(table, kernel, &(s.recv_ops[0].blocks), buffer, (s.from_data ? data : dst), dst, s.ctx, 1, nullptr, 0, (s.to_master ? master : nullptr));
+    }
+    size_t make_requests(const size_t &k, MPI_Request request[], const bool &init)
+    {
+        const Step &s = steps[k];
+        const int t = step_tag(epoch, TAG_REDUCE, s.tag_index, num_tags);
+        size_t request_index;
+        if (s.reduce)
+        {
+            request_index = handle_send(comm, datatype, &s.send_ops, (s.from_data ? data : dst), s.ctx, request, t, 0, SIZE_MAX, init);
+            request_index += handle_recv(comm, datatype, &s.recv_ops, buffer, s.ctx, false, request + request_index, t, 0, SIZE_MAX, init);
+        }
+        else if (master != nullptr)
+        {
+            request_index = handle_send(comm, MPI_FLOAT, &s.send_ops, master, s.master_ctx, request, t, 0, SIZE_MAX, init);
+            request_index += handle_recv(comm, MPI_FLOAT, &s.recv_ops, master, s.master_ctx, true, request + request_index, t, 0, SIZE_MAX, init);
+        }
+        else
+        {
+            request_index = handle_send(comm, datatype, &s.send_ops, dst, s.ctx, request, t, 0, SIZE_MAX, init);
+            request_index += handle_recv(comm, datatype, &s.recv_ops, dst, s.ctx, true, request + request_index, t, 0, SIZE_MAX, init);
+        }
+        return request_index;
+    }
+    void post_step()
+    {
+        requests.clear();
+        if (persistent)
+        {
+            start_persistent(persistent_requests[step], requests);
+            return;
+        }
+        requests.resize(2);
+        requests.resize(make_requests(step, requests.data(), false));
+    }
+};
+
+static int allreduce(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm, float *master = nullptr);
+
+// 确定性模式. 浮点加法不满足结合律, 普通模式下求和的结果和 FT_TOPO 给出的拓扑 (也就是合并顺序) 有关.
+// 设置 FT_DETERMINISTIC=1 后, float/double/16 位浮点的 MPI_SUM 先把每个元素按所在块的全局最大指数换算成定点整数,
+// 整数加法的结果和合并顺序无关, 最后再换算回浮点数, 所以同样的输入在任何拓扑下都得到同样的结果.
+// 代价是多一次很小的 (每块一个 int) MPI_MAX, 以及传输的数据变成每个元素 8 字节 (double 是 16 字节).
+static bool deterministic_enabled()
+{
+    static const bool enabled = get_env_size("FT_DETERMINISTIC", 0) != 0;
+    return enabled;
+}
+
+// 共用一个指数的元素个数, 可以用环境变量 FT_DETERMINISTIC_BLOCK 调整. 块越小, 和块内最大值相差很远的元素丢掉的低位越少.
+static size_t deterministic_block()
+{
+    static const size_t block = std::max<size_t>(get_env_size("FT_DETERMINISTIC_BLOCK", 256), 1);
+    return block;
+}
+
+// 每个元素换算成几个 64 位整数. double 用两个, 精度大约是块内最大值的 2^-116 (2^20 个节点时), float 和 16 位浮点用一个就足够了.
+template<class T> struct Det_Words
+{
+    static const size_t value = 1;
+};
+template<> struct Det_Words<double>
+{
+    static const size_t value = 2;
+};
+
+// double 的偏置指数, 0 和非规格化数为 0, inf/nan 为 0x7ff
+static inline int det_biased_exponent(const double &x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return (bits >> 52) & 0x7ff;
+}
+
+// 2^e, 分成两个因子以免 e 超出 double 的指数范围
+struct Det_Scale
+{
+    double a, b;
+    explicit Det_Scale(const int &e) : a(std::ldexp(1.0, e / 2)), b(std::ldexp(1.0, e - e / 2)) {}
+};
+
+// inf/nan 不能换成定点数, 单独计数: 低 21 位是 +inf 的个数, 中间 21 位是 -inf, 高位是 nan
+static inline uint64_t det_special(const double &x)
+{
+    if (x != x) return 1ull << 42;
+    if (x > 0) return 1;
+    return 1ull << 21;
+}
+
+static inline double det_special_value(const uint64_t &c)
+{
+    const uint64_t mask = (1ull << 21) - 1;
+    const bool pos = (c & mask) != 0, neg = ((c >> 21) & mask) != 0;
+    if ((c >> 42) != 0 || (pos && neg)) return std::numeric_limits<double>::quiet_NaN();
+    return pos ? std::numeric_limits<double>::infinity() : -std::numeric_limits<double>::infinity();
+}
+
+// 按块把 [0, count) 交给线程池, 每个线程处理连续的若干块
+template<class F>
+static void det_parallel(const size_t &count, const size_t &bytes_per_element, const F &f)
+{
+    const size_t block = deterministic_block();
+    const size_t num_blocks = (count + block - 1) / block;
+    const size_t num_threads = std::min<size_t>(std::max<size_t>(count * bytes_per_element / reduce_min_bytes_per_thread(), 1), num_blocks);
+    Reduce_Pool::get().run(num_threads, [&](size_t tid, size_t n)
+    {
+        const size_t per = (num_blocks + n - 1) / n;
+        for (size_t b = per * tid; b < std::min(num_blocks, per * (tid + 1)); b++)
+        {
+            f(b, b * block, std::min(count, (b + 1) * block));
+        }
+    });
+}
+
+/**
+ * 确定性的求和. 块的指数先用 MPI_MAX 取全局最大 (max 本身和顺序无关), 然后每个元素 x 换算成整数 x * 2^k,
+ * k 取得让 num_nodes 个节点的整数相加也不会溢出. 换算和还原是逐元素的简单循环, 用线程池并行, 整数的 allreduce 仍然走 SIMD 的 reduce kernel.
+ * 
+ * @param master 不为 null 时, 还原的结果以 float 写进 master
+ */
+template<class T>
+static void deterministic_sum(const T *src, T *dst, const size_t &count, const MPI_Comm &comm, float *master)
+{
+    typedef typename Accum<T>::type A;
+    const size_t K = Det_Words<T>::value;
+    const size_t block = deterministic_block();
+    const size_t num_blocks = (count + block - 1) / block;
+    int num_nodes;
+    MPI_Comm_size(comm, &num_nodes);
+    int headroom = 0;
+    while ((1 << headroom) < num_nodes) headroom++;
+    const int W = 62 - headroom; // 每个整数的有效位数
+
+    // 每块的最大偏置指数, 最后一个位置标记有没有 inf/nan.
+    // 融合队列的后台线程和用户线程可能同时进来, 所以都是局部变量
+    std::vector<int> exponents(num_blocks + 1, 0);
+    std::vector<uint64_t> words(count * K), specials;
+    std::atomic<int> special(0);
+    det_parallel(count, sizeof(T), [&](size_t b, size_t begin, size_t end)
+    {
+        int e = 1, s = 0;
+        for (size_t i = begin; i < end; i++)
+        {
+            const int x = det_biased_exponent(Accum<T>::load(src[i]));
+            s |= (x == 0x7ff);
+            e = std::max(e, x == 0x7ff ? 0 : x);
+        }
+        exponents[b] = e;
+        if (s) special = 1;
+    });
+    exponents[num_blocks] = special;
+    allreduce(MPI_IN_PLACE, exponents.data(), num_blocks + 1, MPI_INT, MPI_MAX, comm);
+    const bool has_special = (exponents[num_blocks] != 0);
+    if (has_special)
+    {
+        // 有 inf/nan 的时候再做一次计数, 按 IEEE 的规则决定这些位置的结果. 原地调用时 src 就是 dst, 所以要在还原之前做
+        specials.resize(count);
+        det_parallel(count, sizeof(T), [&](size_t, size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                const double x = Accum<T>::load(src[i]);
+                specials[i] = (det_biased_exponent(x) == 0x7ff ? det_special(x) : 0);
+            }
+        });
+        allreduce(MPI_IN_PLACE, specials.data(), count, MPI_UINT64_T, MPI_SUM, comm);
+    }
+
+    // |x| < 2^(e - 1022), 换算成 |x * 2^k| < 2^W
+    det_parallel(count, sizeof(T), [&](size_t b, size_t begin, size_t end)
+    {
+        const Det_Scale scale(W - (exponents[b] - 1022));
+        const Det_Scale low(W);
+        for (size_t i = begin; i < end; i++)
+        {
+            const double x = Accum<T>::load(src[i]);
+            const double y = (det_biased_exponent(x) == 0x7ff ? 0.0 : x * scale.a * scale.b);
+            const int64_t hi = (int64_t)y;
+            words[i * K] = (uint64_t)hi;
+            if (K > 1) words[i * K + 1] = (uint64_t)(int64_t)((y - (double)hi) * low.a * low.b);
+        }
+    });
+    // 无符号整数加法按 2^64 取模, 中间结果溢出也不影响最终结果, 所以用 uint64 求和
+    allreduce(MPI_IN_PLACE, words.data(), count * K, MPI_UINT64_T, MPI_SUM, comm);
+
+    det_parallel(count, sizeof(T), [&](size_t b, size_t begin, size_t end)
+    {
+        const Det_Scale scale(-(W - (exponents[b] - 1022)) - (K > 1 ? W : 0));
+        for (size_t i = begin; i < end; i++)
+        {
+            double v;
+            if (K > 1)
+            {
+#ifdef __SIZEOF_INT128__
+                // 拼成一个 128 位整数再转换, 只舍入一次
+                v = (double)((__int128)(int64_t)words[i * K] * ((__int128)1 << W) + (int64_t)words[i * K + 1]);
+#else
+                v = std::ldexp((double)(int64_t)words[i * K], W) + (double)(int64_t)words[i * K + 1];
+#endif
+            }
+            else
+            {
+                v = (double)(int64_t)words[i];
+            }
+            const A r = (A)(has_special && specials[i] != 0 ? det_special_value(specials[i]) : v * scale.a * scale.b);
+            if (master != nullptr) master[i] = r;
+            dst[i] = Accum<T>::store(r);
+        }
+    });
+}
+
+// 确定性模式是否接管这个调用. 只有浮点的 MPI_SUM 需要, 整数和 max/min 等本来就和顺序无关.
+static bool deterministic_supported(const MPI_Datatype &datatype, const MPI_Op &op)
+{
+    if (op != MPI_SUM || !deterministic_enabled()) return false;
+    const int t = reduce_type_index(datatype);
+    return t == Index_Of<float, Reduce_Types>::value || t == Index_Of<double, Reduce_Types>::value || t == Index_Of<Half, Reduce_Types>::value || t == Index_Of<BFloat16, Reduce_Types>::value;
+}
+
+// 确定性模式能处理的调用返回 true, 见 deterministic_supported.
+static bool deterministic_allreduce(const void *sendbuf, void *recvbuf, const size_t &count, const MPI_Datatype &datatype, const MPI_Op &op, const MPI_Comm &comm, float *master)
+{
+    if (!deterministic_supported(datatype, op)) return false;
+    const int t = reduce_type_index(datatype);
+    const void *src = (sendbuf == MPI_IN_PLACE ? recvbuf : sendbuf);
+    if (t == Index_Of<float, Reduce_Types>::value) deterministic_sum(static_cast<const float*>(src), static_cast<float*>(recvbuf), count, comm, master);
+    else if (t == Index_Of<double, Reduce_Types>::value) deterministic_sum(static_cast<const double*>(src), static_cast<double*>(recvbuf), count, comm, master);
+    else if (t == Index_Of<Half, Reduce_Types>::value) deterministic_sum(static_cast<const Half*>(src), static_cast<Half*>(recvbuf), count, comm, master);
+    else if (t == Index_Of<BFloat16, Reduce_Types>::value) deterministic_sum(static_cast<const BFloat16*>(src), static_cast<BFloat16*>(recvbuf), count, comm, master);
+    else return false;
+    return true;
+}
+
+// 单节点和确定性模式不需要 FlexTree 的调度, 直接在这里做完并返回 true.
+static bool allreduce_direct(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm, float *master)
+{
+    int comm_size;
+    MPI_Comm_size(comm, &comm_size);
+    if (comm_size <= 1)
+    {
+        const FlexTree_Context ft_ctx(comm, datatype, count);
+        if (sendbuf != MPI_IN_PLACE)
+        {
+            copy_local(sendbuf, recvbuf, count, datatype, ft_ctx.type_dense, ft_ctx.type_extent);
+        }
+        if (master != nullptr)
+        {
+            convert_master(datatype, recvbuf, master, count, true);
+        }
+        return true;
+    }
+    return deterministic_allreduce(sendbuf, recvbuf, count, datatype, op, comm, master);
+}
+
+// 阻塞调用共用的全局接收缓冲区, 不够大时重新分配. tree 相邻的两个 stage 各用一半
+static Staging_Buffer *shared_recv_buffer(const FlexTree_Context &ft_ctx)
+{
+    Staging_Buffer *buffer = flextree_register_the_buffer(ft_ctx.buffer_bytes(2 * ft_ctx.stage_size));
+    recv_buffer = buffer->data() + ft_ctx.buffer_front();
+    return buffer;
+}
+
+// 每个 rank 所在机器的编号, 取这台机器上最小的 rank. 用 MPI_Get_processor_name 区分机器.
+// FT_RANK_MAP_HOSTS=k 时模拟启动器按轮转方式放置的 k 台机器 (rank r 在第 r % k 台上), 用来在一台机器上测试
+static std::vector<int> gather_hosts(const MPI_Comm &comm)
+{
+    int size;
+    MPI_Comm_size(comm, &size);
+    std::vector<int> hosts(size);
+    const size_t simulated = get_env_size("FT_RANK_MAP_HOSTS", 0);
+    if (simulated > 0)
+    {
+        for (int i = 0; i < size; i++)
+        {
+            hosts[i] = i % simulated;
+        }
+        return hosts;
+    }
+    char name[MPI_MAX_PROCESSOR_NAME] = {0};
+    int len;
+    MPI_Get_processor_name(name, &len);
+    std::vector<char> names((size_t)size * MPI_MAX_PROCESSOR_NAME);
+    MPI_Allgather(name, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, names.data(), MPI_MAX_PROCESSOR_NAME, MPI_CHAR, comm);
+    std::map<std::string, int> first;
+    for (int i = 0; i < size; i++)
+    {
+        const char *n = names.data() + (size_t)i * MPI_MAX_PROCESSOR_NAME;
+        hosts[i] = first.emplace(std::string(n, strnlen(n, MPI_MAX_PROCESSOR_NAME)), i).first->second;
+    }
+    return hosts;
+}
+
+/**
+ * rank 到树中位置的映射, 挂在通信域上 (见 comm_object), 第一次调用时计算.
+ * Send_Ops/Recv_Ops 的第 0 个 stage 由编号连续的节点组成, 越往后的 stage 跨度越大, 数据量越小.
+ * 启动器给出的 rank 顺序不一定是按机器排的 (比如轮转放置), 所以按 (所在机器, rank) 重新排序, 同一台机器上的 rank 占据连续的位置,
+ * 这样最宽, 传输量最大的前几个 stage 留在机器内部, 只有后面的 stage 跨机器.
+ * 同一台机器上再按 rank 被绑定的 NUMA 节点排序 (FT_RANK_MAP_NUMA=0 关掉), 这时把第 0 个 stage 的宽度设成每个 socket 的 rank 数,
+ * 比如 FT_TOPO=8,2,4 (每个 socket 8 个 rank, 每台机器 2 个 socket, 4 台机器), 树里就多了一层只在 socket 内部进行的 stage.
+ * 重新排序用 MPI_Comm_split 得到一个新的通信域, 新的 rank 就是树中的位置, 各种调度都直接在它上面进行.
+ * 设置 FT_RANK_MAP=0 关掉.
+ */
+class Rank_Map
+{
+public:
+    bool initialized = false;
+    MPI_Comm mapped = MPI_COMM_NULL; // 重新编号的通信域, 顺序不需要改变时为 MPI_COMM_NULL
+    std::vector<int> position;       // 每个 rank 在树中的位置
+
+    ~Rank_Map()
+    {
+        if (mapped != MPI_COMM_NULL) MPI_Comm_free(&mapped);
+    }
+    void init(const MPI_Comm &comm)
+    {
+        initialized = true;
+        static const bool enabled = get_env_size("FT_RANK_MAP", 1) != 0;
+        if (!enabled) return;
+        int rank, size;
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &size);
+        const std::vector<int> hosts = gather_hosts(comm);
+        // 没有绑定到某一个 NUMA 节点的 rank 是 -1, 排在同一台机器的最前面
+        static const bool by_numa = get_env_size("FT_RANK_MAP_NUMA", 1) != 0;
+        std::vector<int> numa(size, -1);
+        if (by_numa)
+        {
+            int node = current_numa_node();
+            MPI_Allgather(&node, 1, MPI_INT, numa.data(), 1, MPI_INT, comm);
+        }
+        std::vector<int> order(size);
+        for (int i = 0; i < size; i++)
+        {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](const int &a, const int &b) { return hosts[a] != hosts[b] ? hosts[a] < hosts[b] : numa[a] < numa[b]; });
+        position.resize(size);
+        bool identity = true;
+        for (int i = 0; i < size; i++)
+        {
+            position[order[i]] = i;
+            identity = identity && (order[i] == i);
+        }
+#ifdef FT_DEBUG
+        if (rank == 0)
+        {
+            std::cout << "FlexTree rank map:";
+            for (auto i : order)
+            {
+                std::cout << " " << i;
+            }
+            std::cout << std::endl;
+        }
+#endif
+        if (!identity)
+        {
+            MPI_Comm_split(comm, 0, position[rank], &mapped);
+        }
+    }
+};
+
+// 调度实际使用的通信域, 见 Rank_Map. 集合操作, 第一次调用时所有 rank 都要参与
+static MPI_Comm mapped_comm(const MPI_Comm &comm)
+{
+    Rank_Map &map = comm_object<Rank_Map>(comm);
+    if (!map.initialized)
+    {
+        map.init(comm);
+    }
+    return map.mapped != MPI_COMM_NULL ? map.mapped : comm;
+}
+
+/**
+ * allreduce, iallreduce 和 allreduce_init 共用的准备工作, 根据 engine (默认是 FT_ALGO 和 FT_TOPO) 选择算法.
+ * 调用者保证 op 满足交换律, 并且不是 allreduce_direct 能直接做完的情况.
+ * 
+ * @param master 不为 null 时 datatype 必须是 16 位浮点, 长度为 count 的 float 数组. 
+ *               各个 stage 仍然用 16 位传输, 但最终结果以 float 保存在 master 中, 广播阶段传输的也是 float, recvbuf 中是它舍入后的值.
+ * @param shared_buffer 为 true 时使用全局注册的接收缓冲区 (阻塞调用), 否则调度自己分配一块
+ * @param persistent 生成持久化的调度, 见 allreduce_init
+ * @param engine 算法和拓扑, 阻塞调用由 Engine_Selector 按消息大小选择
+ */
+static Allreduce_Schedule *create_schedule(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm, float *master, const bool &shared_buffer, const bool &persistent = false, const Engine &engine = env_engine())
+{
+    // 树中的位置按机器重新排过, 见 Rank_Map
+    comm = mapped_comm(comm);
+    int comm_size;
+    MPI_Comm_size(comm, &comm_size);
+    const Algorithm algorithm = get_algorithm(engine.algo);
+    size_t num_lonely = 0;
+    std::vector<size_t> stages = {1};
+    std::unique_ptr<Irregular_Topo> irregular;
+    if (algorithm == ALGO_TREE && is_irregular_topo(engine.topo))
+    {
+        int rank;
+        MPI_Comm_rank(comm, &rank);
+        irregular.reset(new Irregular_Topo(engine.topo, comm_size));
+        stages = irregular->widths(rank);
+    }
+    else if (algorithm == ALGO_TREE && engine.topo.empty())
+    {
+        int type_size;
+        MPI_Type_size(datatype, &type_size);
+        stages = model_stages(comm_size, (size_t)count * type_size);
+    }
+    else if (algorithm == ALGO_TREE)
+    {
+        stages = get_stages(comm_size, &num_lonely, engine.topo);
+    }
+    else if (algorithm != ALGO_RING)
+    {
+        // 折叠出去的节点和孤立节点一样不分块
+        num_lonely = comm_size - pow2_floor(comm_size);
+    }
+    FlexTree_Context ft_ctx(comm, datatype, count, num_lonely);
+    if (irregular)
+    {
+        // 不规则的树在一个 stage 里可能收到多于 num_split 块
+        ft_ctx.stage_size = irregular->stage_size(ft_ctx.node_label, ft_ctx.split_size);
+    }
+#ifdef FT_DEBUG
+    if (ft_ctx.node_label == ft_ctx.num_nodes - 2) ft_ctx.show_context();
+#endif
+    // 类型和算子对应的 reduce 实现只查一次
+    const Reduce_Kernel kernel = resolve_reduce(datatype, op, ft_ctx);
+    if (master != nullptr && kernel.master_kernels.fn[0] == nullptr)
+    {
+        std::cerr << "Op " << op << " is not supported with a float master copy." << std::endl;
+        exit(1);
+    }
+
+    init_local_ranks(comm);
+    // 单边传输只用于阻塞调用 (见 Rma_Stages), 窗口建在调度自己的缓冲区上
+    const Transport transport = (algorithm == ALGO_TREE && shared_buffer ? get_transport() : TRANSPORT_P2P);
+    Staging_Buffer *buffer = (shared_buffer && transport == TRANSPORT_P2P ? shared_recv_buffer(ft_ctx) : nullptr);
+    // MPI_IN_PLACE
+    const void *data = (sendbuf == MPI_IN_PLACE ? nullptr : sendbuf);
+    if (algorithm != ALGO_TREE && algorithm != ALGO_RING)
+    {
+        return new Butterfly_Allreduce(datatype, kernel, comm, data, recvbuf, ft_ctx, algorithm, master, buffer, persistent);
+    }
+    if (irregular || stages[0] != 1)
+    {
+        return new Tree_Allreduce(datatype, kernel, comm, data, recvbuf, ft_ctx, stages, master, buffer, persistent, irregular.get(), transport);
+    }
+    return new Ring_Allreduce(datatype, kernel, comm, data, recvbuf, ft_ctx, master, buffer, persistent);
+}
+
+// 计划缓存的 key. 算法和拓扑是这次调用的引擎 (见 Engine), 也就是 FT_ALGO 和 FT_TOPO (或者 FT_TOPO_FILE 的内容) 的原文
+// 或者决策表选出的一项, 变了就是另一个计划. FT_TRANSPORT 也一样.
+// 分组 allreduce 的调度每次调用前重新绑定各片 (见 allreduce_group), 和普通的调度分开缓存.
+struct Plan_Key
+{
+    int count;
+    MPI_Datatype datatype;
+    MPI_Op op;
+    bool master;
+    std::string algo, topo;
+    Transport transport;
+    bool grouped;
+    bool operator==(const Plan_Key &other) const
+    {
+        return count == other.count && datatype == other.datatype && op == other.op && master == other.master && algo == other.algo && topo == other.topo && transport == other.transport && grouped == other.grouped;
+    }
+    // datatype 和 op 按句柄比较, 所以只缓存不会被释放的预定义类型和算子 (以及这里创建的 16 位浮点类型).
+    // 派生类型和用户算子释放之后句柄可能被新建的类型/算子重用, 不能缓存.
+    bool cacheable() const
+    {
+        if (reduce_op_index(op) < 0) return false;
+        if (is_half_type(datatype)) return true;
+        int num_integers, num_addresses, num_datatypes, combiner;
+        MPI_Type_get_envelope(datatype, &num_integers, &num_addresses, &num_datatypes, &combiner);
+        return combiner == MPI_COMBINER_NAMED;
+    }
+};
+
+/**
+ * 阻塞 allreduce 的计划缓存, 挂在通信域上 (见 comm_object), 随通信域一起释放.
+ * 同样的 (count, datatype, op, 拓扑) 再次调用时直接复用上次的调度, 包括 FlexTree_Context, 解析好的拓扑, Send_Ops/Recv_Ops,
+ * reduce 的实现以及已经分配好的请求数组, 只重新绑定缓冲区. 按 LRU 淘汰, 容量由 FT_PLAN_CACHE 设置 (默认 16, 0 表示不缓存).
+ */
+class Plan_Cache
+{
+public:
+    size_t hits = 0, misses = 0;
+
+    static size_t capacity()
+    {
+        static const size_t c = get_env_size("FT_PLAN_CACHE", 16);
+        return c;
+    }
+    // 找到时移到最前面, 没有时返回 nullptr
+    Allreduce_Schedule *find(const Plan_Key &key)
+    {
+        if (!key.cacheable())
+        {
+            misses++;
+            return nullptr;
+        }
+        for (auto i = entries.begin(); i != entries.end(); i++)
+        {
+            if (i->first == key)
+            {
+                entries.splice(entries.begin(), entries, i);
+                hits++;
+                return entries.front().second.get();
+            }
+        }
+        misses++;
+        return nullptr;
+    }
+    // 放进缓存, 之后由缓存负责释放. 容量为 0 或者 key 不能缓存时不放, 返回 false
+    bool insert(const Plan_Key &key, Allreduce_Schedule *schedule)
+    {
+        if (capacity() == 0 || !key.cacheable()) return false;
+        if (entries.size() >= capacity())
+        {
+            entries.pop_back();
+        }
+        entries.emplace_front(key, std::unique_ptr<Allreduce_Schedule>(schedule));
+        return true;
+    }
+private:
+    std::list<std::pair<Plan_Key, std::unique_ptr<Allreduce_Schedule>>> entries;
+};
+
+// 通信域上计划缓存的命中和未命中次数
+static inline void plan_cache_stats(const MPI_Comm &comm, size_t &hits, size_t &misses)
+{
+    const Plan_Cache &cache = comm_object<Plan_Cache>(comm);
+    hits = cache.hits;
+    misses = cache.misses;
+}
+
+// 决策表的一项: 不超过 max_bytes 字节 (并且超过上一项) 的消息用 engine
+struct Engine_Rule
+{
+    size_t max_bytes;
+    Engine engine;
+};
+
+/**
+ * 通信域的 rank 在节点上的布局, 例如 "0x4,1x4" 表示前 4 个 rank 在第一个节点, 后 4 个在第二个节点.
+ * 节点按第一次出现的顺序编号, 连续在同一个节点上的 rank 合并成一段. 集合操作, 见 gather_hosts
+ */
+static std::string host_layout(const MPI_Comm &comm)
+{
+    const std::vector<int> hosts = gather_hosts(comm);
+    std::map<int, size_t> index;
+    std::string layout;
+    for (size_t i = 0; i < hosts.size();)
+    {
+        size_t j = i;
+        while (j < hosts.size() && hosts[j] == hosts[i]) j++;
+        const size_t id = index.emplace(hosts[i], index.size()).first->second;
+        layout += (layout.empty() ? "" : ",") + std::to_string(id) + "x" + std::to_string(j - i);
+        i = j;
+    }
+    return layout;
+}
+
+/**
+ * 按消息大小选择引擎 (算法和拓扑) 的决策表, 挂在通信域上 (见 comm_object), 用于阻塞调用.
+ * 小消息适合扁平的树, 大消息适合 ring 或者更深的树, 一个 FT_TOPO 没法兼顾所有大小.
+ *
+ * 第一次调用时初始化: 先从 FT_SELECT_FILE 中取 rank 数和通信域大小相同的行; 没有这样的行时看 FT_SELECT:
+ * tune 做一遍调优 (见 measure), 候选是几种算法; autotune 在树的拓扑之间调优 (见 autotune), 结果存在调优文件里, 之后的运行直接读取.
+ * 都没有时决策表为空, 仍然用 FT_ALGO 和 FT_TOPO. 文件每行是 "rank 数 字节数上限 算法 拓扑", 字节数上限可以写 inf,
+ * 拓扑写 - 表示默认 (由代价模型选择, 见 model_stages), # 之后是注释. 比最后一项还大的消息用最后一项.
+ * 设置了 FT_SELECT_DUMP 时通信域的第 0 个 rank 把决策表按同样的格式写进这个文件 (替换 rank 数相同的行), 可以直接作为 FT_SELECT_FILE.
+ */
+class Engine_Selector
+{
+public:
+    bool initialized = false;
+    std::vector<Engine_Rule> rules; // 按 max_bytes 从小到大
+
+    void init(const MPI_Comm &comm)
+    {
+        initialized = true;
+        int rank, size;
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &size);
+        const char *file = getenv("FT_SELECT_FILE");
+        if (file != nullptr && file[0] != 0)
+        {
+            std::ifstream in(file);
+            if (!in)
+            {
+                std::cerr << "cannot open FT_SELECT_FILE " << file << std::endl;
+                exit(1);
+            }
+            rules = parse(in, "FT_SELECT_FILE", size, nullptr);
+        }
+        const char *raw = getenv("FT_SELECT");
+        const std::string mode = (raw == nullptr ? "" : raw);
+        if (mode != "" && mode != "0" && mode != "tune" && mode != "autotune")
+        {
+            std::cerr << "invalid FT_SELECT " << mode << std::endl;
+            exit(1);
+        }
+        if (rules.empty() && mode == "tune")
+        {
+            rules = measure(comm, candidates(size));
+        }
+        if (rules.empty() && mode == "autotune")
+        {
+            rules = load_tuned(comm);
+            if (rules.empty()) rules = autotune(comm);
+        }
+        const char *dump = getenv("FT_SELECT_DUMP");
+        if (rank == 0 && !rules.empty() && dump != nullptr && dump[0] != 0)
+        {
+            save(dump, size, nullptr, rules);
+        }
+#ifdef FT_DEBUG
+        for (const auto &r : rules)
+        {
+            std::cout << "FlexTree selects " << r.engine.algo << " " << r.engine.topo << " up to " << r.max_bytes << " bytes" << std::endl;
+        }
+#endif
+    }
+    // 决策表为空时返回 nullptr
+    const Engine *select(const size_t &bytes) const
+    {
+        if (rules.empty()) return nullptr;
+        for (const auto &r : rules)
+        {
+            if (bytes <= r.max_bytes) return &r.engine;
+        }
+        return &rules.back().engine;
+    }
+    /**
+     * 在候选的树拓扑 (见 topo_candidates) 之间调优, 集合操作.
+     * 第 0 个 rank 把结果写进调优文件 FT_AUTOTUNE_FILE (默认 flextree_autotune.txt), 按 rank 数和节点布局 (见 host_layout) 区分,
+     * 替换同样 rank 数和布局的行. 文件每行是 "rank 数 布局 字节数上限 算法 拓扑", 其余和 FT_SELECT_FILE 相同
+     */
+    static std::vector<Engine_Rule> autotune(const MPI_Comm &comm)
+    {
+        int rank, size;
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &size);
+        const std::string layout = host_layout(comm);
+        std::vector<Engine> engines;
+        for (const auto &topo : topo_candidates(size))
+        {
+            engines.push_back({"tree", topo});
+        }
+        const std::vector<Engine_Rule> tuned = measure(comm, engines);
+        if (rank == 0)
         {
-            dst[i] = src0[i] & src1[i] & src2[i];
+            save(tuned_file(), size, &layout, tuned);
         }
-        break;
+        return tuned;
     }
-    case 4:
+private:
+    // 候选的引擎: 扁平的树, 两层的树 (最接近的两个因子), 按质因数分解的最深的树, ring, doubling, rabenseifner.
+    // 扁平的树写成 n, 空的拓扑表示由代价模型选择 (见 model_stages)
+    static std::vector<Engine> candidates(const size_t &n)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        std::vector<Engine> engines = {{"tree", std::to_string(n)}};
+        size_t a = (size_t)std::sqrt((double)n);
+        while (a > 1 && n % a != 0) a--;
+        if (a > 1)
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i];
+            engines.push_back({"tree", std::to_string(a) + "," + std::to_string(n / a)});
         }
-        break;
-    }
-    case 5:
-    {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        std::vector<size_t> factors;
+        size_t m = n;
+        for (size_t p = 2; p * p <= m; p++)
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i] & src4[i];
+            while (m % p == 0)
+            {
+                factors.push_back(p);
+                m /= p;
+            }
         }
-        break;
+        if (m > 1) factors.push_back(m);
+        if (factors.size() > 2)
+        {
+            std::string topo;
+            for (auto f : factors)
+            {
+                topo += (topo.empty() ? "" : ",") + std::to_string(f);
+            }
+            engines.push_back({"tree", topo});
+        }
+        engines.push_back({"ring", ""});
+        engines.push_back({"doubling", ""});
+        engines.push_back({"rabenseifner", ""});
+        return engines;
     }
-    case 6:
+    // n 分解成不小于 min 的因数, 因数从小到大, 最多 depth 个
+    static void factor_sets(const size_t &n, const size_t &min, const size_t &depth, std::vector<size_t> &now, std::vector<std::vector<size_t>> &sets)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        if (n == 1)
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i] & src4[i] & src5[i];
+            if (!now.empty()) sets.push_back(now);
+            return;
+        }
+        if (depth == 0) return;
+        for (size_t f = min; f <= n; f++)
+        {
+            if (n % f != 0) continue;
+            now.push_back(f);
+            factor_sets(n / f, f, depth - 1, now, sets);
+            now.pop_back();
         }
-        break;
     }
-    case 7:
+    /**
+     * autotune 的候选拓扑: n 的有序因数分解 (和 cost_model 里的 getWidth 一样), 但是剪掉大部分:
+     * 最多 FT_AUTOTUNE_DEPTH (默认 3) 层; 同一组因数只取从小到大和从大到小两种顺序; 超过 FT_AUTOTUNE_CANDIDATES (默认 8) 个时
+     * 优先层数少的, 层数相同时优先最宽的一层比较窄的. n 是质数时再加上 n - 1 的分解和一个单独的 rank. 扁平的树 (n) 总在第一个
+     */
+    static std::vector<std::string> topo_candidates(const size_t &n)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        const size_t depth = std::max<size_t>(get_env_size("FT_AUTOTUNE_DEPTH", 3), 1);
+        const size_t limit = std::max<size_t>(get_env_size("FT_AUTOTUNE_CANDIDATES", 8), 1);
+        std::vector<std::pair<std::vector<size_t>, size_t>> orders; // 各层的宽度, 单独的 rank 数
+        std::vector<size_t> now;
+        for (size_t lonely = 0; lonely <= 1; lonely++)
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i] & src4[i] & src5[i] & src6[i];
+            if (n - lonely < 2) break;
+            std::vector<std::vector<size_t>> sets;
+            factor_sets(n - lonely, 2, depth, now, sets);
+            // 只有扁平的树时 n 是质数
+            if (lonely == 1 && !(orders.size() == 1 && n > 3)) break;
+            for (auto &set : sets)
+            {
+                if (lonely == 1 && set.size() == 1) continue;
+                orders.push_back({set, lonely});
+                std::reverse(set.begin(), set.end());
+                if (set != orders.back().first) orders.push_back({set, lonely});
+            }
         }
-        break;
+        if (orders.empty()) orders.push_back({{n}, 0});
+        std::stable_sort(orders.begin(), orders.end(), [](const std::pair<std::vector<size_t>, size_t> &a, const std::pair<std::vector<size_t>, size_t> &b) {
+            if (a.first.size() != b.first.size()) return a.first.size() < b.first.size();
+            return *std::max_element(a.first.begin(), a.first.end()) < *std::max_element(b.first.begin(), b.first.end());
+        });
+        std::vector<std::string> topos;
+        for (const auto &o : orders)
+        {
+            if (topos.size() >= limit) break;
+            std::string topo;
+            for (auto w : o.first)
+            {
+                topo += (topo.empty() ? "" : ",") + std::to_string(w);
+            }
+            if (o.second > 0) topo += "+" + std::to_string(o.second);
+            topos.push_back(topo);
+        }
+        return topos;
     }
-    case 8:
+    /**
+     * 调优: 从 1KB 到 FT_SELECT_MAX_BYTES (默认 16MB) 每次乘 4, 每个大小把每个候选引擎跑 FT_SELECT_REPEAT (默认 3) 次 float 求和.
+     * 每次取各个 rank 中最慢的时间, 所以所有 rank 选出的一样. 相邻两个测量点的分界取它们的几何平均, 选中同一个引擎的相邻区间合并.
+     */
+    static std::vector<Engine_Rule> measure(const MPI_Comm &comm, const std::vector<Engine> &engines)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        const size_t max_bytes = std::max<size_t>(get_env_size("FT_SELECT_MAX_BYTES", 16 << 20), 1024);
+        const size_t repeat = std::max<size_t>(get_env_size("FT_SELECT_REPEAT", 3), 1);
+        std::vector<float> data(max_bytes / sizeof(float));
+        std::vector<Engine_Rule> rules;
+        for (size_t bytes = 1024; bytes <= max_bytes; bytes *= 4)
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i] & src4[i] & src5[i] & src6[i] & src7[i];
+            size_t best = 0;
+            double best_time = std::numeric_limits<double>::infinity();
+            for (size_t e = 0; e < engines.size(); e++)
+            {
+                std::unique_ptr<Allreduce_Schedule> schedule(create_schedule(MPI_IN_PLACE, data.data(), bytes / sizeof(float), MPI_FLOAT, MPI_SUM, comm, nullptr, true, false, engines[e]));
+                // 第一次包括放置缓冲区之类的准备工作, 不算
+                std::vector<double> times(repeat + 1);
+                for (auto &t : times)
+                {
+                    MPI_Barrier(comm);
+                    const double begin = MPI_Wtime();
+                    schedule->start();
+                    schedule->advance(true);
+                    t = MPI_Wtime() - begin;
+                }
+                MPI_Allreduce(MPI_IN_PLACE, times.data(), times.size(), MPI_DOUBLE, MPI_MAX, comm);
+                const double t = *std::min_element(times.begin() + 1, times.end());
+                if (t < best_time)
+                {
+                    best_time = t;
+                    best = e;
+                }
+            }
+            const size_t limit = (bytes * 4 > max_bytes ? SIZE_MAX : bytes * 2);
+            if (!rules.empty() && rules.back().engine.algo == engines[best].algo && rules.back().engine.topo == engines[best].topo)
+            {
+                rules.back().max_bytes = limit;
+            }
+            else
+            {
+                rules.push_back({limit, engines[best]});
+            }
         }
-        break;
+        return rules;
+    }
+    static const char *tuned_file()
+    {
+        const char *file = getenv("FT_AUTOTUNE_FILE");
+        return (file != nullptr && file[0] != 0) ? file : "flextree_autotune.txt";
     }
-    case 9:
+    // 第 0 个 rank 读调优文件并广播, 各个 rank 看到的文件可能不一样 (不是共享的文件系统), 但是必须一致决定要不要调优
+    static std::vector<Engine_Rule> load_tuned(const MPI_Comm &comm)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        int rank, size;
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &size);
+        const std::string layout = host_layout(comm);
+        std::string text;
+        if (rank == 0)
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i] & src4[i] & src5[i] & src6[i] & src7[i] & src8[i];
+            std::ifstream in(tuned_file());
+            std::ostringstream ss;
+            ss << in.rdbuf();
+            text = ss.str();
         }
-        break;
+        unsigned long long len = text.size();
+        MPI_Bcast(&len, 1, MPI_UNSIGNED_LONG_LONG, 0, comm);
+        text.resize(len);
+        MPI_Bcast(&text[0], (int)len, MPI_CHAR, 0, comm);
+        std::istringstream in(text);
+        return parse(in, "FT_AUTOTUNE_FILE", size, &layout);
     }
-    case 10:
+    // 取 rank 数 (和布局, layout 不为 nullptr 时) 相同的行
+    static std::vector<Engine_Rule> parse(std::istream &in, const char *name, const int &size, const std::string *layout)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        std::vector<Engine_Rule> rules;
+        std::string line;
+        while (std::getline(in, line))
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i] & src4[i] & src5[i] & src6[i] & src7[i] & src8[i] & src9[i];
+            std::istringstream ss(line.substr(0, line.find('#')));
+            std::string ranks, where, limit, algo, topo;
+            if (!(ss >> ranks)) continue;
+            if ((layout != nullptr && !(ss >> where)) || !(ss >> limit >> algo))
+            {
+                std::cerr << "invalid line in " << name << ": " << line << std::endl;
+                exit(1);
+            }
+            if (!(ss >> topo) || topo == "-") topo = "";
+            if (strtoul(ranks.c_str(), nullptr, 10) != (unsigned long)size) continue;
+            if (layout != nullptr && where != *layout) continue;
+            // 算法名不对时在这里报错
+            get_algorithm(algo);
+            rules.push_back({(limit == "inf" ? SIZE_MAX : (size_t)strtoull(limit.c_str(), nullptr, 10)), {algo, topo}});
         }
-        break;
+        std::stable_sort(rules.begin(), rules.end(), [](const Engine_Rule &a, const Engine_Rule &b) { return a.max_bytes < b.max_bytes; });
+        return rules;
     }
-    case 11:
+    static void save(const char *file, const int &size, const std::string *layout, const std::vector<Engine_Rule> &rules)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        std::vector<std::string> kept;
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i] & src4[i] & src5[i] & src6[i] & src7[i] & src8[i] & src9[i] & src10[i];
+            std::ifstream in(file);
+            std::string line;
+            while (std::getline(in, line))
+            {
+                std::istringstream ss(line.substr(0, line.find('#')));
+                int ranks;
+                std::string where;
+                if (ss >> ranks && ranks == size && (layout == nullptr || (ss >> where && where == *layout))) continue;
+                kept.push_back(line);
+            }
         }
-        break;
+        std::ofstream out(file);
+        for (const auto &line : kept)
+        {
+            out << line << std::endl;
+        }
+        for (const auto &r : rules)
+        {
+            out << size << " " << (layout == nullptr ? "" : *layout + " ") << (r.max_bytes == SIZE_MAX ? "inf" : std::to_string(r.max_bytes)) << " " << (r.engine.algo.empty() ? "tree" : r.engine.algo) << " " << (r.engine.topo.empty() ? "-" : r.engine.topo) << std::endl;
+        }
+    }
+};
+
+// 阻塞调用用的引擎: 通信域有决策表时按消息的字节数选, 否则是 FT_ALGO 和 FT_TOPO
+static Engine select_engine(const MPI_Comm &comm, const int &count, const MPI_Datatype &datatype)
+{
+    Engine_Selector &selector = comm_object<Engine_Selector>(comm);
+    if (!selector.initialized) selector.init(comm);
+    int type_size;
+    MPI_Type_size(datatype, &type_size);
+    const Engine *engine = selector.select((size_t)count * type_size);
+    return engine != nullptr ? *engine : env_engine();
+}
+
+// 通信域上选定的决策表, 在第一次阻塞调用之后才有; 为空表示不做选择
+static inline const std::vector<Engine_Rule> &selector_rules(const MPI_Comm &comm)
+{
+    return comm_object<Engine_Selector>(comm).rules;
+}
+
+// 马上在通信域上做一遍拓扑调优 (见 Engine_Selector::autotune) 并使用它的结果, 代替已有的决策表. 集合操作
+static void autotune(const MPI_Comm &comm)
+{
+    Engine_Selector &selector = comm_object<Engine_Selector>(comm);
+    selector.initialized = true;
+    selector.rules = Engine_Selector::autotune(comm);
+}
+
+// 设置 FT_HIER=1 打开分层 allreduce, 见 hier_allreduce
+static bool hier_enabled()
+{
+    static const bool enabled = get_env_size("FT_HIER", 0) != 0;
+    return enabled;
+}
+
+/**
+ * 分层 allreduce 用到的通信域和共享内存窗口, 挂在通信域上 (见 comm_object), 第一次调用时初始化.
+ * node_comm 是同一台机器上的 rank. 设置 FT_HIER_LOCAL_SIZE=k 时按编号每 k 个 rank 当作一台机器, 用来在一台机器上模拟多机.
+ * 窗口里有 local_size + 1 个槽, 前 local_size 个是各个本地 rank 的输入, 最后一个是结果.
+ */
+class Hier_Context: public Mpi_Resource
+{
+public:
+    bool initialized = false, enabled = false;
+    // 每台机器上的 rank 数都相同时, 本地第 l 个 rank 负责第 l 片的跨机器 allreduce, cross_comm 是各台机器上的第 l 个 rank;
+    // 否则只有本地第 0 个 rank 对整份数据做跨机器的 allreduce
+    bool uniform = false;
+    size_t local_rank = 0, local_size = 1;
+    MPI_Comm node_comm = MPI_COMM_NULL, cross_comm = MPI_COMM_NULL;
+    // 本地 reduce 的来源表, 每个通信域一份, 不同线程上的通信域之间不共享
+    Reduce_Table table;
+
+    ~Hier_Context()
+    {
+        release();
     }
-    case 12:
+    // 释放窗口和通信域. 窗口和通信域都是集合操作, 各个 rank 按同样的顺序调用
+    virtual void release()
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        if (win != MPI_WIN_NULL)
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i] & src4[i] & src5[i] & src6[i] & src7[i] & src8[i] & src9[i] & src10[i] & src11[i];
+            MPI_Win_unlock_all(win);
+            MPI_Win_free(&win);
         }
-        break;
+        if (cross_comm != MPI_COMM_NULL) MPI_Comm_free(&cross_comm);
+        if (node_comm != MPI_COMM_NULL) MPI_Comm_free(&node_comm);
+        enabled = false;
     }
-    case 13:
+    void init(const MPI_Comm &comm)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        initialized = true;
+        if (!hier_enabled()) return;
+        int rank, tmp;
+        MPI_Comm_rank(comm, &rank);
+        const size_t simulated = get_env_size("FT_HIER_LOCAL_SIZE", 0);
+        if (simulated > 0)
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i] & src4[i] & src5[i] & src6[i] & src7[i] & src8[i] & src9[i] & src10[i] & src11[i] & src12[i];
+            MPI_Comm_split(comm, rank / simulated, rank, &node_comm);
+        }
+        else
+        {
+            MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+        }
+        MPI_Comm_rank(node_comm, &tmp);
+        local_rank = tmp;
+        MPI_Comm_size(node_comm, &tmp);
+        local_size = tmp;
+        int sizes[2] = {tmp, -tmp};
+        MPI_Allreduce(MPI_IN_PLACE, sizes, 2, MPI_INT, MPI_MAX, comm);
+        uniform = (sizes[0] == -sizes[1]);
+        // 每台机器只有一个 rank 时没有可以在共享内存里合并的数据
+        enabled = (sizes[0] > 1);
+        if (!enabled)
+        {
+            MPI_Comm_free(&node_comm);
+            return;
+        }
+        MPI_Comm_split(comm, (uniform ? (int)local_rank : (local_rank == 0 ? 0 : MPI_UNDEFINED)), rank, &cross_comm);
+        if (cross_comm != MPI_COMM_NULL)
+        {
+            // 跨机器的那一层不再分层
+            comm_object<Hier_Context>(cross_comm).initialized = true;
         }
-        break;
     }
-    case 14:
+    // 保证每个槽至少有 slot_bytes 字节, 返回第一个槽的地址. node_comm 上的集合操作, 本机所有 rank 的 slot_bytes 相同
+    char *reserve(const size_t &slot_bytes)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        if (slot_bytes <= slot_capacity) return base;
+        if (win != MPI_WIN_NULL)
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i] & src4[i] & src5[i] & src6[i] & src7[i] & src8[i] & src9[i] & src10[i] & src11[i] & src12[i] & src13[i];
+            MPI_Win_unlock_all(win);
+            MPI_Win_free(&win);
         }
-        break;
+        // 整块都由本地第 0 个 rank 分配, 各个槽是连续的
+        void *ptr;
+        MPI_Win_allocate_shared((local_rank == 0 ? (local_size + 1) * slot_bytes : 0), 1, MPI_INFO_NULL, node_comm, &ptr, &win);
+        MPI_Aint size;
+        int disp_unit;
+        MPI_Win_shared_query(win, 0, &size, &disp_unit, &ptr);
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+        base = (char*)ptr;
+        slot_capacity = slot_bytes;
+        return base;
+    }
+    // 本机的 rank 之间同步一次, 之前写进窗口的数据对其他 rank 可见
+    void sync()
+    {
+        MPI_Win_sync(win);
+        MPI_Barrier(node_comm);
+        MPI_Win_sync(win);
+    }
+private:
+    MPI_Win win = MPI_WIN_NULL;
+    char *base = nullptr;
+    size_t slot_capacity = 0;
+};
+
+/**
+ * 分层 allreduce. 同一台机器上的 rank 之间不再走点对点消息:
+ * 1. 各自把输入拷进共享内存窗口, 同步;
+ * 2. 本地第 l 个 rank 把所有本地输入的第 l 片 reduce 到结果槽里, 各个 rank 同时进行;
+ * 3. 跨机器: 各台机器上负责同一片的 rank 用 FlexTree 的调度对这一片做 allreduce (FT_ALGO 和 FT_TOPO 描述的是机器这一层);
+ *    每台机器 rank 数不同时由本地第 0 个 rank 对整份数据做;
+ * 4. 同步之后各自从结果槽拷回 recvbuf.
+ * 只用于阻塞调用, 非阻塞和持久化的调用仍然是平铺的调度. 没有打开或者每台机器只有一个 rank 时返回 false.
+ */
+static bool hier_allreduce(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm)
+{
+    Hier_Context &hier = comm_object<Hier_Context>(comm);
+    if (!hier.initialized)
+    {
+        hier.init(comm);
     }
-    case 15:
+    if (!hier.enabled) return false;
+    // 按本地 rank 数分片, 第 l 片是 node_ctx 的第 l 块
+    const FlexTree_Context node_ctx(hier.node_comm, datatype, count);
+    const Reduce_Kernel kernel = resolve_reduce(datatype, op, node_ctx);
+    const size_t slot_bytes = (node_ctx.buffer_bytes(count) + 63) / 64 * 64;
+    char *base = hier.reserve(slot_bytes) + node_ctx.buffer_front();
+    char *result = base + hier.local_size * slot_bytes;
+    copy_local((sendbuf == MPI_IN_PLACE ? recvbuf : sendbuf), base + hier.local_rank * slot_bytes, count, datatype, node_ctx.type_dense, node_ctx.type_extent);
+    hier.sync();
+
+    const size_t begin = node_ctx.split_size * hier.local_rank;
+    const size_t len = segment_range(node_ctx, hier.local_rank, 0, SIZE_MAX);
+    if (hier.local_size == 1)
+    {
+        // 只有一个来源时 reduce kernel 什么都不做, 直接拷过去
+        copy_local(base, result, count, datatype, node_ctx.type_dense, node_ctx.type_extent);
+    }
+    else if (len > 0)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        Reduce_Table &table = hier.table;
+        table.num_src = hier.local_size;
+        table.to_master = false;
+        table.src.resize(hier.local_size);
+        for (size_t k = 0; k < hier.local_size; k++)
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i] & src4[i] & src5[i] & src6[i] & src7[i] & src8[i] & src9[i] & src10[i] & src11[i] & src12[i] & src13[i] & src14[i];
+            table.src[k] = base + k * slot_bytes + begin * node_ctx.type_extent;
         }
-        break;
+        table.tasks.assign(1, Reduce_Task{table.src.data(), result + begin * node_ctx.type_extent, (kernel.generic ? len : len * kernel.multiple)});
+        run_reduce(kernel, table, node_ctx);
     }
-    case 16:
+    if (hier.uniform)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        // 只依赖自己 reduce 的那一片, 不用等其他本地 rank
+        if (len > 0)
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i] & src4[i] & src5[i] & src6[i] & src7[i] & src8[i] & src9[i] & src10[i] & src11[i] & src12[i] & src13[i] & src14[i] & src15[i];
+            allreduce(MPI_IN_PLACE, result + begin * node_ctx.type_extent, len, datatype, op, hier.cross_comm);
         }
-        break;
     }
-    case 17:
+    else
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        hier.sync();
+        if (hier.local_rank == 0)
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i] & src4[i] & src5[i] & src6[i] & src7[i] & src8[i] & src9[i] & src10[i] & src11[i] & src12[i] & src13[i] & src14[i] & src15[i] & src16[i];
+            allreduce(MPI_IN_PLACE, result, count, datatype, op, hier.cross_comm);
         }
-        break;
     }
-    case 18:
+    hier.sync();
+    // 下一次调用写输入和结果之前都要先经过一次同步, 这时所有 rank 都已经拷完了
+    copy_local(result, recvbuf, count, datatype, node_ctx.type_dense, node_ctx.type_extent);
+    return true;
+}
+
+/**
+ * allreduce 的入口. 算法和拓扑由 select_engine 按消息大小选择, 没有决策表时是 FT_ALGO 和 FT_TOPO.
+ * 
+ * @param master 见 create_schedule
+ */
+static int allreduce(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm, float *master)
+{
+    init_local_ranks(comm);
+    // 不满足交换律的用户算子要求按 rank 顺序合并, 树形的合并顺序做不到, 交给 MPI 自己的实现
+    int commute;
+    MPI_Op_commutative(op, &commute);
+    if (!commute)
+    {
+        return PMPI_Allreduce(sendbuf, recvbuf, count, datatype, op, comm);
+    }
+#ifdef FT_DEBUG
+    std::cout << "FlexTree AR called" << std::endl;
+#endif
+    if (allreduce_direct(sendbuf, recvbuf, count, datatype, op, comm, master))
+    {
+        return 0;
+    }
+    // 分层模式不支持主副本
+    if (master == nullptr && hier_allreduce(sendbuf, recvbuf, count, datatype, op, comm))
+    {
+        return 0;
+    }
+    const Engine engine = select_engine(comm, count, datatype);
+    const Plan_Key key = {count, datatype, op, master != nullptr, engine.algo, engine.topo, get_transport(), false};
+    Plan_Cache &cache = comm_object<Plan_Cache>(comm);
+    Allreduce_Schedule *schedule = cache.find(key);
+    std::unique_ptr<Allreduce_Schedule> uncached;
+    if (schedule != nullptr)
+    {
+        schedule->bind((sendbuf == MPI_IN_PLACE ? nullptr : sendbuf), recvbuf, master, shared_recv_buffer(schedule->context()));
+    }
+    else
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        schedule = create_schedule(sendbuf, recvbuf, count, datatype, op, comm, master, true, false, engine);
+        if (!cache.insert(key, schedule))
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i] & src4[i] & src5[i] & src6[i] & src7[i] & src8[i] & src9[i] & src10[i] & src11[i] & src12[i] & src13[i] & src14[i] & src15[i] & src16[i] & src17[i];
+            uncached.reset(schedule);
         }
-        break;
     }
-    case 19:
+    schedule->start();
+    schedule->advance(true);
+#ifdef FT_DEBUG
+    std::cout << "FlexTree AR finished" << std::endl;
+#endif
+    return 0;
+}
+
+/**
+ * 分组的 allreduce: sendiov 和 recviov 各有 iovcnt 片, 对应的片长度相同, 所有片首尾相接当作一个向量做一次 allreduce.
+ * sendiov 为 null 时在 recviov 上原地进行. tree 的调度直接在各片上收发和 reduce (见 Iovec_List), 不用拷进拷出;
+ * 其他情况 (别的算法, 单边传输, 分层模式, 确定性模式, 单节点, 不满足交换律的算子) 先拷进一块连续的缓冲区, 做完再拷回去.
+ */
+static int allreduce_group(const Iovec *sendiov, const Iovec *recviov, const size_t &iovcnt, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm)
+{
+    init_local_ranks(comm);
+    size_t count = 0;
+    for (size_t i = 0; i < iovcnt; i++)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        if (sendiov != nullptr && sendiov[i].count != recviov[i].count)
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i] & src4[i] & src5[i] & src6[i] & src7[i] & src8[i] & src9[i] & src10[i] & src11[i] & src12[i] & src13[i] & src14[i] & src15[i] & src16[i] & src17[i] & src18[i];
+            std::cerr << "The send and receive pieces of a grouped allreduce must have the same lengths." << std::endl;
+            exit(1);
         }
-        break;
+        count += recviov[i].count;
+    }
+    if (count > (size_t)std::numeric_limits<int>::max())
+    {
+        std::cerr << "A grouped allreduce of " << count << " elements is too large." << std::endl;
+        exit(1);
     }
-    case 20:
+    // 所有片都是空的, 没有数据需要交换
+    if (count == 0) return 0;
+    MPI_Aint lb, extent;
+    MPI_Type_get_extent(datatype, &lb, &extent);
+    int commute, comm_size;
+    MPI_Op_commutative(op, &commute);
+    MPI_Comm_size(comm, &comm_size);
+    const bool direct = (commute && comm_size > 1 && !deterministic_supported(datatype, op) && !hier_enabled() && get_transport() == TRANSPORT_P2P);
+    const Engine engine = (direct ? select_engine(comm, (int)count, datatype) : Engine());
+    if (direct && get_algorithm(engine.algo) == ALGO_TREE)
     {
-#pragma omp parallel for simd num_threads(PARALLEL_THREAD)
-        for (size_t i = 0; i < num_elements; ++i)
+        const Iovec_List recv_list(recviov, iovcnt, extent);
+        std::unique_ptr<Iovec_List> send_list(sendiov != nullptr ? new Iovec_List(sendiov, iovcnt, extent) : nullptr);
+        const Plan_Key key = {(int)count, datatype, op, false, engine.algo, engine.topo, TRANSPORT_P2P, true};
+        Plan_Cache &cache = comm_object<Plan_Cache>(comm);
+        Allreduce_Schedule *schedule = cache.find(key);
+        std::unique_ptr<Allreduce_Schedule> uncached;
+        if (schedule != nullptr)
         {
-            dst[i] = src0[i] & src1[i] & src2[i] & src3[i] & src4[i] & src5[i] & src6[i] & src7[i] & src8[i] & src9[i] & src10[i] & src11[i] & src12[i] & src13[i] & src14[i] & src15[i] & src16[i] & src17[i] & src18[i] & src19[i];
+            schedule->bind(nullptr, nullptr, nullptr, shared_recv_buffer(schedule->context()));
+        }
+        else
+        {
+            schedule = create_schedule(MPI_IN_PLACE, nullptr, (int)count, datatype, op, comm, nullptr, true, false, engine);
+            uncached.reset(schedule);
+        }
+        // 只缓存能直接在各片上做的调度
+        if (schedule->bind_iov((send_list ? send_list.get() : &recv_list), &recv_list))
+        {
+            if (uncached && cache.insert(key, schedule))
+            {
+                uncached.release();
+            }
+            schedule->start();
+            schedule->advance(true);
+            return 0;
         }
-        break;
     }
-    default:
-        std::cerr << "Unknown num_blocks: " << num_blocks << std::endl;
-        break;
+    std::vector<char> packed(count * extent);
+    char *p = packed.data();
+    for (size_t i = 0; i < iovcnt; i++)
+    {
+        memcpy(p, (sendiov != nullptr ? sendiov : recviov)[i].base, recviov[i].count * extent);
+        p += recviov[i].count * extent;
     }
+    allreduce(MPI_IN_PLACE, packed.data(), (int)count, datatype, op, comm);
+    p = packed.data();
+    for (size_t i = 0; i < iovcnt; i++)
+    {
+        memcpy(recviov[i].base, p, recviov[i].count * extent);
+        p += recviov[i].count * extent;
+    }
+    return 0;
 }
 
-// 单纯的发送, 只负责安排工作, 不等待工作完成.
-static size_t handle_send(const MPI_Comm &comm, const MPI_Datatype &datatype, const std::vector<Operation> *ops, const void *data, const FlexTree_Context &ft_ctx, MPI_Request request[])
+// 一次 allreduce 调用的参数, 持久化的请求每次 start 都用同样的参数
+struct Allreduce_Args
 {
+    const void *sendbuf;
+    void *recvbuf;
+    int count;
+    MPI_Datatype datatype;
+    MPI_Op op;
+    MPI_Comm comm;
+    float *master;
+};
 
-    size_t start;
-    size_t request_index = 0;
-
-    for (const auto &i : *ops)
+// 非阻塞 allreduce 的句柄
+class Allreduce_Request
+{
+public:
+    std::unique_ptr<Allreduce_Schedule> schedule; // FlexTree 的调度, 为 null 时看 mpi_request
+    MPI_Request mpi_request;                      // 交给 MPI 的调用 (不满足交换律的算子), 没有时为 MPI_REQUEST_NULL
+    bool done;                                    // 持久化的请求在没有 start 时也是 done
+    bool persistent;                              // 持久化的请求完成之后不释放, 可以再次 start
+    Allreduce_Args args;                          // 只有持久化的请求才保存
+    Allreduce_Request(): mpi_request(MPI_REQUEST_NULL), done(false), persistent(false) {}
+    // 不阻塞地推进一次
+    bool advance()
     {
-        if (LIKELY(ft_ctx.node_label != i.peer))
+        if (done) return true;
+        if (schedule)
         {
-            for (const auto &j : i.blocks)
-            {
-                start = ft_ctx.split_size * j;
-                //LOG_IF(INFO, node_label == 4) << "##4 send " << j << " which is " << start << "+" << count << " to " << i.peer ;
-                
-                // 如果当前块的末尾计算值大于实际的总数据块大小 (超出)
-                if (UNLIKELY(start + ft_ctx.split_size > ft_ctx.data_size))
-                {
-                    // 如果当前块的起始位置没有超过实际总数据块大小
-                    if (start < ft_ctx.data_size)
-                    {
-                        MPI_Isend(data + start * ft_ctx.type_size, ft_ctx.data_size - start, datatype, i.peer, 0, comm, &request[request_index++]); // 此处的tag暂时先打0
-#ifdef FT_DEBUG
-                        std::cout << ft_ctx.node_label << " send " << j << " which is " << start << "+" << ft_ctx.data_size - start << " to " << i.peer << ", element size = " << ft_ctx.type_size << std::endl;
-#endif
-                    }
-                    // 否则根本不发送 (因为块为空)
-                    else
-                    {
-#ifdef FT_DEBUG
-                        std::cout << ft_ctx.node_label << " will not send " << j << " which starts from " << start << " to " << i.peer << " because it's empty." << std::endl;
-#endif
-                    }
-                }
-                else 
-                {
-#ifdef FT_DEBUG
-                    std::cout << ft_ctx.node_label << " send " << j << " which is " << start << "+" << ft_ctx.split_size << " to " << i.peer << ", element size = " << ft_ctx.type_size << std::endl;
-#endif
-                    MPI_Isend(data + start * ft_ctx.type_size, ft_ctx.split_size, datatype, i.peer, 0, comm, &request[request_index++]); // 此处的tag暂时先打0
-                }
-            }
+            done = schedule->advance(false);
         }
+        else
+        {
+            int flag;
+            MPI_Test(&mpi_request, &flag, MPI_STATUS_IGNORE);
+            done = (flag != 0);
+        }
+        return done;
     }
-    return request_index;
-}
+};
 
-// 同上, 只负责安排工作, 不等待工作完成.
-// accordingly 参数的含义是, 如果为 true, 那么把数据块写到 buffer 中对应的位置去; 如果为 false, 那么直接平铺在 buffer 中.
-static size_t handle_recv(const MPI_Comm &comm, const MPI_Datatype &datatype, const std::vector<Operation> *ops, void *buffer, const FlexTree_Context &ft_ctx, const bool &accordingly, MPI_Request request[])
+// 推进所有没完成的非阻塞 allreduce. 不同节点等待的顺序可能不同, 一个节点在等某个请求的时候, 别的节点可能在等另一个,
+// 所以等待的时候不能只推进自己等的那一个, 否则会互相卡住.
+// 设置 FT_PROGRESS_THREAD=1 并且 MPI 提供 MPI_THREAD_MULTIPLE 时由后台线程不停地轮询, 否则在 test/wait 中轮询.
+class Progress_Engine
 {
+public:
+    static Progress_Engine &get()
+    {
+        static Progress_Engine engine;
+        return engine;
+    }
+    void add(Allreduce_Request *request)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        active.push_back(request);
+        cv.notify_all();
+    }
+    // 检查请求是否完成, 没有后台线程时顺便推进一次
+    bool test(Allreduce_Request *request)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!worker.joinable()) poll();
+        return request->done;
+    }
+    void wait(Allreduce_Request *request)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (worker.joinable())
+        {
+            cv.wait(lock, [request]() { return request->done; });
+            return;
+        }
+        while (true)
+        {
+            poll();
+            if (request->done) return;
+            lock.unlock();
+            std::this_thread::yield();
+            lock.lock();
+        }
+    }
+    ~Progress_Engine()
+    {
+        if (!worker.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+            cv.notify_all();
+        }
+        worker.join();
+    }
+private:
+    std::mutex mutex; // 保护 active, 同时保证同一时刻只有一个线程在推进
+    std::condition_variable cv;
+    std::vector<Allreduce_Request*> active;
+    bool stop;
+    std::thread worker;
 
-    size_t start = 0;
-    size_t request_index = 0;
-
-    for (const auto &i : *ops)
+    Progress_Engine(): stop(false)
     {
-        if (LIKELY(ft_ctx.node_label != i.peer))
+        if (get_env_size("FT_PROGRESS_THREAD", 0) == 0) return;
+        if (!mpi_thread_multiple())
         {
-            for (const auto &j : i.blocks)
-            {
-                size_t split_accord_start = ft_ctx.split_size * j;
-                if (accordingly) 
-                {
-                    start = split_accord_start;
-                }
+            std::cerr << "FT_PROGRESS_THREAD needs MPI_THREAD_MULTIPLE, ignored" << std::endl;
+            return;
+        }
+        worker = std::thread([this]() { loop(); });
+    }
+    // 所有请求各推进一次, 去掉已经完成的. 调用者需要持有 mutex. 有请求完成时返回 true
+    bool poll()
+    {
+        bool finished = false;
+        for (auto r : active)
+        {
+            finished |= r->advance();
+        }
+        if (finished)
+        {
+            active.erase(std::remove_if(active.begin(), active.end(), [](Allreduce_Request *r) { return r->done; }), active.end());
+        }
+        return finished;
+    }
+    void loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            cv.wait(lock, [this]() { return stop || !active.empty(); });
+            if (stop) return;
+            if (poll()) cv.notify_all();
+            // 让 test/wait 和新的请求有机会拿到锁
+            lock.unlock();
+            std::this_thread::yield();
+            lock.lock();
+        }
+    }
+};
 
-                // 如果当前块的末尾计算值大于实际的总数据块大小 (超出)
-                if (UNLIKELY(split_accord_start + ft_ctx.split_size > ft_ctx.data_size))
-                {
-                    // 如果当前块的起始位置没有超过实际总数据块大小
-                    if (split_accord_start < ft_ctx.data_size)
-                    {
-#ifdef FT_DEBUG
-                        std::cout << ft_ctx.node_label << " recv " << j << " which will be placed to " << start << "+" << ft_ctx.data_size - split_accord_start << " from " << i.peer << ", element size = " << ft_ctx.type_size << std::endl;
-#endif
-                        MPI_Irecv(buffer + start * ft_ctx.type_size, ft_ctx.data_size - split_accord_start, datatype, i.peer, 0, comm, &request[request_index++]); // 此处的tag暂时先打0
-                    }
-                    // 否则根本不接收 (因为块为空)
-                    else
-                    {
-#ifdef FT_DEBUG
-                        std::cout << ft_ctx.node_label << " will not recv " << j << " from " << i.peer << " because it's empty" << std::endl;
-#endif
-                    }
-                }
-                else
-                {
-#ifdef FT_DEBUG
-                    std::cout << ft_ctx.node_label << " recv " << j << " which will be placed to " << start << "+" << ft_ctx.split_size << " from " << i.peer << ", element size = " << ft_ctx.type_size << std::endl;
-#endif
-                    MPI_Irecv(buffer + start * ft_ctx.type_size, ft_ctx.split_size, datatype, i.peer, 0, comm, &request[request_index++]); // 此处的tag暂时先打0
-                }
-                
-                if (!accordingly)
-                {
-                    start += ft_ctx.split_size;
-                }
-            }
+/**
+ * 非阻塞 allreduce 的入口. 单节点和确定性模式会在这里直接做完.
+ * 返回的句柄要用 test_request/wait_request 完成, 完成之后由调用者 delete.
+ */
+static Allreduce_Request *iallreduce(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm, float *master = nullptr)
+{
+    init_local_ranks(comm);
+    Allreduce_Request *request = new Allreduce_Request;
+    int commute;
+    MPI_Op_commutative(op, &commute);
+    if (!commute)
+    {
+        PMPI_Iallreduce(sendbuf, recvbuf, count, datatype, op, comm, &request->mpi_request);
+    }
+    else
+    {
+        if (allreduce_direct(sendbuf, recvbuf, count, datatype, op, comm, master))
+        {
+            request->done = true;
+        }
+        else
+        {
+            request->schedule.reset(create_schedule(sendbuf, recvbuf, count, datatype, op, comm, master, false));
+            request->schedule->start();
         }
     }
-    return request_index;
+    if (!request->done)
+    {
+        Progress_Engine::get().add(request);
+    }
+    return request;
+}
+
+/**
+ * 持久化 allreduce 的初始化, 参数和 MPI_Allreduce_init 相同, 之后对同样的缓冲区反复 start_request 和 wait_request.
+ * 初始化时就算好 FlexTree_Context, 拓扑, 收发的块, reduce 的来源表, 并生成所有的持久化请求;
+ * 之后的每一次只是 MPI_Startall 和 reduce, 不再分配内存. 这是集合操作, 所有节点要以同样的顺序调用.
+ * 单节点, 确定性模式和不满足交换律的算子没有 FlexTree 的调度, 每次 start 时重新调用.
+ */
+static Allreduce_Request *allreduce_init(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm, float *master = nullptr)
+{
+    init_local_ranks(comm);
+    Allreduce_Request *request = new Allreduce_Request;
+    request->persistent = true;
+    request->done = true;
+    request->args = Allreduce_Args{sendbuf, recvbuf, count, datatype, op, comm, master};
+    int commute, comm_size;
+    MPI_Op_commutative(op, &commute);
+    MPI_Comm_size(comm, &comm_size);
+    if (commute && comm_size > 1 && !deterministic_supported(datatype, op))
+    {
+        request->schedule.reset(create_schedule(sendbuf, recvbuf, count, datatype, op, comm, master, false, true));
+    }
+    return request;
 }
 
-// 负责进行加和, 然后放到指定的位置上去. 注意会自动包含自己的那块data.
-// 这里的 dest 是一块和 data 大小/结构相同的一块内存. 进行 reduce 的时候, 会把结果对应地放进 dest 去. 注意 dest 不可以是 null.
-static void handle_reduce(const MPI_Datatype &datatype, const MPI_Op &op, const std::vector<size_t> *blocks, void *buffer, const void *data, void *dest, const FlexTree_Context &ft_ctx, const size_t &num_peers, void *extra_buffer = nullptr, const size_t &extra_peers = 0)
+// 开始一次持久化的 allreduce
+static void start_request(Allreduce_Request *request)
 {
-    if (dest == nullptr)
+    if (!request->persistent || !request->done)
     {
-        std::cerr << "I can't reduce to null. Aborted." << std::endl;
+        std::cerr << "Only an inactive persistent allreduce request can be started." << std::endl;
         exit(1);
     }
-    const size_t peer_gap = blocks->size() * ft_ctx.split_size;
-    const void **src = (const void**)(new char*[num_peers + extra_peers + 10]);
-    void *dst;
-    for (int i = 0; i < num_peers + 2; i++)
+    request->done = false;
+    const Allreduce_Args &a = request->args;
+    int commute;
+    MPI_Op_commutative(a.op, &commute);
+    if (request->schedule)
     {
-        src[i] = nullptr;
+        request->schedule->start();
     }
-    for (auto i = blocks->begin(); i != blocks->end(); i++)
+    else if (!commute)
     {
-        size_t start = ft_ctx.split_size * (*i);
-        size_t src_index = 1;
-        src[0] = data + start * ft_ctx.type_size;
-        dst = dest + start * ft_ctx.type_size;
-        size_t split_size = ft_ctx.split_size;
-        // 如果当前块的理论结尾位置超过了实际的块大小
-        if (UNLIKELY(start + ft_ctx.split_size > ft_ctx.data_size))
-        {
-            // 如果当前块的起始位置没有超过实际总数据块大小
-            if (start < ft_ctx.data_size)
-            {
-                split_size = ft_ctx.data_size - start;
-            }
-            else
-            {
-#ifdef FT_DEBUG
-                std::cout << ft_ctx.node_label << " will not reduce " << *i << " because it's empty." << std::endl;
-#endif
-                continue; // 当前块实际大小为零, 直接溜了.
-            }
-        }
-#ifdef FT_DEBUG
-        std::cout << ft_ctx.node_label << " reduce " << *i << " which size is " << split_size << ", element size = " << ft_ctx.type_size << std::endl;
-#endif
-        start = (i - blocks->begin()) * ft_ctx.split_size;
-        for (size_t j = 0; j < num_peers; j++)
-        {
-            src[src_index++] = buffer + start * ft_ctx.type_size;
-#ifdef FT_DEBUG
-            std::cout << "  --" << ft_ctx.node_label << " will reduce data at " << start << std::endl;
-#endif
-            start += peer_gap;
-        }
-        start = (i - blocks->begin()) * ft_ctx.split_size;
-        for (size_t j = 0; j < extra_peers; j++)
-        {
-            src[src_index++] = extra_buffer + start * ft_ctx.type_size;
-            start += peer_gap;
-        }
-        
-        if (op == MPI_SUM)
-        {
-            if (datatype == MPI_UINT8_T) reduce_sum((const uint8_t**)src, (uint8_t*)dst, src_index, split_size);
-            else if (datatype == MPI_INT8_T) reduce_sum((const int8_t**)src, (int8_t*)dst, src_index, split_size);
-            else if (datatype == MPI_UINT16_T) reduce_sum((const uint16_t**)src, (uint16_t*)dst, src_index, split_size);
-            else if (datatype == MPI_INT16_T) reduce_sum((const int16_t**)src, (int16_t*)dst, src_index, split_size);
-            else if (datatype == MPI_INT32_T) reduce_sum((const int32_t**)src, (int32_t*)dst, src_index, split_size);
-            else if (datatype == MPI_INT64_T) reduce_sum((const int64_t**)src, (int64_t*)dst, src_index, split_size);
-            else if (datatype == MPI_FLOAT) reduce_sum((const float**)src, (float*)dst, src_index, split_size);
-            else if (datatype == MPI_DOUBLE) reduce_sum((const double**)src, (double*)dst, src_index, split_size);
-            else if (datatype == MPI_C_BOOL) reduce_sum((const bool**)src, (bool*)dst, src_index, split_size);
-            else if (datatype == MPI_LONG_LONG_INT) reduce_sum((const long long int**)src, (long long int*)dst, src_index, split_size);
-            else if (datatype == MPI_LONG_LONG) reduce_sum((const long long**)src, (long long*)dst, src_index, split_size);
-            else 
-            {
-                char name[20];
-                int name_len;
-                MPI_Type_get_name(datatype, name, &name_len);
-                name[name_len] = '\0';
-                std::string s = name;
-                std::cerr << "Type " << s << " is not supported in MPI mode." << std::endl;
-                exit(1);
-            }
-        }
-        else if (op == MPI_BAND)
-        {
-            if (datatype == MPI_UINT8_T) reduce_band((const uint8_t**)src, (uint8_t*)dst, src_index, split_size);
-            else if (datatype == MPI_INT8_T) reduce_band((const int8_t**)src, (int8_t*)dst, src_index, split_size);
-            else if (datatype == MPI_UINT16_T) reduce_band((const uint16_t**)src, (uint16_t*)dst, src_index, split_size);
-            else if (datatype == MPI_INT16_T) reduce_band((const int16_t**)src, (int16_t*)dst, src_index, split_size);
-            else if (datatype == MPI_INT32_T) reduce_band((const int32_t**)src, (int32_t*)dst, src_index, split_size);
-            else if (datatype == MPI_INT64_T) reduce_band((const int64_t**)src, (int64_t*)dst, src_index, split_size);
-            else if (datatype == MPI_LONG_LONG_INT) reduce_band((const long long int**)src, (long long int*)dst, src_index, split_size);
-            else if (datatype == MPI_LONG_LONG) reduce_band((const long long**)src, (long long*)dst, src_index, split_size);
-            else 
-            {
-                char name[20];
-                int name_len;
-                MPI_Type_get_name(datatype, name, &name_len);
-                name[name_len] = '\0';
-                std::string s = name;
-                std::cerr << "Type " << s << " is not supported in MPI mode." << std::endl;
-                exit(1);
-            }
-        }
-        else 
-        {
-            std::cerr << "Unsupported op " << op << std::endl;
-            exit(1);
-        }
+        PMPI_Iallreduce(a.sendbuf, a.recvbuf, a.count, a.datatype, a.op, a.comm, &request->mpi_request);
+    }
+    else
+    {
+        allreduce(a.sendbuf, a.recvbuf, a.count, a.datatype, a.op, a.comm, a.master);
+        request->done = true;
+    }
+    if (!request->done)
+    {
+        Progress_Engine::get().add(request);
     }
-    delete[] src;
-    src = nullptr;
 }
 
-// 从环境变量获取每一层宽度
-// 任意一个位置是 1, 那就用 ring
-static std::vector<size_t> get_stages(const size_t &num_nodes)
+// 检查非阻塞 allreduce 是否完成
+static bool test_request(Allreduce_Request *request)
 {
-    std::string FT_TOPO; 
-    auto FT_TOPO_raw = getenv("FT_TOPO");
-    std::vector<size_t> ans;
-    size_t pi = 1;
-    int tmp;
-    if (FT_TOPO_raw != nullptr)
+    return Progress_Engine::get().test(request);
+}
+
+// 等待非阻塞 allreduce 完成
+static void wait_request(Allreduce_Request *request)
+{
+    Progress_Engine::get().wait(request);
+}
+
+class Fusion_Queue;
+
+// 融合队列中的一个 allreduce, 同时也是它的完成句柄, 完成之后由调用者 delete
+class Fusion_Handle
+{
+public:
+    const void *sendbuf;
+    void *recvbuf;
+    int count;
+    MPI_Datatype datatype;
+    MPI_Op op;
+    std::function<void()> callback; // 完成时调用, 可以为空
+    Fusion_Queue *queue;
+    std::atomic<bool> done{false};
+
+    // 数据所在的地方, 原地调用时就是 recvbuf
+    const void *source() const
     {
-        FT_TOPO = FT_TOPO_raw;
+        return (sendbuf == MPI_IN_PLACE ? recvbuf : sendbuf);
     }
-    if (FT_TOPO.empty())
+};
+
+/**
+ * 小张量的融合队列, 挂在通信域上 (见 comm_object). 放进来的 allreduce 按类型和算子分组, 每组拷进一块复用的融合缓冲区,
+ * 只做一次 FlexTree allreduce, 再拷回各自的 recvbuf, 然后调用回调并标记完成. 每个张量不用再各付一次
+ * get_stages, Send_Ops 和同步的开销.
+ *
+ * 每次融合的字节数不超过 FT_FUSION_BYTES (默认 64MB), 比它大的张量单独做, 不拷贝; 非连续的类型也单独做.
+ * FT_FUSION_CYCLE_US (默认 1000) 大于 0 并且 MPI 提供 MPI_THREAD_MULTIPLE 时由后台线程每个周期处理一次:
+ * 先用一次 MPI_Allreduce 商定所有 rank 都已经放进来的个数, 只处理这些, 所以各个 rank 融合的是同一批;
+ * 队列里攒够 FT_FUSION_BYTES 时不等周期结束. 否则在放进来时 (攒够阈值) 和等待时由调用者的线程处理,
+ * 这时放入和等待都相当于集合操作, 各个 rank 要按同样的顺序调用. 两种方式下各个 rank 放入的顺序都要相同.
+ * 融合的 allreduce 在复制出来的通信域上进行, 用自己的计划缓存和接收缓冲区, 不走分层模式.
+ */
+class Fusion_Queue: public Mpi_Resource
+{
+public:
+    bool initialized = false;
+    std::atomic<size_t> tensors{0}, batches{0}; // 完成的张量数, 实际做的 allreduce 次数
+
+    ~Fusion_Queue()
     {
-        ans = {num_nodes};
+        release();
     }
-    else 
+    // 停下后台线程, 释放复制出来的通信域. 后台线程停下时会通知其他 rank 的后台线程一起停下
+    virtual void release()
     {
-        for (char &i : FT_TOPO)
-        {
-            if (i == ',') i = ' ';
-        }
-        std::istringstream ss(FT_TOPO);
-        while(!ss.eof())
+        if (worker.joinable())
         {
-            ss >> tmp;
-            if (tmp == 1)
             {
-                return {1};
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
             }
-            ans.push_back(tmp);
-            pi *= tmp;
+            wake.notify_all();
+            worker.join();
         }
-        if (pi != num_nodes)
+        if (comm != MPI_COMM_NULL) MPI_Comm_free(&comm);
+    }
+    void init(const MPI_Comm &user_comm)
+    {
+        initialized = true;
+        // 后台线程里不能做集合操作, 在这里先统计好
+        init_local_ranks(user_comm);
+        MPI_Comm_dup(user_comm, &comm);
+        threshold = std::max<size_t>(get_env_size("FT_FUSION_BYTES", 64 << 20), 1);
+        const size_t cycle_us = get_env_size("FT_FUSION_CYCLE_US", 1000);
+        if (cycle_us == 0) return;
+        if (!mpi_thread_multiple())
         {
-            std::cerr << "invalid FT_TOPO " << FT_TOPO << std::endl;
-            exit(1);
+            if (getenv("FT_FUSION_CYCLE_US") != nullptr)
+            {
+                std::cerr << "FT_FUSION_CYCLE_US needs MPI_THREAD_MULTIPLE, the fusion queue runs in the caller's thread" << std::endl;
+            }
+            return;
         }
+        cycle = std::chrono::microseconds(cycle_us);
+        worker = std::thread([this]() { loop(); });
     }
-#ifdef FT_DEBUG
-    std::cout << "FlexTree topo is ";
-    for (auto i:ans)
+    void enqueue(Fusion_Handle *handle)
     {
-        std::cout << i << " ";
+        bool full;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(handle);
+            pending_bytes += bytes(handle);
+            full = (pending_bytes >= threshold);
+        }
+        if (!full) return;
+        if (worker.joinable())
+        {
+            wake.notify_all();
+        }
+        else
+        {
+            process(pending.size());
+        }
     }
-    std::cout << std::endl;
-#endif
-    return ans;
-}
-
-// NOTE: 可别把这个buffer给私自delete了
-static void* flextree_register_the_buffer(size_t _size)
-{
-    static void* buffer;
-    static size_t size = 0;
-    if (_size > size)
+    void wait(Fusion_Handle *handle)
     {
-        if (size != 0)
+        if (worker.joinable())
         {
-            delete[] buffer;
-            buffer = nullptr;
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [handle]() { return handle->done.load(std::memory_order_acquire); });
+        }
+        else if (!handle->done.load(std::memory_order_acquire))
+        {
+            process(pending.size());
         }
-#ifdef FT_DEBUG
-        std::cout << "registered a buffer of " << _size << std::endl;
-#endif
-        buffer = (void*)(new char[_size]);
-        size = _size;
     }
-    return buffer;
-}
+private:
+    MPI_Comm comm = MPI_COMM_NULL;
+    size_t threshold = 0;
+    std::chrono::microseconds cycle{0};
+    std::mutex mutex; // 保护 pending, pending_bytes, stop 以及句柄的 done
+    std::condition_variable wake, finished;
+    std::vector<Fusion_Handle*> pending;
+    size_t pending_bytes = 0;
+    bool stop = false;
+    std::thread worker;
+    Plan_Cache plans;
+    Staging_Buffer fusion_buffer;
 
-// 如果需要原地 ar, 那么将 data 置为 nullptr.
-static void tree_allreduce(const MPI_Datatype &datatype, const MPI_Op &op, const MPI_Comm &comm, const void *data, void *dst, const FlexTree_Context &ft_ctx, const std::vector<size_t> &stages)
-{
-#ifdef FT_DEBUG
-    //std::cout << "FT DEBUG: inside treeallre: op " << op << "; len = " << len << "; total = " << num_nodes << "; datatype = " << datatype << std::endl;
-    std::cout << "LOOK HERE (TMP): " << stages.size();
-#endif
-    if (data == nullptr)
+    static size_t bytes(const Fusion_Handle *handle)
     {
-        data = dst;
+        MPI_Aint lb, extent;
+        MPI_Type_get_extent(handle->datatype, &lb, &extent);
+        return handle->count * extent;
     }
-    //LOG_IF(WARNING, node_label == 0) << "gathering start";
-    Send_Ops send_ops(ft_ctx.num_nodes, ft_ctx.num_lonely, ft_ctx.node_label, stages);
-    Recv_Ops recv_ops(ft_ctx.num_nodes, ft_ctx.num_lonely, ft_ctx.node_label, stages);
-    send_ops.generate_ops();
-    recv_ops.generate_ops();
-    MPI_Comm sub_comm = comm;
-    const size_t MAX_COMM_SIZE = 2 * (ft_ctx.num_split - 1) * (ft_ctx.num_split);
-    size_t request_index = 0;
-    MPI_Request *requests = new MPI_Request[MAX_COMM_SIZE];
-    MPI_Status *status = new MPI_Status[MAX_COMM_SIZE];
-    size_t lonely_request_index = 0;
-    MPI_Request *lonely_requests;
-    int tmp;
-#ifdef SHOW_TIME
-    TIME_RESET();
-#endif
-    if (ft_ctx.node_label < ft_ctx.num_split)
+    // 只有连续的类型才能首尾相接地拷进融合缓冲区
+    static bool fusible(const Fusion_Handle *handle)
     {
-        if (ft_ctx.has_lonely)
+        MPI_Aint lb, extent;
+        int size;
+        MPI_Type_get_extent(handle->datatype, &lb, &extent);
+        MPI_Type_size(handle->datatype, &size);
+        return lb == 0 && extent == size;
+    }
+    void loop()
+    {
+        while (true)
         {
-            // 如果要用, 则必须修改.
-            //lonely_requests = new MPI_Request[ft_ctx.num_lonely << 1];
-            //MPI_Comm_split(comm, 0, ft_ctx.node_label, &sub_comm); // 这个 0 是 magic number, 用来标注本组的颜色.
-            // lonely_request_index = handle_recv(comm, datatype, &(recv_ops.lonely_ops), data + len * type_size, ft_ctx, false, lonely_requests);
+            int state[2];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait_for(lock, cycle, [this]() { return stop || pending_bytes >= threshold; });
+                state[0] = (int)std::min<size_t>(pending.size(), std::numeric_limits<int>::max());
+                state[1] = (stop ? 0 : 1);
+            }
+            // 所有 rank 都已经放进来的个数, 以及有没有 rank 要停下
+            MPI_Allreduce(MPI_IN_PLACE, state, 2, MPI_INT, MPI_MIN, comm);
+            if (state[0] > 0) process(state[0]);
+            if (state[1] == 0) return;
         }
-        for (size_t i = 0; i != stages.size(); i++)
+    }
+    // 处理最早放进来的 n 个. 同一类型和算子的按第一次出现的顺序归为一组, 各个 rank 的分组相同
+    void process(const size_t &n)
+    {
+        std::vector<Fusion_Handle*> batch;
         {
-            // 这一步判断是为什么呢? 是因为, 函数不会试图修改data的内容, 已经reduce的数据将会放在dst中; 而除了第一步之外, 发送的都是reduce后的数据, 所以第一步需要单独提出来.
-            if (i == 0)
+            std::lock_guard<std::mutex> lock(mutex);
+            batch.assign(pending.begin(), pending.begin() + n);
+            pending.erase(pending.begin(), pending.begin() + n);
+            for (auto h : batch)
+            {
+                pending_bytes -= bytes(h);
+            }
+        }
+        std::vector<std::vector<Fusion_Handle*>> groups;
+        for (auto h : batch)
+        {
+            auto g = groups.begin();
+            while (g != groups.end() && !(fusible(h) && fusible(g->front()) && g->front()->datatype == h->datatype && g->front()->op == h->op)) g++;
+            if (g == groups.end())
             {
-                request_index = handle_send(comm, datatype, &(send_ops.ops[i]), data, ft_ctx, requests + request_index); //这里顺便重置了 index
+                groups.push_back({h});
             }
             else
             {
-                request_index = handle_send(comm, datatype, &(send_ops.ops[i]), dst, ft_ctx, requests + request_index); //这里顺便重置了 index
+                g->push_back(h);
             }
-            tmp = handle_recv(comm, datatype, &(recv_ops.ops[i]), recv_buffer, ft_ctx, false, requests + request_index);
-#ifdef FT_DEBUG
-            //std::cout << "FT DEBUG: start to send/recv" << std::endl;
-#endif
-            MPI_Waitall(tmp, requests + request_index, status);
-#ifdef FT_DEBUG
-            //std::cout << "FT DEBUG: complete send/recv" << std::endl;
-#endif
-            if (lonely_request_index == 0 || i != stages.size() - 1)
+        }
+        for (auto &g : groups)
+        {
+            // 按阈值切成若干次 allreduce, 总个数也不能超过 int
+            size_t begin = 0;
+            while (begin < g.size())
             {
-                // 这里判断的原因和上面一样
-                if (i == 0)
-                {
-                    handle_reduce(datatype, op, &(recv_ops.ops[i][0].blocks), recv_buffer, data, dst, ft_ctx, recv_ops.ops[i].size() - 1);
-                }
-                else
+                size_t end = begin + 1, total = bytes(g[begin]);
+                long long count = g[begin]->count;
+                while (end < g.size() && total + bytes(g[end]) <= threshold && count + g[end]->count <= std::numeric_limits<int>::max())
                 {
-                    handle_reduce(datatype, op, &(recv_ops.ops[i][0].blocks), recv_buffer, dst, dst, ft_ctx, recv_ops.ops[i].size() - 1);
+                    total += bytes(g[end]);
+                    count += g[end]->count;
+                    end++;
                 }
+                fuse(g.data() + begin, end - begin, total, count);
+                begin = end;
             }
-            else
-            {
-                MPI_Waitall(lonely_request_index, lonely_requests, status);
-#ifdef SHOW_TIME
-                TIME_LOG_IF(node_label == 0, "node 0 lonely gather finished");
-#endif SHOW_TIME
-                // 如果要用, 则必须修改. handle_reduce(datatype, op, &(recv_ops.ops[i][0].blocks), recv_buffer, data, dst, ft_ctx, recv_ops.ops[i].size() - 1, data + ft_ctx.len * ft_ctx.type_size, ft_ctx.num_lonely);
-            }
-            MPI_Waitall(request_index, requests, status);
-            MPI_Barrier(sub_comm);
         }
-#ifdef SHOW_TIME
-            TIME_LOG_IF(node_label == 0, "(left) FT gather finished");
-#endif SHOW_TIME
-        if (ft_ctx.has_lonely) MPI_Barrier(comm);
-        //LOG_IF(WARNING, node_label == 0) << "gathering done";
-#ifdef SHOW_TIME
-        TIME_RESET();
-#endif
-#ifdef FT_DEBUG
-        std::cout << "-------- FT DEBUG: complete reduce --------" << std::endl;
-#endif
-        if (ft_ctx.has_lonely)
+    }
+    // 对 handles 中的 n 个做一次 allreduce, 只有一个时直接在它自己的缓冲区上做
+    void fuse(Fusion_Handle **handles, const size_t &n, const size_t &total, const int &count)
+    {
+        const MPI_Datatype datatype = handles[0]->datatype;
+        const MPI_Op op = handles[0]->op;
+        if (n == 1)
         {
-            // 测试是否和内存锁有关系
-            //size_t start = len / num_split * node_label;
-            //memcpy(recv_buffer + start, data + start, sizeof(DataType) * len / num_split);
-            //lonely_request_index = handle_send(&(recv_ops.lonely_ops), recv_buffer, len, num_split, node_label, lonely_requests);
-            // end
-            //lonely_request_index = handle_send(&(recv_ops.lonely_ops), data, len, num_split, node_label, lonely_requests);
+            run(handles[0]->sendbuf, handles[0]->recvbuf, count, datatype, op);
         }
-        for (int i = stages.size() - 1; i >= 0; i--)
+        else
         {
-            if (i == 0 && ft_ctx.has_lonely)
+            fusion_buffer.reserve(total);
+            char *p = fusion_buffer.data();
+            for (size_t i = 0; i < n; i++)
             {
-                // 如果要用, 则必须修改. lonely_request_index = handle_send(comm, datatype, &(recv_ops.lonely_ops), data, ft_ctx, lonely_requests);
+                memcpy(p, handles[i]->source(), bytes(handles[i]));
+                p += bytes(handles[i]);
+            }
+            run(MPI_IN_PLACE, fusion_buffer.data(), count, datatype, op);
+            p = fusion_buffer.data();
+            for (size_t i = 0; i < n; i++)
+            {
+                memcpy(handles[i]->recvbuf, p, bytes(handles[i]));
+                p += bytes(handles[i]);
             }
-            request_index = handle_send(comm, datatype, &(recv_ops.ops[i]), dst, ft_ctx, requests);
-            request_index += handle_recv(comm, datatype, &(send_ops.ops[i]), dst, ft_ctx, true, requests + request_index);
-            MPI_Waitall(request_index, requests, status);
-            MPI_Barrier(sub_comm);
         }
-#ifdef SHOW_TIME
-                TIME_LOG_IF(node_label == 0, "(left comm) FT broadcast finished");
-#endif SHOW_TIME
-        if (ft_ctx.has_lonely)
+        batches++;
+        tensors += n;
+        for (size_t i = 0; i < n; i++)
         {
-            MPI_Waitall(lonely_request_index, lonely_requests, status);
-#ifdef SHOW_TIME
-            TIME_LOG_IF(node_label == 0, "node 0 lonely broadcast finished");
-#endif SHOW_TIME
-            MPI_Barrier(comm);
-            delete[] lonely_requests;
-            lonely_requests = nullptr;
+            if (handles[i]->callback) handles[i]->callback();
         }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t i = 0; i < n; i++)
+            {
+                handles[i]->done.store(true, std::memory_order_release);
+            }
+        }
+        finished.notify_all();
     }
-    else 
-    {
-        lonely_requests = new MPI_Request[ft_ctx.num_split << 2];
-        MPI_Comm_split(comm, 1, ft_ctx.node_label, &sub_comm); // 这个 1 是 magic number, 用来标注本组的颜色.
-        //LOG(WARNING) << "LONELY send start";
-        // 如果要用, 则必须修改. lonely_request_index = handle_send(comm, datatype, &(send_ops.lonely_ops), data, ft_ctx, lonely_requests);
-        MPI_Waitall(lonely_request_index, lonely_requests, status);
-#ifdef SHOW_TIME
-        TIME_LOG_IF(true, "(right) lonely send finished");
-#endif SHOW_TIME
-        //LOG(WARNING) << "LONELY send done";
-        MPI_Barrier(comm);
-#ifdef SHOW_TIME
-        TIME_RESET();
-#endif
-        //LOG(WARNING) << "LONELY recv start";
-        // 如果要用, 则必须修改. lonely_request_index = handle_recv(comm, datatype, &(send_ops.lonely_ops), data, ft_ctx, true, lonely_requests);
-        MPI_Waitall(lonely_request_index, lonely_requests, status);
-#ifdef SHOW_TIME
-        TIME_LOG_IF(true, "lonely recv finished");
-#endif SHOW_TIME
-        MPI_Barrier(comm);
-        delete[] lonely_requests;
-        lonely_requests = nullptr;
-    }
-    delete[] requests;
-    delete[] status;
-    requests = nullptr;
-    status = nullptr;
-#ifdef FT_DEBUG
-    std::cout << "-------- FT DEBUG: complete allreduce --------" << std::endl;
-#endif
-    //LOG_IF(WARNING, node_label == 0) << "broadcast done";
-#ifdef FT_DEBUG
-    std::cout << "WHY HERE: " << ((int32_t*)dst)[9] << " " << ((int32_t*)dst)[12] << std::endl;
-#endif
-}
-
-static void ring_allreduce(const MPI_Datatype &datatype, const MPI_Op &op, const MPI_Comm &comm, const void *data, void *dst, const FlexTree_Context &ft_ctx)
-{
-    if (data == nullptr)
-    {
-        data = dst;
-    }
-    const size_t left = (ft_ctx.node_label == 0 ? ft_ctx.num_nodes - 1 : ft_ctx.node_label - 1);
-    const size_t right = (ft_ctx.node_label == ft_ctx.num_nodes - 1 ? 0 : ft_ctx.node_label + 1);
-    size_t block_send = ft_ctx.node_label;
-    size_t block_recv = left;
-    const size_t MAX_COMM_SIZE = 4;
-    size_t request_index = 0;
-    MPI_Request *requests = new MPI_Request[MAX_COMM_SIZE];
-    MPI_Status *status = new MPI_Status[MAX_COMM_SIZE];
-    
-    //LOG_IF(WARNING, node_label == 0) << "gathering start";
-    for (size_t i = 0; i != ft_ctx.num_nodes - 1; i++)
+    // 和 allreduce 一样, 只是调度缓存在队列自己的 plans 里, 用调度自己的接收缓冲区
+    void run(const void *sendbuf, void *recvbuf, const int &count, const MPI_Datatype &datatype, const MPI_Op &op)
     {
-        std::vector<Operation> send_ops = {Operation(right, block_send)};
-        std::vector<Operation> recv_ops = {Operation(left, block_recv)};
-        if (UNLIKELY(i == 0)) // 只有第一次是直接从原始数据里面发
+        int commute;
+        MPI_Op_commutative(op, &commute);
+        if (!commute)
+        {
+            PMPI_Allreduce(sendbuf, recvbuf, count, datatype, op, comm);
+            return;
+        }
+        if (allreduce_direct(sendbuf, recvbuf, count, datatype, op, comm, nullptr)) return;
+        const char *algo = getenv("FT_ALGO");
+        const Plan_Key key = {count, datatype, op, false, (algo == nullptr ? "" : algo), topo_string(), TRANSPORT_P2P, false};
+        Allreduce_Schedule *schedule = plans.find(key);
+        std::unique_ptr<Allreduce_Schedule> uncached;
+        if (schedule != nullptr)
         {
-            request_index = handle_send(comm, datatype, &send_ops, data, ft_ctx, requests);
+            schedule->bind((sendbuf == MPI_IN_PLACE ? nullptr : sendbuf), recvbuf, nullptr, nullptr);
         }
         else
         {
-            request_index = handle_send(comm, datatype, &send_ops, dst, ft_ctx, requests);
+            schedule = create_schedule(sendbuf, recvbuf, count, datatype, op, comm, nullptr, false);
+            if (!plans.insert(key, schedule))
+            {
+                uncached.reset(schedule);
+            }
         }
-        request_index += handle_recv(comm, datatype, &recv_ops, recv_buffer, ft_ctx, false, requests + request_index);
-        MPI_Waitall(request_index, requests, status); 
-        handle_reduce(datatype, op, &(recv_ops[0].blocks), recv_buffer, data, dst, ft_ctx, 1);
-        MPI_Barrier(comm);
-        block_send = (block_send == 0 ? ft_ctx.num_nodes - 1 : block_send - 1);
-        block_recv = (block_recv == 0 ? ft_ctx.num_nodes - 1 : block_recv - 1);
-    }
-    //LOG_IF(WARNING, node_label == 0) << "gathering done";
-    for (size_t i = 0; i != ft_ctx.num_nodes - 1; i++)
-    {
-        std::vector<Operation> send_ops = {Operation(right, block_send)};
-        std::vector<Operation> recv_ops = {Operation(left, block_recv)};
-        request_index = handle_send(comm, datatype, &send_ops, dst, ft_ctx, requests);
-        request_index += handle_recv(comm, datatype, &recv_ops, dst, ft_ctx, true, requests + request_index);
-        MPI_Waitall(request_index, requests, status); 
-        MPI_Barrier(comm);
-        block_send = (block_send == 0 ? ft_ctx.num_nodes - 1 : block_send - 1);
-        block_recv = (block_recv == 0 ? ft_ctx.num_nodes - 1 : block_recv - 1);
+        schedule->start();
+        schedule->advance(true);
     }
-    //LOG_IF(WARNING, node_label == 0) << "broadcast done";
-    delete[] requests;
-    delete[] status;
+};
+
+/**
+ * 把一次 allreduce 放进通信域的融合队列 (见 Fusion_Queue), 参数和 MPI_Iallreduce 相同. 完成之前不能读写 recvbuf, 也不能修改 sendbuf.
+ * 返回的句柄用 fusion_test/fusion_wait 完成, 完成之后由调用者 delete.
+ *
+ * @param callback 完成时调用, 有后台线程时在后台线程中调用, 不能在其中等待融合队列
+ */
+static Fusion_Handle *fusion_enqueue(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm, const std::function<void()> &callback = nullptr)
+{
+    Fusion_Queue &queue = comm_object<Fusion_Queue>(comm);
+    if (!queue.initialized) queue.init(comm);
+    Fusion_Handle *handle = new Fusion_Handle;
+    handle->sendbuf = sendbuf;
+    handle->recvbuf = recvbuf;
+    handle->count = count;
+    handle->datatype = datatype;
+    handle->op = op;
+    handle->callback = callback;
+    handle->queue = &queue;
+    queue.enqueue(handle);
+    return handle;
+}
+
+// 检查融合队列中的 allreduce 是否完成. 没有后台线程时不会推进队列
+static bool fusion_test(Fusion_Handle *handle)
+{
+    return handle->done.load(std::memory_order_acquire);
+}
+
+// 等待融合队列中的 allreduce 完成. 没有后台线程时把队列里所有的都做完
+static void fusion_wait(Fusion_Handle *handle)
+{
+    handle->queue->wait(handle);
+}
+
+// 通信域上融合队列完成的张量数和实际做的 allreduce 次数
+static inline void fusion_stats(const MPI_Comm &comm, size_t &tensors, size_t &batches)
+{
+    const Fusion_Queue &queue = comm_object<Fusion_Queue>(comm);
+    tensors = queue.tensors;
+    batches = queue.batches;
 }
 
 } // end of namespace FlexTree
 
+// 16 位浮点类型, 和 FlexTree 的 allreduce 一起使用. 在 MPI_Init 之后才能用.
+#define FT_FLOAT16 (FlexTree::float16_type())
+#define FT_BFLOAT16 (FlexTree::bfloat16_type())
+
 #ifdef STANDALONE_TEST
 int MPI_Allreduce_FT(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm)
 #else
 static int MPI_Allreduce(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm)
 #endif
 {
-#ifdef FT_DEBUG
-    std::cout << "FlexTree AR called" << std::endl;
-#endif
-    const FlexTree::FlexTree_Context ft_ctx(comm, datatype, count);
-#ifdef FT_DEBUG
-    if (ft_ctx.node_label == ft_ctx.num_nodes - 2) ft_ctx.show_context();
-#endif
+    return FlexTree::allreduce(sendbuf, recvbuf, count, datatype, op, comm);
+}
 
-    if (ft_ctx.num_nodes <= 1)
+/**
+ * 16 位浮点的 allreduce, 同时保留 float 主副本.
+ * reduce 阶段用 16 位传输, 在 float 上累加; 最终结果以 float 写进 master (长度为 count), 并舍入后写进 recvbuf.
+ * 
+ * @param datatype FT_FLOAT16 或者 FT_BFLOAT16
+ */
+static inline int MPI_Allreduce_FT_master(const void *sendbuf, void *recvbuf, float *master, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm)
+{
+    if (!FlexTree::is_half_type(datatype) || master == nullptr)
     {
-        if (sendbuf != MPI_IN_PLACE)
-        {
-            memcpy(recvbuf, sendbuf, count * ft_ctx.type_size);
-        }
-        return 0;
+        std::cerr << "MPI_Allreduce_FT_master needs a 16-bit float datatype and a master buffer." << std::endl;
+        exit(1);
     }
+    return FlexTree::allreduce(sendbuf, recvbuf, count, datatype, op, comm, master);
+}
 
-    FlexTree::recv_buffer = FlexTree::flextree_register_the_buffer(ft_ctx.data_size_aligned * ft_ctx.type_size);
-    auto stages = FlexTree::get_stages(ft_ctx.num_nodes);
-    
-    // MPI_IN_PLACE
-    if (stages[0] != 1)
+// 非阻塞 allreduce 的句柄. 完成之后 MPI_Test_FT/MPI_Wait_FT 会释放它并置为 FT_REQUEST_NULL.
+// 持久化的句柄 (MPI_Allreduce_init_FT) 完成之后保留, 用 MPI_Request_free_FT 释放.
+typedef FlexTree::Allreduce_Request *FT_Request;
+#define FT_REQUEST_NULL nullptr
+
+/**
+ * 非阻塞的 allreduce, 参数和 MPI_Iallreduce 相同. 完成之前不能读写 recvbuf, 也不能修改 sendbuf.
+ * 设置 FT_PROGRESS_THREAD=1 (需要 MPI_THREAD_MULTIPLE) 时由后台线程推进, 否则在 MPI_Test_FT/MPI_Wait_FT 中推进.
+ */
+static inline int MPI_Iallreduce_FT(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm, FT_Request *request)
+{
+    *request = FlexTree::iallreduce(sendbuf, recvbuf, count, datatype, op, comm);
+    return MPI_SUCCESS;
+}
+
+/**
+ * 检查非阻塞 allreduce 是否完成.
+ *
+ * @param flag 完成时置为 1, 同时释放 request
+ */
+static inline int MPI_Test_FT(FT_Request *request, int *flag)
+{
+    if (*request == FT_REQUEST_NULL)
     {
-        if (sendbuf == MPI_IN_PLACE)
-        {
-            FlexTree::tree_allreduce(datatype, op, comm, nullptr, recvbuf, ft_ctx, stages);
-        }
-        else 
-        {
-            FlexTree::tree_allreduce(datatype, op, comm, sendbuf, recvbuf, ft_ctx, stages);
-        }
+        *flag = 1;
+        return MPI_SUCCESS;
     }
-    else
+    *flag = FlexTree::test_request(*request);
+    if (*flag && !(*request)->persistent)
     {
-        if (sendbuf == MPI_IN_PLACE)
-        {
-            FlexTree::ring_allreduce(datatype, op, comm, nullptr, recvbuf, ft_ctx);
-        }
-        else 
-        {
-            FlexTree::ring_allreduce(datatype, op, comm, sendbuf, recvbuf, ft_ctx);
-        }
+        delete *request;
+        *request = FT_REQUEST_NULL;
     }
-    
-#ifdef FT_DEBUG
-    std::cout << "FlexTree AR finished" << std::endl;
-#endif
-    return 0;
+    return MPI_SUCCESS;
+}
+
+// 等待非阻塞 allreduce 完成并释放 request
+static inline int MPI_Wait_FT(FT_Request *request)
+{
+    if (*request == FT_REQUEST_NULL) return MPI_SUCCESS;
+    FlexTree::wait_request(*request);
+    if ((*request)->persistent) return MPI_SUCCESS;
+    delete *request;
+    *request = FT_REQUEST_NULL;
+    return MPI_SUCCESS;
+}
+
+/**
+ * 持久化的 allreduce, 参数和 MPI_Allreduce_init 相同 (没有 info). 用 MPI_Start_FT 开始, MPI_Wait_FT/MPI_Test_FT 完成.
+ * 每次 start 都对同样的 sendbuf/recvbuf 进行; 初始化之后不再分配内存.
+ */
+static inline int MPI_Allreduce_init_FT(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm, FT_Request *request)
+{
+    *request = FlexTree::allreduce_init(sendbuf, recvbuf, count, datatype, op, comm);
+    return MPI_SUCCESS;
+}
+
+// 开始一次持久化的 allreduce, 上一次必须已经完成
+static inline int MPI_Start_FT(FT_Request *request)
+{
+    FlexTree::start_request(*request);
+    return MPI_SUCCESS;
+}
+
+// 释放持久化的 allreduce, 还没完成的话先等它完成
+static inline int MPI_Request_free_FT(FT_Request *request)
+{
+    if (*request == FT_REQUEST_NULL) return MPI_SUCCESS;
+    FlexTree::wait_request(*request);
+    delete *request;
+    *request = FT_REQUEST_NULL;
+    return MPI_SUCCESS;
+}
+
+// 分组 allreduce 的一片, (地址, 元素个数)
+typedef FlexTree::Iovec FT_Iovec;
+
+/**
+ * 分组的 allreduce: iovcnt 片缓冲区首尾相接当作一个向量, 只做一次集合通信, 不拷进一块连续的内存 (见 FlexTree::allreduce_group).
+ * sendiov 和 recviov 对应的片长度相同, 各个 rank 的片数和长度也相同. sendiov 为 nullptr 时在 recviov 上原地进行.
+ */
+static inline int MPI_Allreduce_group_FT(const FT_Iovec *sendiov, const FT_Iovec *recviov, int iovcnt, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm)
+{
+    return FlexTree::allreduce_group(sendiov, recviov, iovcnt, datatype, op, comm);
+}
+
+// 融合队列中的 allreduce 的句柄. 完成之后 MPI_Fusion_test_FT/MPI_Fusion_wait_FT 会释放它并置为 FT_FUSION_NULL.
+typedef FlexTree::Fusion_Handle *FT_Fusion_Handle;
+#define FT_FUSION_NULL nullptr
+
+/**
+ * 把 allreduce 放进融合队列, 和同一通信域上其他同类型同算子的小 allreduce 合成一次做 (见 FlexTree::Fusion_Queue).
+ * 参数和 MPI_Iallreduce 相同, 完成之前不能读写 recvbuf, 也不能修改 sendbuf. 各个 rank 放入的顺序要相同.
+ */
+static inline int MPI_Allreduce_enqueue_FT(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm, FT_Fusion_Handle *handle)
+{
+    *handle = FlexTree::fusion_enqueue(sendbuf, recvbuf, count, datatype, op, comm);
+    return MPI_SUCCESS;
+}
+
+/**
+ * 检查融合队列中的 allreduce 是否完成. 没有后台线程 (FT_FUSION_CYCLE_US=0 或者没有 MPI_THREAD_MULTIPLE) 时不推进队列.
+ *
+ * @param flag 完成时置为 1, 同时释放 handle
+ */
+static inline int MPI_Fusion_test_FT(FT_Fusion_Handle *handle, int *flag)
+{
+    if (*handle == FT_FUSION_NULL)
+    {
+        *flag = 1;
+        return MPI_SUCCESS;
+    }
+    *flag = FlexTree::fusion_test(*handle);
+    if (*flag)
+    {
+        delete *handle;
+        *handle = FT_FUSION_NULL;
+    }
+    return MPI_SUCCESS;
+}
+
+// 等待融合队列中的 allreduce 完成并释放 handle. 没有后台线程时这是集合操作, 各个 rank 要按同样的顺序等待
+static inline int MPI_Fusion_wait_FT(FT_Fusion_Handle *handle)
+{
+    if (*handle == FT_FUSION_NULL) return MPI_SUCCESS;
+    FlexTree::fusion_wait(*handle);
+    delete *handle;
+    *handle = FT_FUSION_NULL;
+    return MPI_SUCCESS;
+}
+
+/**
+ * 马上在 comm 上调优树的拓扑, 之后的阻塞调用按结果选择拓扑; 结果同时写进调优文件 (见 FT_AUTOTUNE_FILE).
+ * 集合操作. 设置 FT_SELECT=autotune 时第一次调用自动做同样的事, 已有调优文件时直接读取.
+ */
+static inline int MPI_Autotune_FT(MPI_Comm comm)
+{
+    FlexTree::autotune(comm);
+    return MPI_SUCCESS;
 }
 
 #endif //end if of check c++
@@ -0,0 +1,131 @@
+#include<iostream>
+#include<sstream>
+#include<vector>
+#include<chrono>
+#include<iomanip>
+#include<string.h>
+#include<stdlib.h>
+#include<mpi.h>
+#include<glog/logging.h>
+#define STANDALONE_TEST
+#include "mpi_mod.hpp"
+
+// 单线程 reduce kernel 的带宽测试, 不需要 mpirun.
+// 对比: naive (逐元素遍历所有来源的普通循环), simd (FlexTree::reduce_range), blocked (FlexTree::reduce_blocked) 以及 blocked + non-temporal store.
+// 带宽按 (width + 1) * size * sizeof(float) 字节计算, 即读所有来源再写一次结果.
+
+static void reduce_naive(const float **src, float *dst, const size_t num_src, const size_t num_elements)
+{
+#pragma omp simd
+    for (size_t i = 0; i < num_elements; ++i)
+    {
+        float acc = src[0][i];
+        for (size_t j = 1; j < num_src; ++j)
+        {
+            acc += src[j][i];
+        }
+        dst[i] = acc;
+    }
+}
+
+template<class F>
+static double measure_gbps(F func, const size_t &width, const size_t &data_len, const int &repeat)
+{
+    func(); // warm up
+    auto time1 = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < repeat; i++)
+    {
+        func();
+    }
+    auto time2 = std::chrono::high_resolution_clock::now();
+    double seconds = std::chrono::duration<double>(time2 - time1).count() / repeat;
+    return (width + 1) * data_len * sizeof(float) / seconds / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    // 命令行参数
+    size_t data_len = 1 << 20; // 每个来源的元素个数
+    int repeat = 10;
+    std::vector<size_t> widths = {2, 4, 8, 12, 16, 28, 32, 48, 64};
+
+    FLAGS_colorlogtostderr = true;
+    FLAGS_logtostderr = true;
+    google::InitGoogleLogging(argv[0]);
+
+    for (auto i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--size") == 0)
+        {
+            i++;
+            CHECK_GE(argc, i);
+            std::istringstream ss(argv[i]);
+            ss >> data_len;
+        }
+        else if (strcmp(argv[i], "--repeat") == 0)
+        {
+            i++;
+            CHECK_GE(argc, i);
+            std::istringstream ss(argv[i]);
+            ss >> repeat;
+        }
+        else if (strcmp(argv[i], "--widths") == 0)
+        {
+            i++;
+            CHECK_GE(argc, i);
+            std::string s = argv[i];
+            for (char &c : s)
+            {
+                if (c == ',') c = ' ';
+            }
+            std::istringstream ss(s);
+            widths.clear();
+            size_t w;
+            while (ss >> w)
+            {
+                CHECK_GE(w, 2);
+                widths.push_back(w);
+            }
+        }
+        else
+        {
+            LOG(FATAL) << "unknown parameter: " << argv[i];
+        }
+    }
+
+    size_t max_width = 0;
+    for (auto w : widths)
+    {
+        max_width = std::max(max_width, w);
+    }
+    std::vector<std::vector<float>> sources(max_width, std::vector<float>(data_len));
+    for (size_t j = 0; j < max_width; j++)
+    {
+        for (size_t i = 0; i < data_len; i++)
+        {
+            sources[j][i] = (i + j) % 17;
+        }
+    }
+    std::vector<float> dst(data_len + 64);
+    float *out = dst.data();
+    const float **src = new const float*[max_width];
+    for (size_t j = 0; j < max_width; j++)
+    {
+        src[j] = sources[j].data();
+    }
+
+    std::cout << "simd level " << FlexTree::simd_level() << ", tile " << FlexTree::reduce_tile_bytes() << " bytes, " << data_len << " floats per source, GB/s:" << std::endl;
+    std::cout << std::setw(6) << "width" << std::setw(10) << "naive" << std::setw(10) << "simd" << std::setw(10) << "blocked" << std::setw(12) << "blocked-nt" << std::endl;
+    for (auto w : widths)
+    {
+        double naive = measure_gbps([&]() { reduce_naive(src, out, w, data_len); }, w, data_len, repeat);
+        double simd = measure_gbps([&]() { FlexTree::reduce_range<FlexTree::Op_Sum>(src, out, w, 0, data_len); }, w, data_len, repeat);
+        double blocked = measure_gbps([&]() { FlexTree::reduce_blocked<FlexTree::Op_Sum>(src, out, w, 0, data_len, false); }, w, data_len, repeat);
+        double blocked_nt = measure_gbps([&]() { FlexTree::reduce_blocked<FlexTree::Op_Sum>(src, out, w, 0, data_len, true); }, w, data_len, repeat);
+        std::cout << std::fixed << std::setprecision(2) << std::setw(6) << w << std::setw(10) << naive << std::setw(10) << simd << std::setw(10) << blocked << std::setw(12) << blocked_nt << std::endl;
+    }
+
+    delete[] src;
+    google::ShutdownGoogleLogging();
+    return 0;
+}
@@ -1,81 +1,23 @@
+// 各项开销的计算见 cost_model.hpp, 这里只是打印出来
 double latency_control_overhead(double Chunk_size, double Tree_width)
 {
-    double lo  = 0.004;
-    double co = 0.0002;
-    double tw = Tree_width;
-    double s = Chunk_size;
-    if(tw > 9)
-    {
-        double cost = 2 * lo
-                      + s * (tw - 9) * co;
-        cout << "the latency & control overhead of the layer is: " << cost << endl;
-        return cost;
-    }
-    else
-    {
-        double cost = 2 * lo;
-        cout << "the latency & control overhead of the layer is: " << cost << endl;
-        return cost;
-    }
+    double cost = cost_model::latency_control_overhead(Chunk_size, Tree_width);
+    cout << "the latency & control overhead of the layer is: " << cost << endl;
+    return cost;
 }
 
 double bandwidth_calculation_overhead(int Total_nodes, double Chunk_size)
 {
-    double bo = 0.0068;
-    double s = Chunk_size;
-    double n = Total_nodes;
-    double cost = (((n - 1) / n) * s) * bo;
+    double cost = cost_model::bandwidth_calculation_overhead(Total_nodes, Chunk_size);
     cout << "the overhead of the bandwidth & calculation part is: " << cost << endl;
     return cost;
 }
 
-double memory_read_write_overhead(vector<int> tree_structure, int Tree_height, int Total_nodes, double Chunk_size)
+double memory_read_write_overhead(vector<int> tree_structure, int Total_nodes, double Chunk_size)
 {
-    vector<int> tree = tree_structure;
-    int th = Tree_height;
-    double s = Chunk_size;
-    double o = 0.0004;
-    int steps;
-    int n = Total_nodes;
-    switch (th)
-    {
-        case 1:
-            steps = n + 1;
-            cout << "the overhead of the memory w / r part is: "<< ((steps * s) / n) * o << endl;
-            return ((steps * s) / n) * o;
-        case 2:
-            steps = n + 2 * tree[0] + 1;
-            cout << "the overhead of the memory w / r part is: "<< ((steps * s) / n) * o << endl;
-            return ((steps * s) / n) * o;
-        case 3:
-            steps = n + 2 * tree[0] * tree[1] + 2 * tree[0] + 1;
-            cout << "the overhead of the memory w / r part is: "<< ((steps * s) / n) * o << endl;
-            return ((steps * s) / n) * o;
-        case 4:
-            steps = n + 2 * tree[0] * tree[1] * tree[2] + 2 * tree[0] * tree[1] + 2 * tree[0] + 1;
-            cout << "the overhead of the memory w / r part is: "<< ((steps * s) / n) * o << endl;
-            return ((steps * s) / n) * o;
-        case 5:
-            steps = n + 2 * tree[0] * tree[1] * tree[2] * tree[3] + 2 * tree[0] * tree[1] * tree[2] + 2 * tree[0] * tree[1] + 2 * tree[0] + 1;
-            cout << "the overhead of the memory w / r part is: "<< ((steps * s) / n) * o << endl;
-            return ((steps * s) / n) * o;
-        case 6:
-            steps = n + 2 * tree[0] * tree[1] * tree[2] * tree[3] * tree[4] + 2 * tree[0] * tree[1] * tree[2] * tree[3] + 2 * tree[0] * tree[1] * tree[2] + 2 * tree[0] * tree[1] + 2 * tree[0] + 1;
-            cout << "the overhead of the memory w / r part is: "<< ((steps * s) / n) * o << endl;
-            return ((steps * s) / n) * o;
-        case 7:
-            steps = n + 2 * tree[0] * tree[1] * tree[2] * tree[3] * tree[4] * tree[5] + 2 * tree[0] * tree[1] * tree[2] * tree[3] * tree[4] + 2 * tree[0] * tree[1] * tree[2] * tree[3] + 2 * tree[0] * tree[1] * tree[2] + 2 * tree[0] * tree[1] + 2 * tree[0] + 1;
-            cout << "the overhead of the memory w / r part is: "<< ((steps * s) / n) * o << endl;
-            return ((steps * s) / n) * o;
-        case 8:
-            steps = n + 2 * tree[0] * tree[1] * tree[2] * tree[3] * tree[4] * tree[5] * tree[6] + 2 * tree[0] * tree[1] * tree[2] * tree[3] * tree[4] * tree[5] + 2 * tree[0] * tree[1] * tree[2] * tree[3] * tree[4] + 2 * tree[0] * tree[1] * tree[2] * tree[3] + 2 * tree[0] * tree[1] * tree[2] + 2 * tree[0] * tree[1] + 2 * tree[0] + 1;
-            cout << "the overhead of the memory w / r part is: "<< ((steps * s) / n) * o << endl;
-            return ((steps * s) / n) * o;
-        case 9:
-            steps = n + 2 * tree[0] * tree[1] * tree[2] * tree[3] * tree[4] * tree[5] * tree[6] * tree[7] + 2 * tree[0] * tree[1] * tree[2] * tree[3] * tree[4] * tree[5] * tree[6] + 2 * tree[0] * tree[1] * tree[2] * tree[3] * tree[4] * tree[5] + 2 * tree[0] * tree[1] * tree[2] * tree[3] * tree[4] + 2 * tree[0] * tree[1] * tree[2] * tree[3] + 2 * tree[0] * tree[1] * tree[2] + 2 * tree[0] * tree[1] + 2 * tree[0] + 1;
-            cout << "the overhead of the memory w / r part is: "<< ((steps * s) / n) * o << endl;
-            return ((steps * s) / n) * o;
-    }
+    double cost = cost_model::memory_read_write_overhead(tree_structure, Total_nodes, Chunk_size);
+    cout << "the overhead of the memory w / r part is: "<< cost << endl;
+    return cost;
 }
 
 
@@ -86,12 +28,12 @@ void CostModel(vector<vector<int>> tree, int Total_nodes, double Chunk_size)
     for(int i = 0; i < tree.size(); i++)
     {
         cout << "*------------start analysing one single structure---------*" << endl;
-        double cost;
+        double cost = 0;
         for (int j = 0; j < tree[i].size(); j++) {
             cout << "the width of the layer is: " << tree[i][j] << endl;
             cost += latency_control_overhead(100, tree[i][j]);
         }
-        cost += memory_read_write_overhead(tree[i], tree[i].size(), Total_nodes, Chunk_size);
+        cost += memory_read_write_overhead(tree[i], Total_nodes, Chunk_size);
         cost += bandwidth_calculation_overhead(Total_nodes, Chunk_size);
         cout << "the single cost should be: " << cost << endl;
         if(cost < cost_output)
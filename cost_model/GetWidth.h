@@ -3,47 +3,11 @@ using namespace std;
 #include "GetPrimeFactor.h"
 #include <algorithm>
 #include<cmath>
+#include "cost_model.hpp"
 
-vector<int> tree_now;
-vector<vector<int>> ans;
-
-void _getWidth(int numberNow)
-{
-    if (numberNow == 0) return;
-    if (numberNow == 1)
-    {
-        if (tree_now.size() == 1)
-        {
-            tree_now.push_back(1);
-            vector<int>ps;
-            ps.push_back(1);
-            ps.push_back(tree_now[0]);
-            ans.push_back(ps);
-        }
-        ans.push_back(tree_now);
-        return;
-    }
-    else
-    {
-        int upper = numberNow;
-        upper = max(2, upper);
-        for (int i = 2; i <= upper; i++)
-        {
-            if (numberNow % i == 0)
-            {
-                tree_now.push_back(i);
-                _getWidth(numberNow / i);
-                tree_now.pop_back();
-            }
-        }
-    }
-}
-
+// 见 cost_model.hpp
 vector<vector<int>> getWidth(int numberOfProcess) {
-    ans.clear();
-    tree_now.clear();
-    _getWidth(numberOfProcess);
-    return ans;
+    return cost_model::get_width(numberOfProcess);
 }
 
 
@@ -0,0 +1,163 @@
+// FlexTree 的代价模型, 只有头文件, 不输出任何东西. 估计每种树结构做一次 allreduce 的开销, 选出最好的一种.
+// allreduce_over_mpi/mpi_mod.hpp 在没有设置 FT_TOPO 时用它选择各层宽度, main.cpp 用它打印分析结果
+#ifndef FLEXTREE_COST_MODEL
+#define FLEXTREE_COST_MODEL
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <limits>
+#include <stddef.h>
+
+namespace cost_model
+{
+
+// 一层的延迟和控制开销. 宽度超过 9 之后, 每多一个节点增加一份和块大小成正比的开销
+inline double latency_control_overhead(double chunk_size, double tree_width)
+{
+    const double lo = 0.004;
+    const double co = 0.0002;
+    if (tree_width > 9)
+    {
+        return 2 * lo + chunk_size * (tree_width - 9) * co;
+    }
+    return 2 * lo;
+}
+
+// 带宽和计算的开销, 和树的结构无关
+inline double bandwidth_calculation_overhead(int total_nodes, double chunk_size)
+{
+    const double bo = 0.0068;
+    const double n = total_nodes;
+    return (((n - 1) / n) * chunk_size) * bo;
+}
+
+/**
+ * 读写内存的开销. 读写的次数是 n + 2 * (tree[0] + tree[0] * tree[1] + ... + tree[0] * ... * tree[h - 2]) + 1
+ * @param tree 从第一层开始的各层宽度, 树高就是它的长度
+ */
+inline double memory_read_write_overhead(const std::vector<int> &tree, int total_nodes, double chunk_size)
+{
+    const double o = 0.0004;
+    double steps = total_nodes + 1;
+    double prefix = 1;
+    for (size_t i = 0; i + 1 < tree.size(); i++)
+    {
+        prefix *= tree[i];
+        steps += 2 * prefix;
+    }
+    return ((steps * chunk_size) / total_nodes) * o;
+}
+
+// 一种树结构的总开销
+inline double tree_cost(const std::vector<int> &tree, int total_nodes, double chunk_size)
+{
+    double cost = 0;
+    for (auto width : tree)
+    {
+        cost += latency_control_overhead(chunk_size, width);
+    }
+    cost += memory_read_write_overhead(tree, total_nodes, chunk_size);
+    cost += bandwidth_calculation_overhead(total_nodes, chunk_size);
+    return cost;
+}
+
+inline void get_width(int number_now, std::vector<int> &tree_now, std::vector<std::vector<int>> &ans)
+{
+    if (number_now == 0) return;
+    if (number_now == 1)
+    {
+        if (tree_now.size() == 1)
+        {
+            ans.push_back({1, tree_now[0]});
+            tree_now.push_back(1);
+            ans.push_back(tree_now);
+            tree_now.pop_back();
+            return;
+        }
+        ans.push_back(tree_now);
+        return;
+    }
+    for (int i = 2; i <= number_now; i++)
+    {
+        if (number_now % i == 0)
+        {
+            tree_now.push_back(i);
+            get_width(number_now / i, tree_now, ans);
+            tree_now.pop_back();
+        }
+    }
+}
+
+// 所有积为 number_of_process 的有序因数分解. 只有一层时写成 {1, n} 和 {n, 1} 两种
+inline std::vector<std::vector<int>> get_width(int number_of_process)
+{
+    std::vector<int> tree_now;
+    std::vector<std::vector<int>> ans;
+    get_width(number_of_process, tree_now, ans);
+    return ans;
+}
+
+// 分支定界: 已经选了 tree 中的几层, 剩下的积是 rest. prefix 是除了最后一层以外各层宽度的积, partial 是已选各层的开销
+inline void search_width(int total_nodes, double chunk_size, int rest, std::vector<int> &tree, double partial, double prefix, std::vector<int> &best, double &best_cost)
+{
+    const double lo = latency_control_overhead(chunk_size, 0);
+    for (int i = 2; i <= rest; i++)
+    {
+        if (rest % i != 0) continue;
+        tree.push_back(i);
+        if (rest == i)
+        {
+            const double cost = tree_cost(tree, total_nodes, chunk_size);
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best = tree;
+            }
+        }
+        else
+        {
+            // 再加一层至少多一份延迟, 和这一层带来的内存读写
+            const double next_prefix = prefix * i;
+            const double next = partial + latency_control_overhead(chunk_size, i) + 2 * next_prefix * chunk_size / total_nodes * 0.0004;
+            if (next + lo < best_cost)
+            {
+                search_width(total_nodes, chunk_size, rest / i, tree, next, next_prefix, best, best_cost);
+            }
+        }
+        tree.pop_back();
+    }
+}
+
+/**
+ * 在 get_width 的候选中找开销最小的各层宽度, 宽度为 1 的层不算 (只有一层时就是 {n}).
+ * 搜索时剪掉已经不可能更好的分支, 不需要列出所有候选.
+ * @param chunk_size 消息大小, 单位是 MB
+ */
+inline std::vector<int> best_width(int total_nodes, double chunk_size)
+{
+    if (total_nodes < 2) return {total_nodes};
+    std::vector<int> best = {total_nodes}, tree;
+    double best_cost = tree_cost(best, total_nodes, chunk_size);
+    search_width(total_nodes, chunk_size, total_nodes, tree, 0, 1, best, best_cost);
+    return best;
+}
+
+// best_width 的结果按 (节点数, 消息大小所在的 2 的幂区间) 缓存, 按区间下界的大小计算. 可以在多个线程中调用
+inline std::vector<int> cached_best_width(int total_nodes, size_t bytes)
+{
+    static std::mutex mutex;
+    static std::map<std::pair<int, int>, std::vector<int>> cache;
+    int bucket = 0;
+    while (bucket < 63 && (bytes >> (bucket + 1)) != 0) bucket++;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto i = cache.find({total_nodes, bucket});
+    if (i != cache.end()) return i->second;
+    const double chunk_size = (double)((size_t)1 << bucket) / (1 << 20);
+    return cache[{total_nodes, bucket}] = best_width(total_nodes, chunk_size);
+}
+
+} // namespace cost_model
+
+#endif